@@ -5,33 +5,60 @@
 #include "log.h"
 #include "serial.h"
 
-#define KMALLOC_MINSIZE		16
+//Small requests are served from per size-class slabs (a 4K page carved into equal chunks).
+//Chunk sizes include the MallocHeader. Anything bigger goes to the page-granular path.
+#define KMALLOC_CLASS_COUNT     9
+#define KMALLOC_MAX_CLASS_SIZE  2048
+
+//A free chunk keeps its MallocHeader (used = 0) and stores the free list link right after it.
+typedef struct SlabChunk
+{
+    struct MallocHeader header;
+    struct SlabChunk* next;
+} SlabChunk;
+
+//Header of a free run of kernel heap pages. Runs are kept sorted by address so neighbours can be merged.
+typedef struct FreeRun
+{
+    uint32_t page_count;
+    struct FreeRun* next;
+} FreeRun;
 
 extern uint32_t *g_kernel_page_directory;
 
 static char *g_kernel_heap = NULL;
 static uint32_t g_kernel_heap_used = 0;
 
+static const uint32_t g_class_sizes[KMALLOC_CLASS_COUNT] = {16, 32, 64, 128, 256, 512, 768, 1024, 2048};
+static SlabChunk* g_class_free[KMALLOC_CLASS_COUNT];
+
+static FreeRun* g_free_runs = NULL;
+
 
 void initialize_kernel_heap()
 {
     g_kernel_heap = (char *) KERN_HEAP_BEGIN;
 
-    ksbrk_page(1);
+    for (int i = 0; i < KMALLOC_CLASS_COUNT; ++i)
+    {
+        g_class_free[i] = NULL;
+    }
+
+    g_free_runs = NULL;
 }
 
 void *ksbrk_page(int n)
 {
-    struct MallocHeader *chunk;
+    char *pages;
     uint32_t p_addr;
     int i;
 
-    if ((g_kernel_heap + (n * PAGESIZE_4K)) > (char *) KERN_HEAP_END) {
+    if ((g_kernel_heap + (n * PAGESIZE_4K)) > (char *) KERN_WINDOW) {
         //Screen_PrintF("ERROR: ksbrk(): no virtual memory left for kernel heap !\n");
         return (char *) -1;
     }
 
-    chunk = (struct MallocHeader *) g_kernel_heap;
+    pages = g_kernel_heap;
 
     for (i = 0; i < n; i++)
     {
@@ -48,76 +75,184 @@ void *ksbrk_page(int n)
         g_kernel_heap += PAGESIZE_4K;
     }
 
-    chunk->size = PAGESIZE_4K * n;
-    chunk->used = 0;
+    return pages;
+}
+
+static int get_size_class(uint32_t realsize)
+{
+    for (int i = 0; i < KMALLOC_CLASS_COUNT; ++i)
+    {
+        if (realsize <= g_class_sizes[i])
+        {
+            return i;
+        }
+    }
 
-    return chunk;
+    return -1;
 }
 
-void *kmalloc(uint32_t size)
+//First-fit over previously released runs, otherwise grow the heap.
+static char *acquire_pages(uint32_t page_count)
 {
-    if (size == 0)
+    FreeRun* previous = NULL;
+    FreeRun* run = g_free_runs;
+
+    while (run)
     {
-        return 0;
+        if (run->page_count >= page_count)
+        {
+            if (run->page_count > page_count)
+            {
+                FreeRun* rest = (FreeRun*)((char*)run + page_count * PAGESIZE_4K);
+                rest->page_count = run->page_count - page_count;
+                rest->next = run->next;
+
+                if (previous)
+                {
+                    previous->next = rest;
+                }
+                else
+                {
+                    g_free_runs = rest;
+                }
+            }
+            else
+            {
+                if (previous)
+                {
+                    previous->next = run->next;
+                }
+                else
+                {
+                    g_free_runs = run->next;
+                }
+            }
+
+            return (char*)run;
+        }
+
+        previous = run;
+        run = run->next;
     }
 
-    unsigned long realsize;
-    struct MallocHeader *chunk, *other;
+    char* pages = ksbrk_page(page_count);
+    if ((int)pages == -1)
+    {
+        PANIC("kmalloc(): no memory left for kernel !\nSystem halted\n");
+
+        return NULL;
+    }
 
-    if ((realsize = sizeof(struct MallocHeader) + size) < KMALLOC_MINSIZE)
+    return pages;
+}
+
+static void release_pages(char *pages, uint32_t page_count)
+{
+    FreeRun* run = (FreeRun*)pages;
+    run->page_count = page_count;
+
+    FreeRun* previous = NULL;
+    FreeRun* next = g_free_runs;
+
+    while (next && next < run)
     {
-        realsize = KMALLOC_MINSIZE;
+        previous = next;
+        next = next->next;
     }
 
-    chunk = (struct MallocHeader *) KERN_HEAP_BEGIN;
-    while (chunk->used || chunk->size < realsize)
+    //Merge with next run
+    if (next && (char*)run + run->page_count * PAGESIZE_4K == (char*)next)
     {
-        if (chunk->size == 0)
-        {
-            printkf("\nPANIC: kmalloc(): corrupted chunk on %x with null size (heap %x) !\nSystem halted\n", chunk, g_kernel_heap);
+        run->page_count += next->page_count;
+        run->next = next->next;
+    }
+    else
+    {
+        run->next = next;
+    }
 
-            PANIC("kmalloc()");
+    //Merge with previous run
+    if (previous && (char*)previous + previous->page_count * PAGESIZE_4K == (char*)run)
+    {
+        previous->page_count += run->page_count;
+        previous->next = run->next;
+    }
+    else if (previous)
+    {
+        previous->next = run;
+    }
+    else
+    {
+        g_free_runs = run;
+    }
+}
 
-            return 0;
-        }
+//Carves a fresh page into chunks of the class and pushes them to its free list.
+static void refill_class(int size_class)
+{
+    uint32_t chunk_size = g_class_sizes[size_class];
+
+    char* page = acquire_pages(1);
+    if (NULL == page)
+    {
+        return;
+    }
+
+    for (uint32_t offset = 0; offset + chunk_size <= PAGESIZE_4K; offset += chunk_size)
+    {
+        SlabChunk* chunk = (SlabChunk*)(page + offset);
+        chunk->header.size = chunk_size;
+        chunk->header.used = 0;
+        chunk->next = g_class_free[size_class];
+        g_class_free[size_class] = chunk;
+    }
+}
+
+void *kmalloc(uint32_t size)
+{
+    if (size == 0)
+    {
+        return 0;
+    }
 
-        chunk = (struct MallocHeader *)((char *)chunk + chunk->size);
+    uint32_t realsize = sizeof(struct MallocHeader) + size;
+    struct MallocHeader *chunk;
 
-        if (chunk == (struct MallocHeader *) g_kernel_heap)
+    int size_class = get_size_class(realsize);
+
+    if (size_class >= 0)
+    {
+        if (NULL == g_class_free[size_class])
         {
-            if ((int)(ksbrk_page((realsize / PAGESIZE_4K) + 1)) < 0)
-            {
-                PANIC("kmalloc(): no memory left for kernel !\nSystem halted\n");
+            refill_class(size_class);
 
+            if (NULL == g_class_free[size_class])
+            {
                 return 0;
             }
         }
-        else if (chunk > (struct MallocHeader *) g_kernel_heap)
-        {
-            printkf("\nPANIC: kmalloc(): chunk on %x while heap limit is on %x !\nSystem halted\n", chunk, g_kernel_heap);
 
-            PANIC("kmalloc()");
+        SlabChunk* slab_chunk = g_class_free[size_class];
+        g_class_free[size_class] = slab_chunk->next;
 
-            return 0;
-        }
-    }
-
-
-    if (chunk->size - realsize < KMALLOC_MINSIZE)
-    {
-        chunk->used = 1;
+        chunk = &slab_chunk->header;
     }
     else
     {
-        other = (struct MallocHeader *)((char *) chunk + realsize);
-        other->size = chunk->size - realsize;
-        other->used = 0;
+        uint32_t page_count = PAGE_COUNT(realsize);
+
+        chunk = (struct MallocHeader *) acquire_pages(page_count);
+        if (NULL == chunk)
+        {
+            return 0;
+        }
 
-        chunk->size = realsize;
-        chunk->used = 1;
+        chunk->size = page_count * PAGESIZE_4K;
     }
 
-    g_kernel_heap_used += realsize;
+    chunk->used = 1;
+
+    g_kernel_heap_used += chunk->size;
 
     return (char *) chunk + sizeof(struct MallocHeader);
 }
@@ -129,46 +264,79 @@ void kfree(void *v_addr)
         return;
     }
 
-    struct MallocHeader *chunk, *other;
+    struct MallocHeader *chunk;
 
     chunk = (struct MallocHeader *)((uint32_t)v_addr - sizeof(struct MallocHeader));
+
+    if (chunk->used == 0)
+    {
+        printkf("\nkfree(): double free on %x !\n", v_addr);
+        return;
+    }
+
     chunk->used = 0;
 
-    g_kernel_heap_used -= chunk->size;
+    uint32_t chunk_size = chunk->size;
+
+    g_kernel_heap_used -= chunk_size;
 
-    //Merge free block with next free block
-    while ((other = (struct MallocHeader *)((char *)chunk + chunk->size))
-           && other < (struct MallocHeader *)g_kernel_heap
-           && other->used == 0)
+    if (chunk_size <= KMALLOC_MAX_CLASS_SIZE)
     {
-        chunk->size += other->size;
+        int size_class = get_size_class(chunk_size);
+
+        SlabChunk* slab_chunk = (SlabChunk*)((char*)v_addr - sizeof(struct MallocHeader));
+        slab_chunk->next = g_class_free[size_class];
+        g_class_free[size_class] = slab_chunk;
+    }
+    else
+    {
+        release_pages((char*)chunk, chunk_size / PAGESIZE_4K);
     }
 }
 
-static void sbrk_page(Process* process, int page_count)
+//Page aligned memory without a header. It must be released with kfree_pages and the same page_count.
+void *kmalloc_pages(uint32_t page_count)
 {
-    if (page_count > 0)
+    char* pages = acquire_pages(page_count);
+
+    if (pages)
     {
-        for (int i = 0; i < page_count; ++i)
-        {
-            if ((process->brk_next_unallocated_page_begin + PAGESIZE_4K) > (char*)(MEMORY_END - PAGESIZE_4K))
-            {
-                return;
-            }
+        g_kernel_heap_used += page_count * PAGESIZE_4K;
+    }
 
-            uint32_t p_addr = vmm_acquire_page_frame_4k();
+    return pages;
+}
 
-            if ((int)(p_addr) < 0)
-            {
-                //PANIC("sbrk_page(): no free page frame available !");
-                return;
-            }
+void kfree_pages(void *pages, uint32_t page_count)
+{
+    if (pages == (void*)0)
+    {
+        return;
+    }
+
+    g_kernel_heap_used -= page_count * PAGESIZE_4K;
+
+    release_pages((char*)pages, page_count);
+}
 
-            vmm_add_page_to_pd(process->brk_next_unallocated_page_begin, p_addr, PG_USER | PG_OWNED);
+//Growing only reserves the pages in the heap area. They are backed on first touch by the page fault handler.
+static BOOL sbrk_page(Process* process, int page_count)
+{
+    BOOL result = TRUE;
 
-            SET_PAGEFRAME_USED(process->mmapped_virtual_memory, PAGE_INDEX_4K((uint32_t)process->brk_next_unallocated_page_begin));
+    if (page_count > 0)
+    {
+        uint32_t begin = (uint32_t)process->brk_next_unallocated_page_begin;
 
-            process->brk_next_unallocated_page_begin += PAGESIZE_4K;
+        //Stop at the end of memory or at an mmapped area
+        if ((uint32_t)page_count > (MEMORY_END - PAGESIZE_4K - begin) / PAGESIZE_4K ||
+            vmm_vma_intersects(process, begin, begin + page_count * PAGESIZE_4K))
+        {
+            result = FALSE;
+        }
+        else
+        {
+            process->brk_next_unallocated_page_begin += page_count * PAGESIZE_4K;
         }
     }
     else if (page_count < 0)
@@ -183,23 +351,42 @@ static void sbrk_page(Process* process, int page_count)
 
                 //This also releases the page frame
                 vmm_remove_page_from_pd(process->brk_next_unallocated_page_begin);
-
-                SET_PAGEFRAME_UNUSED(process->mmapped_virtual_memory, (uint32_t)process->brk_next_unallocated_page_begin);
             }
         }
     }
+
+    if (process->heap_vma)
+    {
+        vmm_vma_resize(process, process->heap_vma, process->heap_vma->start, (uint32_t)process->brk_next_unallocated_page_begin);
+    }
+
+    return result;
 }
 
-void initialize_program_break(Process* process, uint32_t size)
+//If populate is FALSE, the caller maps the image lazily
+void initialize_program_break(Process* process, uint32_t size, BOOL populate)
 {
     process->brk_begin = (char*) USER_OFFSET;
     process->brk_end = process->brk_begin;
     process->brk_next_unallocated_page_begin = process->brk_begin;
 
+    process->heap_vma = vmm_vma_add(process, USER_OFFSET, USER_OFFSET, VMA_ANONYMOUS | VMA_HEAP);
+
     //Userland programs (their code, data,..) start from USER_OFFSET
     //Lets allocate some space for them by moving program break.
 
     sbrk(process, size);
+
+    //The image is not part of the heap area
+    vmm_vma_resize(process, process->heap_vma, (uint32_t)process->brk_next_unallocated_page_begin, process->heap_vma->end);
+
+    if (populate)
+    {
+        //The loader copies the image in while another thread is current, so this part cannot be faulted in
+        uint32_t image_pages = (process->brk_next_unallocated_page_begin - process->brk_begin) / PAGESIZE_4K;
+
+        vmm_populate_memory(process, USER_OFFSET, image_pages);
+    }
 }
 
 void *sbrk(Process* process, int n_bytes)
@@ -215,13 +402,16 @@ void *sbrk(Process* process, int n_bytes)
             int bytesNeededInNewPages = n_bytes - remainingInThePage;
             int neededNewPageCount = ((bytesNeededInNewPages-1) / PAGESIZE_4K) + 1;
 
-            uint32_t freePages = vmm_get_free_page_count();
-            if ((uint32_t)neededNewPageCount + 1 > freePages)
+            //Pages are backed lazily, so only reject what could never fit
+            if ((uint32_t)neededNewPageCount + 1 > vmm_get_total_page_count())
             {
                 return (void*)-1;
             }
 
-            sbrk_page(process, neededNewPageCount);
+            if (FALSE == sbrk_page(process, neededNewPageCount))
+            {
+                return (void*)-1;
+            }
         }
     }
     else if (n_bytes < 0)
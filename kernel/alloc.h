@@ -8,8 +8,10 @@ void initialize_kernel_heap();
 void *ksbrk_page(int n);
 void *kmalloc(uint32_t size);
 void kfree(void *v_addr);
+void *kmalloc_pages(uint32_t page_count);
+void kfree_pages(void *pages, uint32_t page_count);
 
-void initialize_program_break(Process* process, uint32_t size);
+void initialize_program_break(Process* process, uint32_t size, BOOL populate);
 void *sbrk(Process* process, int n_bytes);
 
 uint32_t get_kernel_heap_used();
@@ -0,0 +1,295 @@
+#include "benchmark.h"
+#include "alloc.h"
+#include "timer.h"
+#include "fs.h"
+
+#define BENCHMARK_BUFFER_SIZE   (1024 * 1024)
+#define BENCHMARK_TARGET_BYTES  (8 * 1024 * 1024)
+
+#define BENCHMARK_SEEK_DIRECTORY    "/initrd"
+#define BENCHMARK_SEEK_COUNT        512
+#define BENCHMARK_SEEK_READ_SIZE    4096
+#define BENCHMARK_SEQUENTIAL_CHUNK  (64 * 1024)
+
+typedef enum MemoryOperation
+{
+    MO_MEMCPY,
+    MO_MEMSET,
+    MO_MEMMOVE
+} MemoryOperation;
+
+static const char* g_operation_names[] = {"memcpy", "memset", "memmove"};
+
+static const uint32_t g_sizes[] = {64, 4096, 65536, 1024 * 1024};
+
+//dest and src misalignments
+static const uint32_t g_alignments[][2] = {{0, 0}, {1, 0}, {3, 1}};
+
+//Returns throughput in MB/s
+static uint32_t run(MemoryOperation operation, uint8_t* dest, uint8_t* src, uint32_t size)
+{
+    uint32_t iterations = BENCHMARK_TARGET_BYTES / size;
+
+    uint32_t start = get_uptime_milliseconds();
+
+    for (uint32_t i = 0; i < iterations; ++i)
+    {
+        switch (operation)
+        {
+        case MO_MEMCPY:
+            memcpy(dest, src, size);
+            break;
+        case MO_MEMSET:
+            memset(dest, (uint8_t)i, size);
+            break;
+        case MO_MEMMOVE:
+            //overlapping, backwards copy
+            memmove(src + 8, src, size);
+            break;
+        }
+    }
+
+    uint32_t elapsed = get_uptime_milliseconds() - start;
+
+    if (elapsed == 0)
+    {
+        elapsed = 1;
+    }
+
+    uint32_t kbytes = (iterations * size) / 1024;
+
+    return (kbytes * 1000 / 1024) / elapsed;
+}
+
+//Runs memcpy/memset/memmove over several sizes and alignments and writes a MB/s report to buffer.
+//Interrupts are enabled while running since timing depends on the timer tick.
+uint32_t benchmark_memory(char* buffer, uint32_t buffer_size)
+{
+    uint8_t* dest = kmalloc(BENCHMARK_BUFFER_SIZE + 32);
+    uint8_t* src = kmalloc(BENCHMARK_BUFFER_SIZE + 32);
+
+    if (NULL == dest || NULL == src)
+    {
+        kfree(dest);
+        kfree(src);
+        return 0;
+    }
+
+    memset(src, 0xAB, BENCHMARK_BUFFER_SIZE + 32);
+
+    BOOL interrupts_were_enabled = is_interrupts_enabled();
+
+    enable_interrupts();
+
+    //align bases to 16 bytes so misalignment below is exact
+    uint8_t* dest_base = (uint8_t*)(((uint32_t)dest + 15) & ~15);
+    uint8_t* src_base = (uint8_t*)(((uint32_t)src + 15) & ~15);
+
+    uint32_t char_index = 0;
+    char_index += sprintf(buffer + char_index, buffer_size - char_index, "op size dst+ src+ MB/s\n");
+
+    for (uint32_t op = MO_MEMCPY; op <= MO_MEMMOVE; ++op)
+    {
+        for (uint32_t s = 0; s < sizeof(g_sizes) / sizeof(g_sizes[0]); ++s)
+        {
+            for (uint32_t a = 0; a < sizeof(g_alignments) / sizeof(g_alignments[0]); ++a)
+            {
+                uint32_t size = g_sizes[s];
+
+                //memmove shifts the source forward by 8 bytes, leave room for it
+                if (op == MO_MEMMOVE && size == BENCHMARK_BUFFER_SIZE)
+                {
+                    size -= 16;
+                }
+
+                if (buffer_size - char_index < 64)
+                {
+                    break;
+                }
+
+                uint32_t mbps = run(op, dest_base + g_alignments[a][0], src_base + g_alignments[a][1], size);
+
+                char_index += sprintf(buffer + char_index, buffer_size - char_index, "%s %d %d %d %d\n",
+                                      g_operation_names[op], size, g_alignments[a][0], g_alignments[a][1], mbps);
+            }
+        }
+    }
+
+    if (!interrupts_were_enabled)
+    {
+        disable_interrupts();
+    }
+
+    kfree(dest);
+    kfree(src);
+
+    return char_index;
+}
+
+static uint64_t read_tsc()
+{
+    uint64_t value;
+    asm volatile("rdtsc" : "=A"(value));
+    return value;
+}
+
+//Timestamp counter ticks per millisecond divided by 1024, measured against the timer over 100ms
+static uint32_t calibrate_tsc()
+{
+    BOOL interrupts_were_enabled = is_interrupts_enabled();
+
+    enable_interrupts();
+
+    uint32_t start_ms = get_uptime_milliseconds();
+    while (get_uptime_milliseconds() == start_ms);
+
+    start_ms = get_uptime_milliseconds();
+    uint64_t start = read_tsc();
+    while (get_uptime_milliseconds() - start_ms < 100);
+    uint64_t elapsed = read_tsc() - start;
+
+    if (!interrupts_were_enabled)
+    {
+        disable_interrupts();
+    }
+
+    uint32_t kticks_per_ms = (uint32_t)(elapsed >> 10) / 100;
+
+    return MAX(kticks_per_ms, 1);
+}
+
+static uint32_t elapsed_milliseconds(uint64_t start, uint32_t kticks_per_ms)
+{
+    uint32_t elapsed = (uint32_t)((read_tsc() - start) >> 10) / kticks_per_ms;
+
+    return MAX(elapsed, 1);
+}
+
+static FileSystemNode* find_largest_file(const char* path)
+{
+    FileSystemNode* directory = fs_get_node(path);
+
+    if (NULL == directory)
+    {
+        return NULL;
+    }
+
+    File* file = fs_open(directory, 0);
+
+    if (NULL == file)
+    {
+        return NULL;
+    }
+
+    FileSystemNode* largest = NULL;
+
+    uint32_t size = 0;
+    FileSystemDirent* dirent = NULL;
+    for (uint32_t i = 0; (dirent = fs_readdir_file(file, i, &size)) != NULL; ++i)
+    {
+        if (dirent->file_type == FT_FILE && (NULL == largest || size > largest->length))
+        {
+            FileSystemNode* node = fs_finddir(directory, dirent->name);
+
+            if (node)
+            {
+                largest = node;
+            }
+        }
+    }
+
+    fs_close(file);
+
+    return largest;
+}
+
+//Random reads from a fixed seed so every pass reads the same offsets. Returns KB/s.
+static uint32_t run_seeks(FileSystemNode* node, uint32_t flags, uint8_t* data, uint32_t kticks_per_ms)
+{
+    File* file = fs_open(node, flags);
+
+    if (NULL == file)
+    {
+        return 0;
+    }
+
+    uint32_t seed = 12345;
+    uint32_t span = node->length - BENCHMARK_SEEK_READ_SIZE + 1;
+
+    uint64_t start = read_tsc();
+
+    for (uint32_t i = 0; i < BENCHMARK_SEEK_COUNT; ++i)
+    {
+        seed = seed * 1103515245 + 12345;
+
+        fs_lseek(file, (seed >> 8) % span, 0);//SEEK_SET
+        fs_read(file, BENCHMARK_SEEK_READ_SIZE, data);
+    }
+
+    uint32_t elapsed = elapsed_milliseconds(start, kticks_per_ms);
+
+    fs_close(file);
+
+    return (BENCHMARK_SEEK_COUNT * (BENCHMARK_SEEK_READ_SIZE / 1024) * 1000) / elapsed;
+}
+
+//Reads the whole file in large chunks. Returns KB/s.
+static uint32_t run_sequential(FileSystemNode* node, uint32_t flags, uint8_t* data, uint32_t kticks_per_ms)
+{
+    File* file = fs_open(node, flags);
+
+    if (NULL == file)
+    {
+        return 0;
+    }
+
+    uint64_t start = read_tsc();
+
+    while (fs_read(file, BENCHMARK_SEQUENTIAL_CHUNK, data) == BENCHMARK_SEQUENTIAL_CHUNK);
+
+    uint32_t elapsed = elapsed_milliseconds(start, kticks_per_ms);
+
+    fs_close(file);
+
+    return (node->length / 1024) * 1000 / elapsed;
+}
+
+//Compares random 4K reads and sequential reads of the largest file in /initrd,
+//with FAT files following the cluster chain and with a cluster link map.
+//The mode is chosen per open, other files are not affected. The timestamp counter is used for timing.
+uint32_t benchmark_file_seek(char* buffer, uint32_t buffer_size)
+{
+    uint32_t char_index = 0;
+
+    FileSystemNode* node = find_largest_file(BENCHMARK_SEEK_DIRECTORY);
+
+    if (NULL == node || node->length < BENCHMARK_SEEK_READ_SIZE)
+    {
+        char_index += sprintf(buffer + char_index, buffer_size - char_index, "no file large enough in %s\n", BENCHMARK_SEEK_DIRECTORY);
+
+        return char_index;
+    }
+
+    uint8_t* data = kmalloc(BENCHMARK_SEQUENTIAL_CHUNK);
+
+    uint32_t kticks_per_ms = calibrate_tsc();
+
+    char_index += sprintf(buffer + char_index, buffer_size - char_index, "file %s %d bytes\n", node->name, node->length);
+    char_index += sprintf(buffer + char_index, buffer_size - char_index, "mode random_KB/s sequential_KB/s\n");
+
+    //warm the block cache so both passes start alike
+    run_sequential(node, O_RDONLY | O_DIRECT, data, kticks_per_ms);
+
+    uint32_t chain_random = run_seeks(node, O_RDONLY | O_DIRECT | O_NOFASTSEEK, data, kticks_per_ms);
+    uint32_t chain_sequential = run_sequential(node, O_RDONLY | O_DIRECT | O_NOFASTSEEK, data, kticks_per_ms);
+
+    uint32_t map_random = run_seeks(node, O_RDONLY | O_DIRECT, data, kticks_per_ms);
+    uint32_t map_sequential = run_sequential(node, O_RDONLY | O_DIRECT, data, kticks_per_ms);
+
+    char_index += sprintf(buffer + char_index, buffer_size - char_index, "chain %d %d\n", chain_random, chain_sequential);
+    char_index += sprintf(buffer + char_index, buffer_size - char_index, "linkmap %d %d\n", map_random, map_sequential);
+
+    kfree(data);
+
+    return char_index;
+}
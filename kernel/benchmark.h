@@ -0,0 +1,9 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include "common.h"
+
+uint32_t benchmark_memory(char* buffer, uint32_t buffer_size);
+uint32_t benchmark_file_seek(char* buffer, uint32_t buffer_size);
+
+#endif // BENCHMARK_H
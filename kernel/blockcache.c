@@ -0,0 +1,365 @@
+#include "blockcache.h"
+#include "alloc.h"
+#include "process.h"
+#include "sleep.h"
+#include "timer.h"
+#include "mutex.h"
+
+//Blocks of block devices kept in memory, keyed by (device, block number).
+//Writes are delayed: a kernel thread writes back the blocks that stayed dirty long enough.
+#define BLOCKCACHE_BLOCK_COUNT      2048 //1MB
+#define BLOCKCACHE_BUCKET_COUNT     1024
+#define BLOCKCACHE_READ_AHEAD       16
+#define BLOCKCACHE_FLUSH_PERIOD_MS  1000
+#define BLOCKCACHE_DIRTY_AGE_MS     3000
+
+typedef struct CachedBlock
+{
+    FileSystemNode* device;//NULL if the slot is empty
+    uint32_t block_number;
+    BOOL dirty;
+    uint32_t dirty_since;
+    uint8_t* data;
+    struct CachedBlock* hash_next;
+    //LRU links, most recently used first
+    struct CachedBlock* lru_previous;
+    struct CachedBlock* lru_next;
+} CachedBlock;
+
+static CachedBlock* g_blocks = NULL;
+static CachedBlock* g_buckets[BLOCKCACHE_BUCKET_COUNT];
+static CachedBlock* g_lru_head = NULL;
+static CachedBlock* g_lru_tail = NULL;
+
+//A read starting where the previous one ended is considered sequential and triggers read-ahead
+static FileSystemNode* g_last_read_device = NULL;
+static uint32_t g_last_read_end = 0;
+
+static uint32_t g_hits = 0;
+static uint32_t g_misses = 0;
+static uint32_t g_read_aheads = 0;
+static uint32_t g_write_backs = 0;
+static uint32_t g_dirty_count = 0;
+
+//The only lock of the cache, held across device I/O with interrupts enabled.
+//Callers pass kernel buffers (see fatfilesystem.c), so nothing under it can fault into a file mapping.
+static Mutex g_mutex;
+
+static void flusher_thread();
+
+void blockcache_initialize()
+{
+    mutex_init(&g_mutex);
+
+    g_blocks = (CachedBlock*)kmalloc(BLOCKCACHE_BLOCK_COUNT * sizeof(CachedBlock));
+    memset((uint8_t*)g_blocks, 0, BLOCKCACHE_BLOCK_COUNT * sizeof(CachedBlock));
+
+    uint8_t* data = (uint8_t*)kmalloc(BLOCKCACHE_BLOCK_COUNT * BLOCKCACHE_BLOCK_SIZE);
+
+    memset((uint8_t*)g_buckets, 0, sizeof(g_buckets));
+
+    for (uint32_t i = 0; i < BLOCKCACHE_BLOCK_COUNT; ++i)
+    {
+        CachedBlock* block = &g_blocks[i];
+
+        block->data = data + i * BLOCKCACHE_BLOCK_SIZE;
+
+        block->lru_previous = g_lru_tail;
+
+        if (g_lru_tail)
+        {
+            g_lru_tail->lru_next = block;
+        }
+        else
+        {
+            g_lru_head = block;
+        }
+
+        g_lru_tail = block;
+    }
+
+    thread_create_kthread(flusher_thread);
+}
+
+static uint32_t hash_index(FileSystemNode* device, uint32_t block_number)
+{
+    return (block_number ^ ((uint32_t)device >> 4)) % BLOCKCACHE_BUCKET_COUNT;
+}
+
+static CachedBlock* find_block(FileSystemNode* device, uint32_t block_number)
+{
+    CachedBlock* block = g_buckets[hash_index(device, block_number)];
+
+    while (block)
+    {
+        if (block->device == device && block->block_number == block_number)
+        {
+            return block;
+        }
+
+        block = block->hash_next;
+    }
+
+    return NULL;
+}
+
+static void lru_touch(CachedBlock* block)
+{
+    if (g_lru_head == block)
+    {
+        return;
+    }
+
+    //Unlink
+    block->lru_previous->lru_next = block->lru_next;
+
+    if (block->lru_next)
+    {
+        block->lru_next->lru_previous = block->lru_previous;
+    }
+    else
+    {
+        g_lru_tail = block->lru_previous;
+    }
+
+    //Push front
+    block->lru_previous = NULL;
+    block->lru_next = g_lru_head;
+    g_lru_head->lru_previous = block;
+    g_lru_head = block;
+}
+
+static BOOL write_back(CachedBlock* block)
+{
+    if (block->device->write_block(block->device, block->block_number, 1, block->data) < 0)
+    {
+        return FALSE;
+    }
+
+    block->dirty = FALSE;
+    --g_dirty_count;
+    ++g_write_backs;
+
+    return TRUE;
+}
+
+//Recycles the least recently used slot for (device, block_number). Its data is undefined.
+static CachedBlock* acquire_block(FileSystemNode* device, uint32_t block_number)
+{
+    CachedBlock* block = g_lru_tail;
+
+    if (block->device)
+    {
+        if (block->dirty)
+        {
+            write_back(block);
+        }
+
+        CachedBlock** link = &g_buckets[hash_index(block->device, block->block_number)];
+        while (*link != block)
+        {
+            link = &(*link)->hash_next;
+        }
+        *link = block->hash_next;
+    }
+
+    block->device = device;
+    block->block_number = block_number;
+    block->dirty = FALSE;
+
+    uint32_t index = hash_index(device, block_number);
+    block->hash_next = g_buckets[index];
+    g_buckets[index] = block;
+
+    lru_touch(block);
+
+    return block;
+}
+
+//Reads count uncached blocks from the device into the cache
+static BOOL fill_blocks(FileSystemNode* device, uint32_t block_number, uint32_t count, uint8_t* buffer)
+{
+    if (device->read_block(device, block_number, count, buffer) < 0)
+    {
+        return FALSE;
+    }
+
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        CachedBlock* block = acquire_block(device, block_number + i);
+
+        memcpy(block->data, buffer + i * BLOCKCACHE_BLOCK_SIZE, BLOCKCACHE_BLOCK_SIZE);
+    }
+
+    return TRUE;
+}
+
+static void read_ahead(FileSystemNode* device, uint32_t block_number)
+{
+    uint32_t count = 0;
+    while (count < BLOCKCACHE_READ_AHEAD && NULL == find_block(device, block_number + count))
+    {
+        ++count;
+    }
+
+    if (count == 0)
+    {
+        return;
+    }
+
+    uint8_t* buffer = (uint8_t*)kmalloc(count * BLOCKCACHE_BLOCK_SIZE);
+
+    //Failing here is fine, it may just be the end of the device
+    if (fill_blocks(device, block_number, count, buffer))
+    {
+        g_read_aheads += count;
+    }
+
+    kfree(buffer);
+}
+
+int32_t blockcache_read(FileSystemNode* device, uint32_t block_number, uint32_t count, uint8_t* buffer)
+{
+    mutex_lock(&g_mutex);
+
+    int32_t result = 0;
+
+    BOOL sequential = (device == g_last_read_device && block_number == g_last_read_end);
+
+    uint32_t i = 0;
+    while (i < count)
+    {
+        CachedBlock* block = find_block(device, block_number + i);
+
+        if (block)
+        {
+            memcpy(buffer + i * BLOCKCACHE_BLOCK_SIZE, block->data, BLOCKCACHE_BLOCK_SIZE);
+
+            lru_touch(block);
+
+            ++g_hits;
+            ++i;
+            continue;
+        }
+
+        //Read the whole run of missing blocks at once, straight into the caller's buffer
+        uint32_t run = 1;
+        while (i + run < count && NULL == find_block(device, block_number + i + run))
+        {
+            ++run;
+        }
+
+        g_misses += run;
+
+        if (FALSE == fill_blocks(device, block_number + i, run, buffer + i * BLOCKCACHE_BLOCK_SIZE))
+        {
+            result = -1;
+            break;
+        }
+
+        i += run;
+    }
+
+    if (result == 0)
+    {
+        g_last_read_device = device;
+        g_last_read_end = block_number + count;
+
+        if (sequential)
+        {
+            read_ahead(device, block_number + count);
+        }
+    }
+
+    mutex_unlock(&g_mutex);
+
+    return result;
+}
+
+int32_t blockcache_write(FileSystemNode* device, uint32_t block_number, uint32_t count, uint8_t* buffer)
+{
+    mutex_lock(&g_mutex);
+
+    uint32_t now = get_uptime_milliseconds();
+
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        CachedBlock* block = find_block(device, block_number + i);
+
+        if (block)
+        {
+            lru_touch(block);
+        }
+        else
+        {
+            block = acquire_block(device, block_number + i);
+        }
+
+        memcpy(block->data, buffer + i * BLOCKCACHE_BLOCK_SIZE, BLOCKCACHE_BLOCK_SIZE);
+
+        if (FALSE == block->dirty)
+        {
+            block->dirty = TRUE;
+            block->dirty_since = now;
+            ++g_dirty_count;
+        }
+    }
+
+    mutex_unlock(&g_mutex);
+
+    return 0;
+}
+
+//Writes back dirty blocks of device (all devices if NULL) that have been dirty for at least min_age_ms
+static int32_t flush(FileSystemNode* device, uint32_t min_age_ms)
+{
+    mutex_lock(&g_mutex);
+
+    int32_t result = 0;
+
+    uint32_t now = get_uptime_milliseconds();
+
+    for (uint32_t i = 0; i < BLOCKCACHE_BLOCK_COUNT && g_dirty_count > 0; ++i)
+    {
+        CachedBlock* block = &g_blocks[i];
+
+        if (block->dirty && (NULL == device || block->device == device) && now - block->dirty_since >= min_age_ms)
+        {
+            if (FALSE == write_back(block))
+            {
+                result = -1;
+            }
+        }
+    }
+
+    mutex_unlock(&g_mutex);
+
+    return result;
+}
+
+int32_t blockcache_sync(FileSystemNode* device)
+{
+    return flush(device, 0);
+}
+
+void blockcache_get_statistics(uint32_t* hits, uint32_t* misses, uint32_t* read_aheads, uint32_t* write_backs, uint32_t* dirty)
+{
+    *hits = g_hits;
+    *misses = g_misses;
+    *read_aheads = g_read_aheads;
+    *write_backs = g_write_backs;
+    *dirty = g_dirty_count;
+}
+
+static void flusher_thread()
+{
+    while (TRUE)
+    {
+        sleep_ms(thread_get_current(), BLOCKCACHE_FLUSH_PERIOD_MS);
+
+        if (g_dirty_count > 0)
+        {
+            flush(NULL, BLOCKCACHE_DIRTY_AGE_MS);
+        }
+    }
+}
@@ -0,0 +1,15 @@
+#ifndef BLOCKCACHE_H
+#define BLOCKCACHE_H
+
+#include "common.h"
+#include "fs.h"
+
+#define BLOCKCACHE_BLOCK_SIZE 512
+
+void blockcache_initialize();
+int32_t blockcache_read(FileSystemNode* device, uint32_t block_number, uint32_t count, uint8_t* buffer);
+int32_t blockcache_write(FileSystemNode* device, uint32_t block_number, uint32_t count, uint8_t* buffer);
+int32_t blockcache_sync(FileSystemNode* device);
+void blockcache_get_statistics(uint32_t* hits, uint32_t* misses, uint32_t* read_aheads, uint32_t* write_backs, uint32_t* dirty);
+
+#endif // BLOCKCACHE_H
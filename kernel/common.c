@@ -32,12 +32,31 @@ uint16_t inw(uint16_t port)
     return ret;
 }
 
+//Copies below this size are not worth aligning, they go straight to rep movsb / rep stosb
+#define MEM_WORD_THRESHOLD 16
+
 // Copy len bytes from src to dest.
 void* memcpy(uint8_t *dest, const uint8_t *src, uint32_t len)
 {
-    const uint8_t *sp = (const uint8_t *)src;
-    uint8_t *dp = (uint8_t *)dest;
-    for(; len != 0; len--) *dp++ = *sp++;
+    uint8_t *dp = dest;
+    const uint8_t *sp = src;
+
+    if (len >= MEM_WORD_THRESHOLD)
+    {
+        //Align the destination to a dword, then move dwords with string instructions
+        uint32_t head = (-(uint32_t)dp) & 3;
+        len -= head;
+
+        asm volatile("cld; rep movsb" : "+D"(dp), "+S"(sp), "+c"(head) : : "memory");
+
+        uint32_t dwords = len >> 2;
+        len &= 3;
+
+        asm volatile("rep movsl" : "+D"(dp), "+S"(sp), "+c"(dwords) : : "memory");
+    }
+
+    //Tail (or the whole copy if it is small)
+    asm volatile("cld; rep movsb" : "+D"(dp), "+S"(sp), "+c"(len) : : "memory");
 
     return dest;
 }
@@ -45,31 +64,65 @@ void* memcpy(uint8_t *dest, const uint8_t *src, uint32_t len)
 // Write len copies of val into dest.
 void* memset(uint8_t *dest, uint8_t val, uint32_t len)
 {
-    uint8_t *temp = (uint8_t *)dest;
-    for ( ; len != 0; len--) *temp++ = val;
+    uint8_t *dp = dest;
+
+    if (len >= MEM_WORD_THRESHOLD)
+    {
+        uint32_t head = (-(uint32_t)dp) & 3;
+        len -= head;
+
+        asm volatile("cld; rep stosb" : "+D"(dp), "+c"(head) : "a"(val) : "memory");
+
+        uint32_t dwords = len >> 2;
+        len &= 3;
+
+        uint32_t pattern = val * 0x01010101;
+
+        asm volatile("rep stosl" : "+D"(dp), "+c"(dwords) : "a"(pattern) : "memory");
+    }
+
+    asm volatile("cld; rep stosb" : "+D"(dp), "+c"(len) : "a"(val) : "memory");
 
     return dest;
 }
 
 void* memmove(void* dest, const void* src, uint32_t n)
 {
-    uint8_t* _dest;
-    uint8_t* _src;
+    uint8_t* _dest = (uint8_t*)dest;
+    const uint8_t* _src = (const uint8_t*)src;
 
-    if ( dest < src ) {
-        _dest = ( uint8_t* )dest;
-        _src = ( uint8_t* )src;
+    if (_dest <= _src || _dest >= _src + n)
+    {
+        //No harmful overlap, a forward copy is fine
+        return memcpy(_dest, _src, n);
+    }
 
-        while ( n-- ) {
-            *_dest++ = *_src++;
-        }
-    } else {
-        _dest = ( uint8_t* )dest + n;
-        _src = ( uint8_t* )src + n;
+    //Destination overlaps the end of source: copy backwards
+    _dest += n;
+    _src += n;
 
-        while ( n-- ) {
+    if (n >= MEM_WORD_THRESHOLD)
+    {
+        //Align the destination end to a dword
+        while (((uint32_t)_dest & 3) != 0)
+        {
             *--_dest = *--_src;
+            --n;
         }
+
+        while (n >= 4)
+        {
+            _dest -= 4;
+            _src -= 4;
+            n -= 4;
+
+            *(uint32_t*)_dest = *(const uint32_t*)_src;
+        }
+    }
+
+    while (n--)
+    {
+        *--_dest = *--_src;
     }
 
     return dest;
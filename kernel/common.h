@@ -21,25 +21,29 @@
 #define	KERN_PAGE_DIRECTORY			0x00001000
 
 //16M is identity mapped as below.
-//First 12M we don't touch. Kernel code and runtime initrd are there.
-//4M is reserved for 4K page directories.
+//We don't touch it. Kernel code and runtime initrd are there.
+//Page directories are page frames like any other, see vmm_acquire_page_directory.
 #define RESERVED_AREA           0x01000000 //16 mb
-#define KERN_PD_AREA_BEGIN      0x00C00000 //12 mb
-#define KERN_PD_AREA_END        0x01000000 //16 mb
 
 
 #define GFX_MEMORY              0x01000000 //16 mb
 
 #define KERN_HEAP_BEGIN 		0x02000000 //32 mb
 #define KERN_HEAP_END    		0x40000000 // 1 gb
+#define KERN_WINDOW             (KERN_HEAP_END - PAGESIZE_4K) //Not part of the heap. Frames are mapped here briefly to be initialized.
 
 #define	PAGING_FLAG 		0x80000000	// CR0 - bit 31
+#define	WRITE_PROTECT_FLAG	0x00010000	// CR0 - bit 16 //Supervisor writes honor read-only pages too.
 #define PSE_FLAG			0x00000010	// CR4 - bit 4 //For 4M page support.
+#define PGE_FLAG			0x00000080	// CR4 - bit 7 //Global pages stay in the TLB when CR3 is reloaded.
 #define PG_PRESENT			0x00000001	// page directory / table
 #define PG_WRITE			0x00000002
 #define PG_USER				0x00000004
+#define PG_DIRTY			0x00000040  // set by the CPU on write
 #define PG_4MB				0x00000080
+#define PG_GLOBAL			0x00000100  // kernel space mappings, the same in every page directory
 #define PG_OWNED			0x00000200  // We use 9th bit for bookkeeping of owned pages (9-11th bits are available for OS)
+#define PG_COW				0x00000400  // 10th bit: owned page write protected after fork, copied on the first write
 #define	PAGESIZE_4K 		0x00001000
 #define	PAGESIZE_4M			0x00400000
 #define	RAM_AS_4K_PAGES		0x100000
@@ -60,6 +64,7 @@
 #define	SIZE_2MB        	0x200000 //2MB
 
 #define	USER_STACK 			0xF0000000
+#define	USER_STACK_SIZE		0x00800000 //8MB reserved below USER_STACK, pages are faulted in as the stack grows
 
 void outb(uint16_t port, uint8_t value);
 void outw(uint16_t port, uint16_t value);
@@ -0,0 +1,246 @@
+#include "dcache.h"
+#include "alloc.h"
+
+//Results of finddir kept in memory, keyed by (directory node, name).
+//A NULL node is a negative entry: the name is known to be missing from the directory.
+//Only directories having cache_lookups set are cached, since their children live as long as they do.
+#define DCACHE_ENTRY_COUNT      1024
+#define DCACHE_BUCKET_COUNT     512
+
+typedef struct DentryCacheEntry
+{
+    FileSystemNode* directory;//NULL if the slot is empty
+    FileSystemNode* node;
+    uint32_t hash;
+    char name[128];
+    struct DentryCacheEntry* hash_next;
+    //LRU links, most recently used first
+    struct DentryCacheEntry* lru_previous;
+    struct DentryCacheEntry* lru_next;
+} DentryCacheEntry;
+
+static DentryCacheEntry* g_entries = NULL;
+static DentryCacheEntry* g_buckets[DCACHE_BUCKET_COUNT];
+static DentryCacheEntry* g_lru_head = NULL;
+static DentryCacheEntry* g_lru_tail = NULL;
+
+void dcache_initialize()
+{
+    g_entries = (DentryCacheEntry*)kmalloc(DCACHE_ENTRY_COUNT * sizeof(DentryCacheEntry));
+    memset((uint8_t*)g_entries, 0, DCACHE_ENTRY_COUNT * sizeof(DentryCacheEntry));
+
+    memset((uint8_t*)g_buckets, 0, sizeof(g_buckets));
+
+    for (uint32_t i = 0; i < DCACHE_ENTRY_COUNT; ++i)
+    {
+        DentryCacheEntry* entry = &g_entries[i];
+
+        entry->lru_previous = g_lru_tail;
+
+        if (g_lru_tail)
+        {
+            g_lru_tail->lru_next = entry;
+        }
+        else
+        {
+            g_lru_head = entry;
+        }
+
+        g_lru_tail = entry;
+    }
+}
+
+static uint32_t hash_name(FileSystemNode* directory, const char* name)
+{
+    //FNV-1a
+    uint32_t hash = 2166136261u;
+
+    while (*name)
+    {
+        hash ^= (uint8_t)*name++;
+        hash *= 16777619u;
+    }
+
+    return hash ^ ((uint32_t)directory >> 4);
+}
+
+static DentryCacheEntry* find_entry(FileSystemNode* directory, const char* name, uint32_t hash)
+{
+    DentryCacheEntry* entry = g_buckets[hash % DCACHE_BUCKET_COUNT];
+
+    while (entry)
+    {
+        if (entry->hash == hash && entry->directory == directory && strcmp(entry->name, name) == 0)
+        {
+            return entry;
+        }
+
+        entry = entry->hash_next;
+    }
+
+    return NULL;
+}
+
+static void lru_unlink(DentryCacheEntry* entry)
+{
+    if (entry->lru_previous)
+    {
+        entry->lru_previous->lru_next = entry->lru_next;
+    }
+    else
+    {
+        g_lru_head = entry->lru_next;
+    }
+
+    if (entry->lru_next)
+    {
+        entry->lru_next->lru_previous = entry->lru_previous;
+    }
+    else
+    {
+        g_lru_tail = entry->lru_previous;
+    }
+}
+
+static void lru_push_front(DentryCacheEntry* entry)
+{
+    entry->lru_previous = NULL;
+    entry->lru_next = g_lru_head;
+
+    if (g_lru_head)
+    {
+        g_lru_head->lru_previous = entry;
+    }
+    else
+    {
+        g_lru_tail = entry;
+    }
+
+    g_lru_head = entry;
+}
+
+static void lru_push_back(DentryCacheEntry* entry)
+{
+    entry->lru_next = NULL;
+    entry->lru_previous = g_lru_tail;
+
+    if (g_lru_tail)
+    {
+        g_lru_tail->lru_next = entry;
+    }
+    else
+    {
+        g_lru_head = entry;
+    }
+
+    g_lru_tail = entry;
+}
+
+//Empties the slot and moves it to the LRU tail, so it is the next one recycled
+static void remove_entry(DentryCacheEntry* entry)
+{
+    DentryCacheEntry** link = &g_buckets[entry->hash % DCACHE_BUCKET_COUNT];
+    while (*link != entry)
+    {
+        link = &(*link)->hash_next;
+    }
+    *link = entry->hash_next;
+
+    entry->directory = NULL;
+    entry->node = NULL;
+    entry->hash_next = NULL;
+
+    lru_unlink(entry);
+    lru_push_back(entry);
+}
+
+FileSystemNode* dcache_lookup(FileSystemNode* directory, const char* name, BOOL* found)
+{
+    DentryCacheEntry* entry = find_entry(directory, name, hash_name(directory, name));
+
+    if (NULL == entry)
+    {
+        *found = FALSE;
+
+        return NULL;
+    }
+
+    lru_unlink(entry);
+    lru_push_front(entry);
+
+    *found = TRUE;
+
+    return entry->node;
+}
+
+void dcache_insert(FileSystemNode* directory, const char* name, FileSystemNode* node)
+{
+    if (strlen(name) >= (int)sizeof(g_entries[0].name))
+    {
+        return;
+    }
+
+    uint32_t hash = hash_name(directory, name);
+
+    DentryCacheEntry* entry = find_entry(directory, name, hash);
+
+    if (NULL == entry)
+    {
+        entry = g_lru_tail;
+
+        if (entry->directory)
+        {
+            remove_entry(entry);
+        }
+
+        entry->directory = directory;
+        entry->hash = hash;
+        strcpy(entry->name, name);
+
+        uint32_t index = hash % DCACHE_BUCKET_COUNT;
+        entry->hash_next = g_buckets[index];
+        g_buckets[index] = entry;
+    }
+
+    entry->node = node;
+
+    lru_unlink(entry);
+    lru_push_front(entry);
+}
+
+void dcache_invalidate(FileSystemNode* directory, const char* name)
+{
+    DentryCacheEntry* entry = find_entry(directory, name, hash_name(directory, name));
+
+    if (entry)
+    {
+        remove_entry(entry);
+    }
+}
+
+//Drops the entries resolving to node and the entries of the directory node
+void dcache_invalidate_node(FileSystemNode* node)
+{
+    for (uint32_t i = 0; i < DCACHE_ENTRY_COUNT; ++i)
+    {
+        DentryCacheEntry* entry = &g_entries[i];
+
+        if (entry->directory && (entry->node == node || entry->directory == node))
+        {
+            remove_entry(entry);
+        }
+    }
+}
+
+void dcache_purge()
+{
+    for (uint32_t i = 0; i < DCACHE_ENTRY_COUNT; ++i)
+    {
+        DentryCacheEntry* entry = &g_entries[i];
+
+        if (entry->directory)
+        {
+            remove_entry(entry);
+        }
+    }
+}
@@ -0,0 +1,14 @@
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#include "common.h"
+#include "fs.h"
+
+void dcache_initialize();
+FileSystemNode* dcache_lookup(FileSystemNode* directory, const char* name, BOOL* found);
+void dcache_insert(FileSystemNode* directory, const char* name, FileSystemNode* node);
+void dcache_invalidate(FileSystemNode* directory, const char* name);
+void dcache_invalidate_node(FileSystemNode* node);
+void dcache_purge();
+
+#endif // DCACHE_H
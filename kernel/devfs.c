@@ -135,6 +135,7 @@ FileSystemNode* devfs_register_device(Device* device)
     device_node->ftruncate = device->ftruncate;
     device_node->mmap = device->mmap;
     device_node->munmap = device->munmap;
+    device_node->passable = device->passable;
     device_node->private_node_data = device->private_data;
     device_node->parent = g_dev_root;
 
@@ -20,6 +20,7 @@ typedef struct Device
     FtruncateFunction ftruncate;
     MmapFunction mmap;
     MunmapFunction munmap;
+    BOOL passable;//see FileSystemNode
     void * private_data;
 } Device;
 
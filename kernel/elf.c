@@ -1,6 +1,8 @@
 #include "elf.h"
 #include "common.h"
 #include "process.h"
+#include "vmm.h"
+#include "pagecache.h"
 
 BOOL elf_is_valid(const char *elf_data)
 {
@@ -109,3 +111,89 @@ uint32_t elf_get_end_in_memory(const char *elf_data)
 
     return result;
 }
+
+//Segments can be mapped from the page cache if the program headers are in the first header_size bytes,
+//each segment has the same offset in its page as in the file and no two segments share a page.
+BOOL elf_can_map(const char *elf_data, uint32_t header_size)
+{
+    if (header_size < sizeof(Elf32_Ehdr) || elf_is_valid(elf_data) == FALSE)
+    {
+        return FALSE;
+    }
+
+    Elf32_Ehdr *hdr = (Elf32_Ehdr *) elf_data;
+
+    if (hdr->e_phoff + hdr->e_phnum * sizeof(Elf32_Phdr) > header_size)
+    {
+        return FALSE;
+    }
+
+    Elf32_Phdr *p_entry = (Elf32_Phdr *) (elf_data + hdr->e_phoff);
+
+    uint32_t previous_end = 0;
+
+    for (int pe = 0; pe < hdr->e_phnum; pe++, p_entry++)
+    {
+        if (p_entry->p_type != PT_LOAD)
+        {
+            continue;
+        }
+
+        if ((p_entry->p_vaddr % PAGESIZE_4K) != (p_entry->p_offset % PAGESIZE_4K))
+        {
+            return FALSE;
+        }
+
+        uint32_t v_begin = p_entry->p_vaddr & 0xFFFFF000;
+
+        //Segments are sorted by address
+        if (v_begin < previous_end)
+        {
+            return FALSE;
+        }
+
+        previous_end = (p_entry->p_vaddr + p_entry->p_memsz + PAGESIZE_4K - 1) & 0xFFFFF000;
+    }
+
+    return TRUE;
+}
+
+//Like elf_load but records a file backed memory area for each segment instead of copying.
+//The pages are read from the cache on first touch. bss is zero-filled on demand.
+uint32_t elf_map(Process* process, PageCache* cache, const char *elf_data)
+{
+    Elf32_Ehdr *hdr = (Elf32_Ehdr *) elf_data;
+    Elf32_Phdr *p_entry = (Elf32_Phdr *) (elf_data + hdr->e_phoff);
+
+    for (int pe = 0; pe < hdr->e_phnum; pe++, p_entry++)
+    {
+        if (p_entry->p_type != PT_LOAD)
+        {
+            continue;
+        }
+
+        uint32_t v_begin = p_entry->p_vaddr;
+        uint32_t v_end = p_entry->p_vaddr + p_entry->p_memsz;
+
+        if (v_begin < USER_OFFSET || v_end > USER_STACK)
+        {
+            printkf("Warning: skipped to load %d(%x) bytes to %x\n", p_entry->p_filesz, p_entry->p_filesz, v_begin);
+            continue;
+        }
+
+        uint32_t start = v_begin & 0xFFFFF000;
+        uint32_t end = (v_end + PAGESIZE_4K - 1) & 0xFFFFF000;
+        uint32_t lead = v_begin - start;
+
+        uint32_t flags = 0;
+        if (p_entry->p_flags & PF_W)
+        {
+            flags |= VMA_WRITE;
+        }
+
+        vmm_vma_add_file(process, start, end, flags, cache, p_entry->p_offset - lead, lead + p_entry->p_filesz);
+    }
+
+    //entry point
+    return hdr->e_entry;
+}
@@ -246,8 +246,13 @@ typedef struct {
 
 #define AUX_CNT 38
 
+typedef struct Process Process;
+typedef struct PageCache PageCache;
+
 BOOL elf_is_valid(const char *elfData);
 uint32_t elf_load(const char *elfData);
 uint32_t elf_get_end_in_memory(const char *elfData);
+BOOL elf_can_map(const char *elfData, uint32_t headerSize);
+uint32_t elf_map(Process* process, PageCache* cache, const char *elfData);
 
 #endif // ELF_H
@@ -4,6 +4,8 @@
 #include "alloc.h"
 #include "fatfs_ff.h"
 #include "fatfs_diskio.h"
+#include "blockcache.h"
+#include "mutex.h"
 
 #define SEEK_SET	0	/* Seek from beginning of file.  */
 #define SEEK_CUR	1	/* Seek from current position.  */
@@ -12,6 +14,7 @@
 static BOOL mount(const char* source_path, const char* target_path, uint32_t flags, void *data);
 static BOOL checkMount(const char* sourcePath, const char* targetPath, uint32_t flags, void *data);
 static FileSystemDirent* readdir(FileSystemNode *node, uint32_t index);
+static FileSystemDirent* readdir_file(File *file, uint32_t index, uint32_t* length);
 static FileSystemNode* finddir(FileSystemNode *node, char *name);
 static int32_t read(File *file, uint32_t size, uint8_t *buffer);
 static int32_t write(File *file, uint32_t size, uint8_t *buffer);
@@ -22,8 +25,82 @@ static void close(File *file);
 
 static FileSystemDirent g_fs_dirent;
 
+//private_data of an opened directory. The FatFs DIR stays open so entries are read one after another.
+typedef struct FatDirCursor
+{
+    DIR dir;
+    uint32_t next_index;//index of the entry the next f_readdir returns
+    FILINFO file_info;//entry next_index - 1, kept for a caller retrying it
+} FatDirCursor;
+
+//Builds the FatFs path ("volume:/dir/name") of node, or of its child name if name is not NULL.
+//Returns a pointer into target_path (128 bytes) or NULL if the path does not fit.
+static uint8_t* get_target_path(FileSystemNode *node, const char* name, uint8_t* target_path)
+{
+    FileSystemNode *n = node;
+    int char_index = 126;
+    memset(target_path, 0, 128);
+
+    if (name)
+    {
+        int length = strlen(name);
+        char_index -= length;
+
+        if (char_index < 2)
+        {
+            return NULL;
+        }
+
+        strcpy_nonnull((char*)(target_path + char_index), name);
+        char_index -= 1;
+        target_path[char_index] = '/';
+    }
+
+    //when node is the root of mounted filesystem,
+    //node->mount_source is the source node (eg. disk partition /dev/hd1p1)
+    while (NULL == n->mount_source)
+    {
+        int length = strlen(n->name);
+        char_index -= length;
+
+        if (char_index < 2)
+        {
+            return NULL;
+        }
+
+        strcpy_nonnull((char*)(target_path + char_index), n->name);
+        char_index -= 1;
+        target_path[char_index] = '/';
+
+        n = n->parent;
+    }
+
+    char number[8];
+    sprintf(number, 8, "%d", n->private_node_data);//volume nuber
+
+    target_path[char_index] = ':';
+    int length = strlen(number);
+    char_index -= length;
+    if (char_index < 0)
+    {
+        return NULL;
+    }
+
+    strcpy_nonnull((char*)(target_path + char_index), number);
+
+    return target_path + char_index;
+}
+
 static FileSystemNode* g_mounted_block_devices[FF_VOLUMES];
 
+//FatFs holds the volume mutex while it copies file data. Touching a user page there could fault into
+//a file mapping of the same volume and lock it again, so user buffers go through a kernel buffer.
+#define FAT_BOUNCE_SIZE (64 * 1024)
+
+//Read only files get a cluster link map on open, so seeks and reads do not follow the FAT chain.
+//Opening with O_NOFASTSEEK skips it.
+#define FAT_LINK_MAP_INITIAL_SIZE 32
+
 
 void fatfs_initialize()
 {
@@ -76,8 +153,11 @@ static BOOL mount(const char* source_path, const char* target_path, uint32_t fla
                 strcpy(new_node->name, target_node->name);
                 new_node->node_type = FT_DIRECTORY;
                 new_node->open = open;
+                new_node->close = close;
                 new_node->readdir = readdir;
+                new_node->readdir_file = readdir_file;
                 new_node->finddir = finddir;
+                new_node->cache_lookups = TRUE;
                 new_node->parent = target_node->parent;
                 new_node->mount_source = node;
                 new_node->private_node_data = (void*)volume;
@@ -115,6 +195,34 @@ static BOOL mount(const char* source_path, const char* target_path, uint32_t fla
     return FALSE;
 }
 
+static void create_link_map(FIL* f)
+{
+    DWORD* table = (DWORD*)kmalloc(FAT_LINK_MAP_INITIAL_SIZE * sizeof(DWORD));
+    table[0] = FAT_LINK_MAP_INITIAL_SIZE;
+    f->cltbl = table;
+
+    FRESULT fr = f_lseek(f, CREATE_LINKMAP);
+
+    if (FR_NOT_ENOUGH_CORE == fr)
+    {
+        //table[0] is now the required size
+        DWORD size = table[0];
+        kfree(table);
+
+        table = (DWORD*)kmalloc(size * sizeof(DWORD));
+        table[0] = size;
+        f->cltbl = table;
+
+        fr = f_lseek(f, CREATE_LINKMAP);
+    }
+
+    if (FR_OK != fr)
+    {
+        kfree(table);
+        f->cltbl = NULL;
+    }
+}
+
 static BOOL checkMount(const char* source_path, const char* target_path, uint32_t flags, void *data)
 {
     FileSystemNode* node = fs_get_node(source_path);
@@ -133,6 +241,22 @@ static BOOL checkMount(const char* source_path, const char* target_path, uint32_
     return FALSE;
 }
 
+static FileSystemDirent* fill_dirent(FILINFO* file_info)
+{
+    g_fs_dirent.inode = 0;
+    strcpy(g_fs_dirent.name, file_info->fname);
+    if ((file_info->fattrib & AM_DIR) == AM_DIR)
+    {
+        g_fs_dirent.file_type = FT_DIRECTORY;
+    }
+    else
+    {
+        g_fs_dirent.file_type = FT_FILE;
+    }
+
+    return &g_fs_dirent;
+}
+
 static FileSystemDirent* readdir(FileSystemNode *node, uint32_t index)
 {
     //when node is the root of mounted filesystem,
@@ -141,42 +265,13 @@ static FileSystemDirent* readdir(FileSystemNode *node, uint32_t index)
     //Screen_PrintF("readdir1: node->name:%s\n", node->name);
 
     uint8_t target_path[128];
+    uint8_t* target = get_target_path(node, NULL, target_path);
 
-    FileSystemNode *n = node;
-    int char_index = 126;
-    memset(target_path, 0, 128);
-    while (NULL == n->mount_source)
-    {
-        int length = strlen(n->name);
-
-        char_index -= length;
-
-        if (char_index < 2)
-        {
-            return NULL;
-        }
-
-        strcpy_nonnull((char*)(target_path + char_index), n->name);
-        char_index -= 1;
-        target_path[char_index] = '/';
-
-        n = n->parent;
-    }
-
-    char number[8];
-    sprintf(number, 8, "%d", n->private_node_data);//volume nuber
-
-    target_path[char_index] = ':';
-    int length = strlen(number);
-    char_index -= length;
-    if (char_index < 0)
+    if (NULL == target)
     {
         return NULL;
     }
 
-    strcpy_nonnull((char*)(target_path + char_index), number);
-    uint8_t* target = target_path + char_index;
-
     //Screen_PrintF("readdir: targetpath:[%s]\n", target);
 
     DIR dir;
@@ -197,23 +292,56 @@ static FileSystemDirent* readdir(FileSystemNode *node, uint32_t index)
             }
         }
 
-        g_fs_dirent.inode = 0;
-        strcpy(g_fs_dirent.name, fileInfo.fname);
-        if ((fileInfo.fattrib & AM_DIR) == AM_DIR)
+        f_closedir(&dir);
+
+        return fill_dirent(&fileInfo);
+    }
+
+    return NULL;
+}
+
+static FileSystemDirent* readdir_file(File *file, uint32_t index, uint32_t* length)
+{
+    FatDirCursor* cursor = (FatDirCursor*)file->private_data;
+
+    if (NULL == cursor)
+    {
+        return NULL;
+    }
+
+    if (index + 1 != cursor->next_index)
+    {
+        if (index < cursor->next_index)
         {
-            g_fs_dirent.file_type = FT_DIRECTORY;
+            //rewind
+            f_readdir(&cursor->dir, NULL);
+            cursor->next_index = 0;
         }
-        else
+
+        while (cursor->next_index <= index)
         {
-            g_fs_dirent.file_type = FT_FILE;
-        }
+            memset((uint8_t*)&cursor->file_info, 0, sizeof(FILINFO));
+            FRESULT fr = f_readdir(&cursor->dir, &cursor->file_info);
 
-        f_closedir(&dir);
+            if (FR_OK != fr || cursor->file_info.fname[0] == '\0')
+            {
+                //end of directory, start over on the next call
+                f_readdir(&cursor->dir, NULL);
+                cursor->next_index = 0;
+
+                return NULL;
+            }
+
+            ++cursor->next_index;
+        }
+    }
 
-        return &g_fs_dirent;
+    if (length)
+    {
+        *length = cursor->file_info.fsize;
     }
 
-    return NULL;
+    return fill_dirent(&cursor->file_info);
 }
 
 static FileSystemNode* finddir(FileSystemNode *node, char *name)
@@ -238,46 +366,13 @@ static FileSystemNode* finddir(FileSystemNode *node, char *name)
     //So we create its node...
 
     uint8_t target_path[128];
+    uint8_t* target = get_target_path(node, name, target_path);
 
-    FileSystemNode *n = node;
-    int char_index = 126;
-    memset(target_path, 0, 128);
-    int length = strlen(name);
-    char_index -= length;
-    strcpy_nonnull((char*)(target_path + char_index), name);
-    char_index -= 1;
-    target_path[char_index] = '/';
-    while (NULL == n->mount_source)
-    {
-        length = strlen(n->name);
-        char_index -= length;
-
-        if (char_index < 2)
-        {
-            return NULL;
-        }
-
-        strcpy_nonnull((char*)(target_path + char_index), n->name);
-        char_index -= 1;
-        target_path[char_index] = '/';
-
-        n = n->parent;
-    }
-
-    char number[8];
-    sprintf(number, 8, "%d", n->private_node_data);//volume nuber
-
-    target_path[char_index] = ':';
-    length = strlen(number);
-    char_index -= length;
-    if (char_index < 0)
+    if (NULL == target)
     {
         return NULL;
     }
 
-    strcpy_nonnull((char*)(target_path + char_index), number);
-    uint8_t* target = target_path + char_index;
-
     //Screen_PrintF("finddir: targetpath:[%s]\n", target);
 
     FILINFO file_info;
@@ -285,12 +380,25 @@ static FileSystemNode* finddir(FileSystemNode *node, char *name)
     FRESULT fr = f_stat((TCHAR*)target, &file_info);
     if (FR_OK == fr)
     {
+        //f_stat may have slept, another thread may have created the node meanwhile
+        FileSystemNode* child = node->first_child;
+        while (NULL != child)
+        {
+            if (strcmp(name, child->name) == 0)
+            {
+                return child;
+            }
+
+            child = child->next_sibling;
+        }
+
         FileSystemNode* new_node = kmalloc(sizeof(FileSystemNode));
 
         memset((uint8_t*)new_node, 0, sizeof(FileSystemNode));
         strcpy(new_node->name, name);
         new_node->parent = node;
         new_node->readdir = readdir;
+        new_node->readdir_file = readdir_file;
         new_node->finddir = finddir;
         new_node->open = open;
         new_node->close = close;
@@ -303,6 +411,7 @@ static FileSystemNode* finddir(FileSystemNode *node, char *name)
         if ((file_info.fattrib & AM_DIR) == AM_DIR)
         {
             new_node->node_type = FT_DIRECTORY;
+            new_node->cache_lookups = TRUE;
         }
         else
         {
@@ -336,48 +445,119 @@ static FileSystemNode* finddir(FileSystemNode *node, char *name)
 
 static int32_t read(File *file, uint32_t size, uint8_t *buffer)
 {
-    if (file->private_data == NULL)
+    if (file->private_data == NULL || file->node->node_type == FT_DIRECTORY)
     {
         return -1;
     }
 
     FIL* f = (FIL*)file->private_data;
 
-    UINT br = 0;
-    FRESULT fr = f_read(f, buffer, size, &br);
-    file->offset = f->fptr;
-    //Screen_PrintF("fat read: name:%s size:%d hasRead:%d, fr:%d\n", file->node->name, size, br, fr);
-    if (FR_OK == fr)
+    if ((uint32_t)buffer < USER_OFFSET || 0 == size)
     {
-        return br;
+        UINT br = 0;
+        FRESULT fr = f_read(f, buffer, size, &br);
+        file->offset = f->fptr;
+        //Screen_PrintF("fat read: name:%s size:%d hasRead:%d, fr:%d\n", file->node->name, size, br, fr);
+        if (FR_OK == fr)
+        {
+            return br;
+        }
+
+        return -1;
     }
 
-    return -1;
+    uint8_t* bounce = (uint8_t*)kmalloc(MIN(size, FAT_BOUNCE_SIZE));
+
+    int32_t result = 0;
+
+    while ((uint32_t)result < size)
+    {
+        UINT chunk = MIN(size - result, FAT_BOUNCE_SIZE);
+
+        UINT br = 0;
+        FRESULT fr = f_read(f, bounce, chunk, &br);
+        file->offset = f->fptr;
+
+        if (FR_OK != fr)
+        {
+            result = result > 0 ? result : -1;
+            break;
+        }
+
+        //Outside of FatFs, a fault here may read other files
+        memcpy(buffer + result, bounce, br);
+
+        result += br;
+
+        if (br < chunk)
+        {
+            break;
+        }
+    }
+
+    kfree(bounce);
+
+    return result;
 }
 
 static int32_t write(File *file, uint32_t size, uint8_t *buffer)
 {
-    if (file->private_data == NULL)
+    if (file->private_data == NULL || file->node->node_type == FT_DIRECTORY)
     {
         return -1;
     }
 
     FIL* f = (FIL*)file->private_data;
 
-    UINT bw = 0;
-    FRESULT fr = f_write(f, buffer, size, &bw);
-    file->offset = f->fptr;
-    if (FR_OK == fr)
+    if ((uint32_t)buffer < USER_OFFSET || 0 == size)
     {
-        return bw;
+        UINT bw = 0;
+        FRESULT fr = f_write(f, buffer, size, &bw);
+        file->offset = f->fptr;
+        if (FR_OK == fr)
+        {
+            return bw;
+        }
+
+        return -1;
     }
 
-    return -1;
+    uint8_t* bounce = (uint8_t*)kmalloc(MIN(size, FAT_BOUNCE_SIZE));
+
+    int32_t result = 0;
+
+    while ((uint32_t)result < size)
+    {
+        UINT chunk = MIN(size - result, FAT_BOUNCE_SIZE);
+
+        memcpy(bounce, buffer + result, chunk);
+
+        UINT bw = 0;
+        FRESULT fr = f_write(f, bounce, chunk, &bw);
+        file->offset = f->fptr;
+
+        if (FR_OK != fr)
+        {
+            result = result > 0 ? result : -1;
+            break;
+        }
+
+        result += bw;
+
+        if (bw < chunk)
+        {
+            break;
+        }
+    }
+
+    kfree(bounce);
+
+    return result;
 }
 
 static int32_t lseek(File *file, int32_t offset, int32_t whence)
 {
-    if (file->private_data == NULL)
+    if (file->private_data == NULL || file->node->node_type == FT_DIRECTORY)
     {
         return -1;
     }
@@ -417,41 +597,13 @@ static int32_t stat(FileSystemNode *node, struct stat* buf)
     //Screen_PrintF("fat stat [%s]\n", node->name);
 
     uint8_t target_path[128];
+    uint8_t* target = get_target_path(node, NULL, target_path);
 
-    FileSystemNode *n = node;
-    int char_index = 126;
-    memset(target_path, 0, 128);
-    while (NULL == n->mount_source)
+    if (NULL == target)
     {
-        int length = strlen(n->name);
-        char_index -= length;
-
-        if (char_index < 2)
-        {
-            return NULL;
-        }
-
-        strcpy_nonnull((char*)(target_path + char_index), n->name);
-        char_index -= 1;
-        target_path[char_index] = '/';
-
-        n = n->parent;
-    }
-
-    char number[8];
-    sprintf(number, 8, "%d", n->private_node_data);//volume nuber
-
-    target_path[char_index] = ':';
-    int length = strlen(number);
-    char_index -= length;
-    if (char_index < 0)
-    {
-        return NULL;
+        return -1;
     }
 
-    strcpy_nonnull((char*)(target_path + char_index), number);
-    uint8_t* target = target_path + char_index;
-
     //Screen_PrintF("fat stat target:[%s]\n", target);
 
     FILINFO file_info;
@@ -482,52 +634,36 @@ static BOOL open(File *file, uint32_t flags)
 
     FileSystemNode *node = file->node;
 
-    if (node->node_type == FT_DIRECTORY)
+    uint8_t target_path[128];
+    uint8_t* target = get_target_path(node, NULL, target_path);
+
+    if (NULL == target)
     {
-        return TRUE;
+        return FALSE;
     }
 
-    uint8_t target_path[128];
-
-    FileSystemNode *n = node;
-    int char_index = 126;
-    memset(target_path, 0, 128);
-    while (NULL == n->mount_source)
+    if (node->node_type == FT_DIRECTORY)
     {
-        int length = strlen(n->name);
-        char_index -= length;
+        FatDirCursor* cursor = (FatDirCursor*)kmalloc(sizeof(FatDirCursor));
+        memset((uint8_t*)cursor, 0, sizeof(FatDirCursor));
 
-        if (char_index < 2)
+        if (FR_OK == f_opendir(&cursor->dir, (TCHAR*)target))
         {
-            return NULL;
-        }
-
-        strcpy_nonnull((char*)(target_path + char_index), n->name);
-        char_index -= 1;
-        target_path[char_index] = '/';
+            file->private_data = cursor;
 
-        n = n->parent;
-    }
+            return TRUE;
+        }
 
-    char number[8];
-    sprintf(number, 8, "%d", n->private_node_data);//volume nuber
+        kfree(cursor);
 
-    target_path[char_index] = ':';
-    int length = strlen(number);
-    char_index -= length;
-    if (char_index < 0)
-    {
-        return NULL;
+        return FALSE;
     }
 
-    strcpy_nonnull((char*)(target_path + char_index), number);
-    uint8_t* target = target_path + char_index;
-
     //Screen_PrintF("fat open %s\n", target);
 
     int fatfs_mode = FA_READ;
 
-    switch (flags)
+    switch (flags & O_ACCMODE)
     {
     case O_RDONLY:
         fatfs_mode = FA_READ;
@@ -547,6 +683,12 @@ static BOOL open(File *file, uint32_t flags)
     FRESULT fr = f_open(f, (TCHAR*)target, fatfs_mode);
     if (FR_OK == fr)
     {
+        //fast seek mode can not extend files, so writable files follow the chain
+        if (FA_READ == fatfs_mode && 0 == (flags & O_NOFASTSEEK))
+        {
+            create_link_map(f);
+        }
+
         file->offset = f->fptr;
 
         file->private_data = f;
@@ -554,6 +696,8 @@ static BOOL open(File *file, uint32_t flags)
         return TRUE;
     }
 
+    kfree(f);
+
     return FALSE;
 }
 
@@ -564,10 +708,28 @@ static void close(File *file)
         return;
     }
 
+    if (file->node->node_type == FT_DIRECTORY)
+    {
+        FatDirCursor* cursor = (FatDirCursor*)file->private_data;
+
+        f_closedir(&cursor->dir);
+
+        kfree(cursor);
+
+        file->private_data = NULL;
+
+        return;
+    }
+
     FIL* f = (FIL*)file->private_data;
 
     f_close(f);
 
+    if (f->cltbl)
+    {
+        kfree(f->cltbl);
+    }
+
     kfree(f);
 
     file->private_data = NULL;
@@ -598,7 +760,10 @@ DRESULT disk_read (
 
     //if (sector >= RamDiskSize) return RES_PARERR;
 
-    g_mounted_block_devices[pdrv]->read_block(g_mounted_block_devices[pdrv], (uint32_t)sector, count, buff);
+    if (blockcache_read(g_mounted_block_devices[pdrv], (uint32_t)sector, count, buff) < 0)
+    {
+        return RES_ERROR;
+    }
 
     return RES_OK;
 }
@@ -614,7 +779,10 @@ DRESULT disk_write (
 
     //if (sector >= RamDiskSize) return RES_PARERR;
 
-    g_mounted_block_devices[pdrv]->write_block(g_mounted_block_devices[pdrv], (uint32_t)sector, count, (uint8_t*)buff);
+    if (blockcache_write(g_mounted_block_devices[pdrv], (uint32_t)sector, count, (uint8_t*)buff) < 0)
+    {
+        return RES_ERROR;
+    }
 
     return RES_OK;
 }
@@ -636,7 +804,7 @@ DRESULT disk_ioctl (
     switch (ctrl)
     {
     case CTRL_SYNC:
-        dr = RES_OK;
+        dr = blockcache_sync(g_mounted_block_devices[pdrv]) < 0 ? RES_ERROR : RES_OK;
         break;
     case GET_SECTOR_COUNT:
         f = fs_open(g_mounted_block_devices[pdrv], 0);
@@ -665,3 +833,36 @@ DRESULT disk_ioctl (
     }
     return dr;
 }
+
+//FatFs re-entrancy hooks: one sleeping mutex per volume
+
+int ff_cre_syncobj(BYTE vol, FF_SYNC_t* sobj)
+{
+    Mutex* mutex = (Mutex*)kmalloc(sizeof(Mutex));
+    mutex_init(mutex);
+
+    *sobj = mutex;
+
+    return 1;
+}
+
+int ff_del_syncobj(FF_SYNC_t sobj)
+{
+    mutex_destroy((Mutex*)sobj);
+    kfree(sobj);
+
+    return 1;
+}
+
+//Waits without timeout, FF_FS_TIMEOUT is not used
+int ff_req_grant(FF_SYNC_t sobj)
+{
+    mutex_lock((Mutex*)sobj);
+
+    return 1;
+}
+
+void ff_rel_grant(FF_SYNC_t sobj)
+{
+    mutex_unlock((Mutex*)sobj);
+}
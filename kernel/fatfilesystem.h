@@ -1,6 +1,8 @@
 #ifndef FATFILESYSTEM_H
 #define FATFILESYSTEM_H
 
+#include "common.h"
+
 void fatfs_initialize();
 
 #endif // FATFILESYSTEM_H
@@ -1621,6 +1621,31 @@ static DWORD clmt_clust (	/* <2:Error, >=2:Cluster number */
 	return cl + *tbl;	/* Return the cluster number */
 }
 
+
+/*-----------------------------------------------------------------------*/
+/* FAT handling - Clusters contiguous with the cluster of an offset      */
+/*-----------------------------------------------------------------------*/
+
+static DWORD clmt_contiguous (	/* Number of clusters from the one of ofs to the end of its fragment (0:Error) */
+	FIL* fp,		/* Pointer to the file object */
+	FSIZE_t ofs		/* File offset */
+)
+{
+	DWORD cl, ncl, *tbl;
+	FATFS *fs = fp->obj.fs;
+
+
+	tbl = fp->cltbl + 1;	/* Top of CLMT */
+	cl = (DWORD)(ofs / SS(fs) / fs->csize);	/* Cluster order from top of the file */
+	for (;;) {
+		ncl = *tbl++;			/* Number of cluters in the fragment */
+		if (ncl == 0) return 0;	/* End of table? (error) */
+		if (cl < ncl) break;	/* In this fragment? */
+		cl -= ncl; tbl++;		/* Next fragment */
+	}
+	return ncl - cl;
+}
+
 #endif	/* FF_USE_FASTSEEK */
 
 
@@ -3754,9 +3779,21 @@ FRESULT f_read (
 			cc = btr / SS(fs);					/* When remaining bytes >= sector size, */
 			if (cc > 0) {						/* Read maximum contiguous sectors directly */
 				if (csect + cc > fs->csize) {	/* Clip at cluster boundary */
-					cc = fs->csize - csect;
+#if FF_USE_FASTSEEK
+					if (fp->cltbl) {			/* With a CLMT, clip at the end of the fragment instead */
+						DWORD ncs = clmt_contiguous(fp, fp->fptr) * fs->csize;
+						if (ncs == 0) ncs = fs->csize;
+						if (csect + cc > ncs) cc = ncs - csect;
+					} else
+#endif
+					{
+						cc = fs->csize - csect;
+					}
 				}
 				if (disk_read(fs->pdrv, rbuff, sect, cc) != RES_OK) ABORT(fs, FR_DISK_ERR);
+#if FF_USE_FASTSEEK
+				fp->clust += (csect + cc - 1) / fs->csize;	/* Cluster of the last sector read (contiguous) */
+#endif
 #if !FF_FS_READONLY && FF_FS_MINIMIZE <= 2		/* Replace one of the read sectors with cached data if it contains a dirty sector */
 #if FF_FS_TINY
 				if (fs->wflag && fs->winsect - sect < cc) {
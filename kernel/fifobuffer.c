@@ -1,13 +1,23 @@
 #include "fifobuffer.h"
 #include "alloc.h"
 
+//Keystrokes, mouse packets and signals are a few bytes. A masked loop beats two memcpy calls for them.
+#define FIFO_SMALL_COPY 16
+
 FifoBuffer* fifobuffer_create(uint32_t capacity)
 {
+    uint32_t storage_size = 1;
+    while (storage_size < capacity)
+    {
+        storage_size <<= 1;
+    }
+
     FifoBuffer* fifo = (FifoBuffer*)kmalloc(sizeof(FifoBuffer));
     memset((uint8_t*)fifo, 0, sizeof(FifoBuffer));
-    fifo->data = (uint8_t*)kmalloc(capacity);
-    memset((uint8_t*)fifo->data, 0, capacity);
+    fifo->data = (uint8_t*)kmalloc(storage_size);
+    memset((uint8_t*)fifo->data, 0, storage_size);
     fifo->capacity= capacity;
+    fifo->mask = storage_size - 1;
 
     return fifo;
 }
@@ -50,6 +60,84 @@ uint32_t fifobuffer_get_free(FifoBuffer* fifo_buffer)
     return fifo_buffer->capacity - fifo_buffer->used_bytes;
 }
 
+uint8_t* fifobuffer_peek_readable(FifoBuffer* fifo_buffer, uint32_t* size)
+{
+    uint32_t until_end = fifo_buffer->mask + 1 - fifo_buffer->read_index;
+
+    *size = MIN(fifo_buffer->used_bytes, until_end);
+
+    return fifo_buffer->data + fifo_buffer->read_index;
+}
+
+void fifobuffer_commit_read(FifoBuffer* fifo_buffer, uint32_t size)
+{
+    size = MIN(size, fifo_buffer->used_bytes);
+
+    fifo_buffer->read_index = (fifo_buffer->read_index + size) & fifo_buffer->mask;
+    fifo_buffer->used_bytes -= size;
+}
+
+uint8_t* fifobuffer_peek_writable(FifoBuffer* fifo_buffer, uint32_t* size)
+{
+    uint32_t until_end = fifo_buffer->mask + 1 - fifo_buffer->write_index;
+
+    *size = MIN(fifo_buffer->capacity - fifo_buffer->used_bytes, until_end);
+
+    return fifo_buffer->data + fifo_buffer->write_index;
+}
+
+void fifobuffer_commit_write(FifoBuffer* fifo_buffer, uint32_t size)
+{
+    size = MIN(size, fifo_buffer->capacity - fifo_buffer->used_bytes);
+
+    fifo_buffer->write_index = (fifo_buffer->write_index + size) & fifo_buffer->mask;
+    fifo_buffer->used_bytes += size;
+}
+
+//At most two spans: up to the end of the storage, then from its beginning
+static void copy_in(FifoBuffer* fifo_buffer, const uint8_t* data, uint32_t count)
+{
+    uint32_t first = MIN(count, fifo_buffer->mask + 1 - fifo_buffer->write_index);
+
+    memcpy(fifo_buffer->data + fifo_buffer->write_index, data, first);
+    if (count > first)
+    {
+        memcpy(fifo_buffer->data, data + first, count - first);
+    }
+
+    fifo_buffer->write_index = (fifo_buffer->write_index + count) & fifo_buffer->mask;
+    fifo_buffer->used_bytes += count;
+}
+
+static void copy_out(FifoBuffer* fifo_buffer, uint8_t* data, uint32_t count)
+{
+    uint32_t first = MIN(count, fifo_buffer->mask + 1 - fifo_buffer->read_index);
+
+    memcpy(data, fifo_buffer->data + fifo_buffer->read_index, first);
+    if (count > first)
+    {
+        memcpy(data + first, fifo_buffer->data, count - first);
+    }
+
+    fifo_buffer->read_index = (fifo_buffer->read_index + count) & fifo_buffer->mask;
+    fifo_buffer->used_bytes -= count;
+}
+
+//Out of line and reached by a tail call, so the small paths need no stack frame
+static int32_t __attribute__((noinline)) enqueue_large(FifoBuffer* fifo_buffer, uint8_t* data, uint32_t count)
+{
+    copy_in(fifo_buffer, data, count);
+
+    return (int32_t)count;
+}
+
+static int32_t __attribute__((noinline)) dequeue_large(FifoBuffer* fifo_buffer, uint8_t* data, uint32_t count)
+{
+    copy_out(fifo_buffer, data, count);
+
+    return (int32_t)count;
+}
+
 int32_t fifobuffer_enqueue(FifoBuffer* fifo_buffer, uint8_t* data, uint32_t size)
 {
     if (size == 0)
@@ -57,18 +145,29 @@ int32_t fifobuffer_enqueue(FifoBuffer* fifo_buffer, uint8_t* data, uint32_t size
         return -1;
     }
 
-    uint32_t bytes_available = fifo_buffer->capacity - fifo_buffer->used_bytes;
+    uint32_t used_bytes = fifo_buffer->used_bytes;
 
-    uint32_t i = 0;
-    while (fifo_buffer->used_bytes < fifo_buffer->capacity && i < size)
+    uint32_t count = MIN(size, fifo_buffer->capacity - used_bytes);
+
+    if (count > FIFO_SMALL_COPY)
     {
-        fifo_buffer->data[fifo_buffer->write_index] = data[i++];
-        fifo_buffer->used_bytes++;
-        fifo_buffer->write_index++;
-        fifo_buffer->write_index %= fifo_buffer->capacity;
+        return enqueue_large(fifo_buffer, data, count);
     }
 
-    return (int32_t)i;
+    //Locals, since stores through uint8_t* could alias the FifoBuffer fields and force reloads
+    uint8_t* storage = fifo_buffer->data;
+    uint32_t index = fifo_buffer->write_index;
+    uint32_t mask = fifo_buffer->mask;
+
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        storage[(index + i) & mask] = data[i];
+    }
+
+    fifo_buffer->write_index = (index + count) & mask;
+    fifo_buffer->used_bytes = used_bytes + count;
+
+    return (int32_t)count;
 }
 
 int32_t fifobuffer_dequeue(FifoBuffer* fifo_buffer, uint8_t* data, uint32_t size)
@@ -78,49 +177,76 @@ int32_t fifobuffer_dequeue(FifoBuffer* fifo_buffer, uint8_t* data, uint32_t size
         return -1;
     }
 
-    if (0 == fifo_buffer->used_bytes)
+    uint32_t used_bytes = fifo_buffer->used_bytes;
+
+    //0 if the buffer is empty
+    uint32_t count = MIN(size, used_bytes);
+
+    if (count > FIFO_SMALL_COPY)
     {
-        //Buffer is empty
-        return 0;
+        return dequeue_large(fifo_buffer, data, count);
     }
 
-    uint32_t i = 0;
-    while (fifo_buffer->used_bytes > 0 && i < size)
+    uint8_t* storage = fifo_buffer->data;
+    uint32_t index = fifo_buffer->read_index;
+    uint32_t mask = fifo_buffer->mask;
+
+    for (uint32_t i = 0; i < count; ++i)
     {
-        data[i++] = fifo_buffer->data[fifo_buffer->read_index];
-        fifo_buffer->used_bytes--;
-        fifo_buffer->read_index++;
-        fifo_buffer->read_index %= fifo_buffer->capacity;
+        data[i] = storage[(index + i) & mask];
     }
 
-    return i;
+    fifo_buffer->read_index = (index + count) & mask;
+    fifo_buffer->used_bytes = used_bytes - count;
+
+    return (int32_t)count;
 }
 
 int32_t fifobuffer_enqueue_from_other(FifoBuffer* fifo_buffer, FifoBuffer* other)
 {
-    uint32_t otherSize = fifobuffer_get_size(other);
+    uint32_t count = MIN(fifo_buffer->capacity - fifo_buffer->used_bytes, other->used_bytes);
 
-    if (otherSize == 0)
+    if (count <= FIFO_SMALL_COPY)
     {
-        return 0;
-    }
+        //Storage to storage, like the small paths of enqueue and dequeue
+        uint8_t* target = fifo_buffer->data;
+        uint32_t target_index = fifo_buffer->write_index;
+        uint32_t target_mask = fifo_buffer->mask;
+
+        uint8_t* source = other->data;
+        uint32_t source_index = other->read_index;
+        uint32_t source_mask = other->mask;
 
-    uint32_t bytes_available = fifo_buffer->capacity - fifo_buffer->used_bytes;
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            target[(target_index + i) & target_mask] = source[(source_index + i) & source_mask];
+        }
+
+        fifo_buffer->write_index = (target_index + count) & target_mask;
+        fifo_buffer->used_bytes += count;
+
+        other->read_index = (source_index + count) & source_mask;
+        other->used_bytes -= count;
+
+        return (int32_t)count;
+    }
 
     uint32_t i = 0;
-    while (fifo_buffer->used_bytes < fifo_buffer->capacity && other->used_bytes > 0)
+
+    //Copies straight out of the other storage, one contiguous span per iteration
+    while (i < count)
     {
-        fifo_buffer->data[fifo_buffer->write_index] = other->data[other->read_index];
-        fifo_buffer->used_bytes++;
-        fifo_buffer->write_index++;
-        fifo_buffer->write_index %= fifo_buffer->capacity;
+        uint32_t span = 0;
+        uint8_t* source = fifobuffer_peek_readable(other, &span);
+
+        span = MIN(span, count - i);
 
-        other->used_bytes--;
-        other->read_index++;
-        other->read_index %= other->capacity;
+        copy_in(fifo_buffer, source, span);
 
-        i++;
+        fifobuffer_commit_read(other, span);
+
+        i += span;
     }
 
     return (int32_t)i;
-}
\ No newline at end of file
+}
@@ -10,6 +10,7 @@ typedef struct FifoBuffer
     uint32_t read_index;
     uint32_t capacity;
     uint32_t used_bytes;
+    uint32_t mask;//storage is capacity rounded up to a power of two, indexes wrap with this mask
 } FifoBuffer;
 
 FifoBuffer* fifobuffer_create(uint32_t capacity);
@@ -23,4 +24,11 @@ int32_t fifobuffer_enqueue(FifoBuffer* fifo_buffer, uint8_t* data, uint32_t size
 int32_t fifobuffer_dequeue(FifoBuffer* fifo_buffer, uint8_t* data, uint32_t size);
 int32_t fifobuffer_enqueue_from_other(FifoBuffer* fifo_buffer, FifoBuffer* other);
 
+//Zero-copy access to the contiguous span at the read or write position. The span may be shorter than
+//the used or free bytes when the data wraps. Commit what was consumed or produced afterwards.
+uint8_t* fifobuffer_peek_readable(FifoBuffer* fifo_buffer, uint32_t* size);
+void fifobuffer_commit_read(FifoBuffer* fifo_buffer, uint32_t size);
+uint8_t* fifobuffer_peek_writable(FifoBuffer* fifo_buffer, uint32_t* size);
+void fifobuffer_commit_write(FifoBuffer* fifo_buffer, uint32_t size);
+
 #endif // FIFOBUFFER_H
@@ -32,6 +32,7 @@ void framebuffer_initialize(uint8_t* p_address, uint8_t* v_address)
     device.ioctl = fb_ioctl;
     device.mmap = fb_mmap;
     device.munmap = fb_munmap;
+    device.passable = TRUE;
 
     devfs_register_device(&device);
 }
@@ -1,6 +1,9 @@
 #include "fs.h"
 #include "alloc.h"
 #include "rootfs.h"
+#include "list.h"
+#include "pagecache.h"
+#include "dcache.h"
 
 FileSystemNode *g_fs_root = NULL; // The root of the filesystem.
 
@@ -13,10 +16,13 @@ void fs_initialize()
 {
     memset((uint8_t*)g_registered_filesystems, 0, sizeof(g_registered_filesystems));
 
+    dcache_initialize();
+
     g_fs_root = rootfs_initialize();
 
     fs_mkdir(g_fs_root, "dev", 0);
     fs_mkdir(g_fs_root, "initrd", 0);
+    fs_mkdir(g_fs_root, "tmp", 0);
 }
 
 FileSystemNode* fs_get_root_node()
@@ -174,9 +180,38 @@ BOOL fs_resolve_path(const char* path, char* buffer, int buffer_size)
 
 uint32_t fs_read(File *file, uint32_t size, uint8_t *buffer)
 {
-    if (file->node->read != 0)
+    FileSystemNode* node = file->node;
+
+    PageCache* cache = NULL;
+
+    //Regular files are read through their page cache, created here on the first read.
+    //It also makes reads see writes through shared mappings. Reclaim drops caches nobody uses.
+    if (node->node_type == FT_FILE && node->lseek && file->offset >= 0 &&
+        FALSE == CHECK_ACCESS(file->flags, O_WRONLY) && 0 == (file->flags & O_DIRECT))
+    {
+        cache = pagecache_get(node);
+    }
+
+    //A storage cache (tmpfs) is read by the filesystem itself
+    if (cache && cache->file)
+    {
+        pagecache_acquire(cache);
+
+        int32_t bytes_read = pagecache_read(cache, file->offset, size, buffer);
+
+        pagecache_release(cache);
+
+        if (bytes_read > 0)
+        {
+            node->lseek(file, file->offset + bytes_read, 0);//SEEK_SET
+        }
+
+        return bytes_read;
+    }
+
+    if (node->read != 0)
     {
-        return file->node->read(file, size, buffer);
+        return node->read(file, size, buffer);
     }
 
     return -1;
@@ -184,14 +219,197 @@ uint32_t fs_read(File *file, uint32_t size, uint8_t *buffer)
 
 uint32_t fs_write(File *file, uint32_t size, uint8_t *buffer)
 {
-    if (file->node->write != 0)
+    FileSystemNode* node = file->node;
+
+    if (node->write != 0)
     {
-        return file->node->write(file, size, buffer);
+        int32_t offset = file->offset;
+
+        //Write through: the filesystem stays the owner of the data, so nothing is lost to a crash
+        //and there is no dirty page to track. Cached pages are patched to stay current.
+        int32_t written = node->write(file, size, buffer);
+
+        PageCache* cache = node->page_cache;
+
+        if (cache && cache->file && written > 0 && offset >= 0)
+        {
+            node->length = MAX(node->length, (uint32_t)(offset + written));
+
+            pagecache_update(cache, offset, written, buffer);
+        }
+
+        return written;
     }
 
     return -1;
 }
 
+//Writes all of size bytes unless out fails, then returns what was written before or the error.
+static int32_t write_all(File* out, uint32_t size, uint8_t* buffer)
+{
+    uint32_t written = 0;
+    while (written < size)
+    {
+        int32_t result = (int32_t)fs_write(out, size - written, buffer + written);
+
+        if (result <= 0)
+        {
+            return written > 0 ? (int32_t)written : result;
+        }
+
+        written += result;
+    }
+
+    return written;
+}
+
+//Moves up to size bytes from in to out at their offsets without a user buffer (sendfile, splice).
+//Regular files that already have a page cache (read or mapped ones, tmpfs) are sent straight out of it.
+//Other sources are read into one kernel page. Splice does not create a cache: sendfile usually
+//streams a file once, and its pages would push the caches of files in use out.
+//Stream sources block only until the first data, like read. Returns the byte count moved or a negative error.
+int32_t fs_splice(File* in, File* out, uint32_t size)
+{
+    FileSystemNode* node = in->node;
+
+    if (NULL == out->node->write || (NULL == node->read && NULL == node->page_cache))
+    {
+        return -1;
+    }
+
+    PageCache* cache = NULL;
+
+    if (node->node_type == FT_FILE && node->lseek)
+    {
+        cache = node->page_cache;
+    }
+
+    if (cache)
+    {
+        pagecache_acquire(cache);
+    }
+
+    uint8_t* bounce = NULL;
+
+    int32_t result = 0;
+    uint32_t moved = 0;
+
+    while (moved < size)
+    {
+        uint32_t chunk = MIN(size - moved, PAGESIZE_4K);
+
+        int32_t written = 0;
+
+        if (cache)
+        {
+            if (in->offset < 0 || (uint32_t)in->offset >= node->length)
+            {
+                break;
+            }
+
+            uint32_t page_index = in->offset / PAGESIZE_4K;
+            uint32_t page_offset = in->offset % PAGESIZE_4K;
+
+            chunk = MIN(chunk, PAGESIZE_4K - page_offset);
+            chunk = MIN(chunk, node->length - in->offset);
+
+            uint8_t* source = NULL;
+
+            if (NULL == cache->file && NULL == cache->pages[page_index])
+            {
+                //Hole of an in-memory file
+                if (NULL == bounce)
+                {
+                    bounce = (uint8_t*)kmalloc(PAGESIZE_4K);
+                }
+                memset(bounce, 0, chunk);
+                source = bounce;
+            }
+            else
+            {
+                source = pagecache_get_page(cache, page_index);
+
+                if (NULL == source)
+                {
+                    result = -1;
+                    break;
+                }
+
+                source += page_offset;
+            }
+
+            written = (int32_t)fs_write(out, chunk, source);
+
+            if (written > 0)
+            {
+                fs_lseek(in, in->offset + written, 0);//SEEK_SET
+            }
+        }
+        else
+        {
+            if (moved > 0 && node->read_test_ready && FALSE == node->read_test_ready(in))
+            {
+                break;
+            }
+
+            if (NULL == bounce)
+            {
+                bounce = (uint8_t*)kmalloc(PAGESIZE_4K);
+            }
+
+            int32_t bytes_read = (int32_t)fs_read(in, chunk, bounce);
+
+            if (bytes_read <= 0)
+            {
+                result = bytes_read;
+                break;
+            }
+
+            //What was read from a stream can not be put back, so all of it goes out
+            written = write_all(out, bytes_read, bounce);
+
+            if (written >= 0 && written < bytes_read)
+            {
+                moved += written;
+                break;
+            }
+
+            chunk = bytes_read;
+        }
+
+        if (written <= 0)
+        {
+            result = written;
+            break;
+        }
+
+        moved += written;
+
+        if ((uint32_t)written < chunk)
+        {
+            //out is full for now
+            break;
+        }
+    }
+
+    if (bounce)
+    {
+        kfree(bounce);
+    }
+
+    if (cache)
+    {
+        pagecache_release(cache);
+    }
+
+    if (moved > 0)
+    {
+        return moved;
+    }
+
+    return result;
+}
+
 File *fs_open(FileSystemNode *node, uint32_t flags)
 {
     return fs_open_for_process(thread_get_current(), node, flags);
@@ -223,6 +441,11 @@ File *fs_open_for_process(Thread* thread, FileSystemNode *node, uint32_t flags)
 
         if (success)
         {
+            if (node->shareable)
+            {
+                ++node->share_count;
+            }
+
             //Screen_PrintF("Opened:%s\n", file->node->name);
             int32_t fd = process_add_file(file->process, file);
 
@@ -247,14 +470,127 @@ File *fs_open_for_process(Thread* thread, FileSystemNode *node, uint32_t flags)
     return NULL;
 }
 
+//Opens the node of file again for the process of thread, at the same descriptor number and offset.
+//A shareable node gets one more File instead, other single_open nodes are not inherited.
+File* fs_clone_for_process(Thread* thread, File* file)
+{
+    Process* process = thread->owner;
+
+    FileSystemNode* node = file->node;
+
+    if (NULL == node->open || NULL != process_get_file(process, file->fd))
+    {
+        return NULL;
+    }
+
+    if (node->single_open && FALSE == node->shareable)
+    {
+        return NULL;
+    }
+
+    File* clone = kmalloc(sizeof(File));
+    memset((uint8_t*)clone, 0, sizeof(File));
+    clone->node = node;
+    clone->process = process;
+    clone->thread = thread;
+    clone->flags = file->flags;
+
+    if (node->shareable)
+    {
+        ++node->share_count;
+    }
+    else if (FALSE == node->open(clone, file->flags))
+    {
+        kfree(clone);
+        return NULL;
+    }
+
+    if (process_add_file_at(process, clone, file->fd) < 0)
+    {
+        fs_close(clone);
+        return NULL;
+    }
+
+    if (file->offset > 0 && node->lseek)
+    {
+        node->lseek(clone, file->offset, 0);//SEEK_SET
+    }
+    clone->offset = file->offset;
+
+    return clone;
+}
+
+//Opens the node of file again without giving it a descriptor, so it can travel in a socket message
+File* fs_open_detached(File* file)
+{
+    FileSystemNode* node = file->node;
+
+    if (NULL == node->open)
+    {
+        return NULL;
+    }
+
+    File* detached = kmalloc(sizeof(File));
+    memset((uint8_t*)detached, 0, sizeof(File));
+    detached->node = node;
+    detached->fd = -1;
+    detached->flags = file->flags;
+
+    if (FALSE == node->open(detached, file->flags))
+    {
+        kfree(detached);
+        return NULL;
+    }
+
+    if (file->offset > 0 && node->lseek)
+    {
+        node->lseek(detached, file->offset, 0);//SEEK_SET
+    }
+    detached->offset = file->offset;
+
+    return detached;
+}
+
+//Gives a detached File the lowest free descriptor of the process of thread
+int32_t fs_attach_to_process(Thread* thread, File* file)
+{
+    file->process = thread->owner;
+    file->thread = thread;
+
+    int32_t fd = process_add_file(file->process, file);
+
+    if (fd < 0)
+    {
+        file->process = NULL;
+        file->thread = NULL;
+        file->fd = -1;
+    }
+
+    return fd;
+}
+
 void fs_close(File *file)
 {
-    if (file->node->close != NULL)
+    FileSystemNode* node = file->node;
+
+    BOOL last = TRUE;
+
+    if (node->shareable)
     {
-        file->node->close(file);
+        --node->share_count;
+
+        last = (0 == node->share_count);
     }
 
-    process_remove_file(file->process, file);
+    if (last && node->close != NULL)
+    {
+        node->close(file);
+    }
+
+    if (file->process)
+    {
+        process_remove_file(file->process, file);
+    }
 
     kfree(file);
 }
@@ -263,7 +599,14 @@ int32_t fs_unlink(FileSystemNode* node, uint32_t flags)
 {
     if (node->unlink)
     {
-        return node->unlink(node, flags);
+        int32_t result = node->unlink(node, flags);
+
+        if (result >= 0)
+        {
+            dcache_invalidate_node(node);
+        }
+
+        return result;
     }
 
     return -1;
@@ -281,6 +624,19 @@ int32_t fs_ioctl(File *file, int32_t request, void * argp)
 
 int32_t fs_lseek(File *file, int32_t offset, int32_t whence)
 {
+    if ((file->node->node_type & FT_DIRECTORY) == FT_DIRECTORY)
+    {
+        //offset of a directory is the index of the next entry, only rewinddir/seekdir are supported
+        if (0 == whence && offset >= 0)//SEEK_SET
+        {
+            file->offset = offset;
+
+            return offset;
+        }
+
+        return -1;
+    }
+
     if (file->node->lseek != NULL)
     {
         return file->node->lseek(file, offset, whence);
@@ -293,6 +649,13 @@ int32_t fs_ftruncate(File* file, int32_t length)
 {
     if (file->node->ftruncate != NULL)
     {
+        if (file->node->page_cache)
+        {
+            pagecache_writeback(file->node->page_cache);
+        }
+
+        pagecache_invalidate(file->node);
+
         return file->node->ftruncate(file, length);
     }
 
@@ -378,6 +741,56 @@ FileSystemDirent *fs_readdir(FileSystemNode *node, uint32_t index)
     return NULL;
 }
 
+static FileSystemNode* finddir_cached(FileSystemNode *directory, char *name)
+{
+    if (FALSE == directory->cache_lookups)
+    {
+        return directory->finddir(directory, name);
+    }
+
+    BOOL found = FALSE;
+    FileSystemNode* node = dcache_lookup(directory, name, &found);
+
+    if (FALSE == found)
+    {
+        node = directory->finddir(directory, name);
+
+        dcache_insert(directory, name, node);
+    }
+
+    return node;
+}
+
+//Like fs_readdir, for a directory opened as file. Sequential indexes are cheap for drivers having readdir_file.
+//If length is not NULL it receives the size of the entry, so listings do not need a stat per entry.
+FileSystemDirent* fs_readdir_file(File* file, uint32_t index, uint32_t* length)
+{
+    FileSystemNode* node = file->node;
+
+    if (node->readdir_file)
+    {
+        return node->readdir_file(file, index, length);
+    }
+
+    FileSystemDirent* dirent = fs_readdir(node, index);
+
+    if (dirent && length)
+    {
+        *length = 0;
+
+        FileSystemNode* child = fs_finddir(node, dirent->name);
+
+        struct stat buf;
+        memset((uint8_t*)&buf, 0, sizeof(buf));
+        if (child && fs_stat(child, &buf) == 0)
+        {
+            *length = buf.st_size;
+        }
+    }
+
+    return dirent;
+}
+
 FileSystemNode *fs_finddir(FileSystemNode *node, char *name)
 {
     //Screen_PrintF("fs_finddir: name:%s\n", name);
@@ -390,12 +803,12 @@ FileSystemNode *fs_finddir(FileSystemNode *node, char *name)
         }
         else
         {
-            return node->mount_point->finddir(node->mount_point, name);
+            return finddir_cached(node->mount_point, name);
         }
     }
     else if ( (node->node_type & FT_DIRECTORY) == FT_DIRECTORY && node->finddir != NULL )
     {
-        return node->finddir(node, name);
+        return finddir_cached(node, name);
     }
 
     return NULL;
@@ -407,24 +820,51 @@ BOOL fs_mkdir(FileSystemNode *node, const char *name, uint32_t flags)
     {
         if (node->mount_point->mkdir)
         {
+            dcache_invalidate(node->mount_point, name);
+
             return node->mount_point->mkdir(node->mount_point, name, flags);
         }
     }
     else if ( (node->node_type & FT_DIRECTORY) == FT_DIRECTORY && node->mkdir != NULL )
     {
+        dcache_invalidate(node, name);
+
         return node->mkdir(node, name, flags);
     }
 
     return FALSE;
 }
 
-void* fs_mmap(File* file, uint32_t size, uint32_t offset, uint32_t flags)
+FileSystemNode* fs_create(FileSystemNode *node, const char *name, uint32_t flags)
+{
+    if ( (node->node_type & FT_MOUNT_POINT) == FT_MOUNT_POINT && node->mount_point != NULL )
+    {
+        node = node->mount_point;
+    }
+
+    if ( (node->node_type & FT_DIRECTORY) == FT_DIRECTORY && node->create != NULL )
+    {
+        dcache_invalidate(node, name);
+
+        return node->create(node, name, flags);
+    }
+
+    return NULL;
+}
+
+//Drivers mapping their own memory implement mmap, regular files are mapped from their page cache
+void* fs_mmap(File* file, uint32_t size, uint32_t offset, uint32_t prot, uint32_t flags)
 {
     if (file->node->mmap)
     {
         return file->node->mmap(file, size, offset, flags);
     }
 
+    if (file->node->node_type == FT_FILE && (offset % PAGESIZE_4K) == 0)
+    {
+        return pagecache_mmap(file, size, offset, prot, flags);
+    }
+
     return NULL;
 }
 
@@ -638,3 +1078,12 @@ BOOL fs_check_mount(const char *source, const char *target, const char *fsType,
 
     return fs->check_mount(source, target, flags, data);
 }
+
+//Called by drivers when the node may have become readable or writable. Safe in interrupt handlers.
+void fs_node_notify(FileSystemNode* node)
+{
+    if (node)
+    {
+        waitqueue_wake_all(&node->waiters);
+    }
+}
@@ -2,11 +2,18 @@
 #define FS_H
 
 #include "common.h"
+#include "waitqueue.h"
 
 #define O_ACCMODE   0003
 #define O_RDONLY    00
 #define O_WRONLY    01
 #define O_RDWR      02
+#define O_CREAT     0100
+#define O_EXCL      0200
+#define O_TRUNC     01000
+#define O_APPEND    02000
+#define O_DIRECT    040000 //reads of regular files go to the driver instead of the page cache
+#define O_NOFASTSEEK 0x80000000 //kernel only: FAT files follow the cluster chain instead of getting a link map
 #define CHECK_ACCESS(flags, test) ((flags & O_ACCMODE) == test)
 
 typedef enum FileType
@@ -33,6 +40,8 @@ typedef struct FileSystemDirent FileSystemDirent;
 typedef struct Process Process;
 typedef struct Thread Thread;
 typedef struct File File;
+typedef struct List List;
+typedef struct PageCache PageCache;
 
 struct stat;
 
@@ -47,8 +56,10 @@ typedef int32_t (*LseekFunction)(File *file, int32_t offset, int32_t whence);
 typedef int32_t (*FtruncateFunction)(File *file, int32_t length);
 typedef int32_t (*StatFunction)(FileSystemNode *node, struct stat *buf);
 typedef FileSystemDirent * (*ReadDirFunction)(FileSystemNode*,uint32_t);
+typedef FileSystemDirent * (*ReadDirFileFunction)(File* file, uint32_t index, uint32_t* length);
 typedef FileSystemNode * (*FindDirFunction)(FileSystemNode*,char *name);
 typedef BOOL (*MkDirFunction)(FileSystemNode* node, const char *name, uint32_t flags);
+typedef FileSystemNode * (*CreateFunction)(FileSystemNode* node, const char *name, uint32_t flags);
 typedef void* (*MmapFunction)(File* file, uint32_t size, uint32_t offset, uint32_t flags);
 typedef BOOL (*MunmapFunction)(File* file, void* address, uint32_t size);
 
@@ -84,8 +95,10 @@ typedef struct FileSystemNode
     FtruncateFunction ftruncate;
     StatFunction stat;
     ReadDirFunction readdir;
+    ReadDirFileFunction readdir_file;//optional, reads through a cursor kept in the open File
     FindDirFunction finddir;
     MkDirFunction mkdir;
+    CreateFunction create;//optional, creates a regular file in the directory
     MmapFunction mmap;
     MunmapFunction munmap;
     FileSystemNode *first_child;
@@ -94,6 +107,13 @@ typedef struct FileSystemNode
     FileSystemNode *mount_point;//only used in mounts
     FileSystemNode *mount_source;//only used in mounts
     void* private_node_data;
+    WaitQueue waiters;//threads blocked in select/poll/epoll_wait on this node
+    PageCache* page_cache;//pages of the file mapped by processes, created on first use
+    BOOL cache_lookups;//finddir results stay valid until mkdir/unlink, so they may be kept in the dentry cache
+    BOOL passable;//open/close do not track the opening thread, so a File of it may be sent over a unix socket (regular files always may)
+    BOOL single_open;//open sets the node up and close destroys it (socket, epoll), so fork and exec must not open it again
+    BOOL shareable;//a single_open node not tied to a process: fork and exec give the new process a File of it without opening
+    uint32_t share_count;//Files of a shareable node, close runs when the last one goes
 } FileSystemNode;
 
 typedef struct FileSystemDirent
@@ -103,6 +123,13 @@ typedef struct FileSystemDirent
     uint32_t inode;
 } FileSystemDirent;
 
+//Layout shared with userspace (soso_read_dir_stat)
+typedef struct FileSystemDirentStat
+{
+    FileSystemDirent dirent;
+    uint32_t size;
+} FileSystemDirentStat;
+
 //Per open
 typedef struct File
 {
@@ -137,11 +164,19 @@ struct stat
     uint32_t/*long       */ st_spare4[2];
 };
 
+struct iovec {
+               void  *iov_base;    /* Starting address */
+               size_t iov_len;     /* Number of bytes to transfer */
+           };
 
 uint32_t fs_read(File* file, uint32_t size, uint8_t* buffer);
 uint32_t fs_write(File* file, uint32_t size, uint8_t* buffer);
+int32_t fs_splice(File* in, File* out, uint32_t size);
 File* fs_open(FileSystemNode* node, uint32_t flags);
 File* fs_open_for_process(Thread* thread, FileSystemNode* node, uint32_t flags);
+File* fs_clone_for_process(Thread* thread, File* file);
+File* fs_open_detached(File* file);
+int32_t fs_attach_to_process(Thread* thread, File* file);
 void fs_close(File* file);
 int32_t fs_unlink(FileSystemNode* node, uint32_t flags);
 int32_t fs_ioctl(File* file, int32_t request, void* argp);
@@ -149,13 +184,17 @@ int32_t fs_lseek(File* file, int32_t offset, int32_t whence);
 int32_t fs_ftruncate(File* file, int32_t length);
 int32_t fs_stat(FileSystemNode *node, struct stat *buf);
 FileSystemDirent* fs_readdir(FileSystemNode* node, uint32_t index);
+FileSystemDirent* fs_readdir_file(File* file, uint32_t index, uint32_t* length);
 FileSystemNode* fs_finddir(FileSystemNode* node, char* name);
 BOOL fs_mkdir(FileSystemNode *node, const char* name, uint32_t flags);
-void* fs_mmap(File* file, uint32_t size, uint32_t offset, uint32_t flags);
+FileSystemNode* fs_create(FileSystemNode *node, const char* name, uint32_t flags);
+void* fs_mmap(File* file, uint32_t size, uint32_t offset, uint32_t prot, uint32_t flags);
 BOOL fs_munmap(File* file, void* address, uint32_t size);
 int fs_get_node_path(FileSystemNode* node, char* buffer, uint32_t buffer_size);
 BOOL fs_resolve_path(const char* path, char* buffer, int buffer_size);
 
+void fs_node_notify(FileSystemNode* node);
+
 void fs_initialize();
 FileSystemNode* fs_get_root_node();
 FileSystemNode* fs_get_node(const char* path);
@@ -37,6 +37,13 @@ void gfx_initialize(uint32_t* pixels, uint32_t width, uint32_t height, uint32_t
     {
         uint32_t offset = i * PAGESIZE_4K;
 
+        //Whole 4MB stretches take a single entry if the physical address is 4MB aligned too
+        if (needed_page_count - i >= 1024 && vmm_add_huge_page_to_pd(v_address + offset, p_address + offset, 0))
+        {
+            i += 1023;
+            continue;
+        }
+
         vmm_add_page_to_pd(v_address + offset, p_address + offset, 0);
     }
 
@@ -33,6 +33,7 @@ typedef struct Reader
 } Reader;
 
 static List* g_readers = NULL;
+static FileSystemNode* g_keyboard_node = NULL;
 
 static void handle_keyboard_interrupt(Registers *regs);
 
@@ -53,7 +54,7 @@ void keyboard_initialize()
 
     g_readers = list_create();
 
-    devfs_register_device(&device);
+    g_keyboard_node = devfs_register_device(&device);
 
     interrupt_register(IRQ1, handle_keyboard_interrupt);
 }
@@ -201,5 +202,7 @@ static void handle_keyboard_interrupt(Registers *regs)
         }
     }
 
+    fs_node_notify(g_keyboard_node);
+
     console_send_key(scancode);
 }
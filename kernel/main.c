@@ -27,6 +27,8 @@
 #include "console.h"
 #include "terminal.h"
 #include "socket.h"
+#include "blockcache.h"
+#include "tmpfs.h"
 
 extern uint32_t _start;
 extern uint32_t _end;
@@ -58,32 +60,17 @@ int execute_file(const char *path, char *const argv[], char *const envp[], FileS
         FileSystemNode* node = fs_get_node_absolute_or_relative(path, process);
         if (node)
         {
-            File* f = fs_open(node, 0);
-            if (f)
+            char* name = "userProcess";
+            if (NULL != argv && NULL != argv[0])
             {
-                void* image = kmalloc(node->length);
-
-                int32_t bytes_read = fs_read(f, node->length, image);
-
-                if (bytes_read > 0)
-                {
-                    char* name = "userProcess";
-                    if (NULL != argv && NULL != argv[0])
-                    {
-                        name = argv[0];
-                    }
-                    Process* new_process = process_create_from_elf_data(name, image, argv, envp, process, tty);
-
-                    if (new_process)
-                    {
-                        result = new_process->pid;
-                    }
-                }
-                fs_close(f);
-
-                kfree(image);
+                name = argv[0];
             }
+            Process* new_process = process_create_from_file(name, 0, node, argv, envp, process, tty);
 
+            if (new_process)
+            {
+                result = new_process->pid;
+            }
         }
     }
 
@@ -165,8 +152,15 @@ int kmain(struct Multiboot *mboot_ptr)
 
     ramdisk_create("ramdisk1", 20*1024*1024);
 
+    blockcache_initialize();
     fatfs_initialize();
 
+    tmpfs_initialize();
+    if (FALSE == fs_mount("tmpfs", "/tmp", "tmpfs", 0, 0))
+    {
+        printkf("Could not mount /tmp\n");
+    }
+
     net_initialize();
 
     printkf("System started!\n");
@@ -184,9 +178,9 @@ int kmain(struct Multiboot *mboot_ptr)
     else
     {
         printkf("Initrd found at %x - %x (%d bytes)\n", initrd_location, initrd_end_location, initrd_size);
-        if ((uint32_t)KERN_PD_AREA_BEGIN < (uint32_t)initrd_end_location)
+        if ((uint32_t)RESERVED_AREA < (uint32_t)initrd_end_location)
         {
-            printkf("Initrd must reside below %x !!!\n", KERN_PD_AREA_BEGIN);
+            printkf("Initrd must reside below %x !!!\n", RESERVED_AREA);
             PANIC("Initrd image is too big!");
         }
         memcpy((uint8_t*)*(uint32_t*)fs_get_node("/dev/ramdisk1")->private_node_data, initrd_location, initrd_size);
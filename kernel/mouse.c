@@ -25,6 +25,7 @@ static int32_t mouse_read(File *file, uint32_t size, uint8_t *buffer);
 uint8_t g_mouse_packet[MOUSE_PACKET_SIZE];
 
 static List* g_readers = NULL;
+static FileSystemNode* g_mouse_node = NULL;
 
 static Spinlock g_readers_lock;
 
@@ -40,7 +41,7 @@ void initialize_mouse()
     device.read = mouse_read;
     interrupt_register(IRQ12, handle_mouse_interrupt);
 
-    devfs_register_device(&device);
+    g_mouse_node = devfs_register_device(&device);
 
     memset(g_mouse_packet, 0, MOUSE_PACKET_SIZE);
 
@@ -208,6 +209,8 @@ static void handle_mouse_interrupt(Registers *regs)
         }
 
         spinlock_unlock(&g_readers_lock);
+
+        fs_node_notify(g_mouse_node);
     }
 
     //printkf("mouse:%d\n", data);
@@ -0,0 +1,85 @@
+#include "mutex.h"
+#include "process.h"
+
+void mutex_init(Mutex* mutex)
+{
+    mutex->owner = NULL;
+    waitqueue_initialize(&mutex->waiters);
+}
+
+//Must not be held
+void mutex_destroy(Mutex* mutex)
+{
+    waitqueue_destroy(&mutex->waiters);
+}
+
+void mutex_lock(Mutex* mutex)
+{
+    BOOL interrupts_enabled = is_interrupts_enabled();
+    disable_interrupts();
+
+    Thread* thread = thread_get_current();
+
+    if (mutex->owner == thread)
+    {
+        PANIC("mutex_lock: already held by the current thread");
+    }
+
+    while (mutex->owner != NULL)
+    {
+        //Also woken by signals, so check again
+        waitqueue_sleep(&mutex->waiters);
+    }
+
+    mutex->owner = thread;
+    ++thread->held_mutex_count;
+
+    if (interrupts_enabled)
+    {
+        enable_interrupts();
+    }
+}
+
+BOOL mutex_try_lock(Mutex* mutex)
+{
+    BOOL result = FALSE;
+
+    BOOL interrupts_enabled = is_interrupts_enabled();
+    disable_interrupts();
+
+    if (NULL == mutex->owner)
+    {
+        mutex->owner = thread_get_current();
+        ++mutex->owner->held_mutex_count;
+
+        result = TRUE;
+    }
+
+    if (interrupts_enabled)
+    {
+        enable_interrupts();
+    }
+
+    return result;
+}
+
+void mutex_unlock(Mutex* mutex)
+{
+    BOOL interrupts_enabled = is_interrupts_enabled();
+    disable_interrupts();
+
+    if (mutex->owner)
+    {
+        --mutex->owner->held_mutex_count;
+    }
+
+    mutex->owner = NULL;
+
+    //Wake one waiter, it takes the mutex when it runs unless someone else did meanwhile
+    waitqueue_wake_one(&mutex->waiters);
+
+    if (interrupts_enabled)
+    {
+        enable_interrupts();
+    }
+}
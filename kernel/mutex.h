@@ -0,0 +1,21 @@
+#ifndef MUTEX_H
+#define MUTEX_H
+
+#include "common.h"
+#include "waitqueue.h"
+
+//Sleeping lock for code that may run with interrupts enabled (eg. around device I/O).
+//Not recursive. Waiters sleep in the WaitQueue of the mutex instead of spinning.
+typedef struct Mutex
+{
+    Thread* owner;
+    WaitQueue waiters;
+} Mutex;
+
+void mutex_init(Mutex* mutex);
+void mutex_destroy(Mutex* mutex);
+void mutex_lock(Mutex* mutex);
+BOOL mutex_try_lock(Mutex* mutex);
+void mutex_unlock(Mutex* mutex);
+
+#endif // MUTEX_H
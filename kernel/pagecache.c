@@ -0,0 +1,611 @@
+#include "pagecache.h"
+#include "alloc.h"
+#include "vmm.h"
+#include "process.h"
+
+#define SEEK_SET 0
+
+//Caches read from files may take up to 1/PAGECACHE_MAX_SHARE of the page frames before reclaim starts
+#define PAGECACHE_MAX_SHARE 4
+
+static PageCache* g_lru_head = NULL;
+static PageCache* g_lru_tail = NULL;
+
+//Pages of caches read from files, storage caches are file data and do not count
+static uint32_t g_file_page_count = 0;
+
+static void lru_unlink(PageCache* cache)
+{
+    if (cache->lru_previous)
+    {
+        cache->lru_previous->lru_next = cache->lru_next;
+    }
+    else if (g_lru_head == cache)
+    {
+        g_lru_head = cache->lru_next;
+    }
+    else
+    {
+        //not linked
+        return;
+    }
+
+    if (cache->lru_next)
+    {
+        cache->lru_next->lru_previous = cache->lru_previous;
+    }
+    else
+    {
+        g_lru_tail = cache->lru_previous;
+    }
+
+    cache->lru_previous = NULL;
+    cache->lru_next = NULL;
+}
+
+static void lru_touch(PageCache* cache)
+{
+    if (g_lru_head == cache)
+    {
+        return;
+    }
+
+    lru_unlink(cache);
+
+    cache->lru_next = g_lru_head;
+
+    if (g_lru_head)
+    {
+        g_lru_head->lru_previous = cache;
+    }
+    else
+    {
+        g_lru_tail = cache;
+    }
+
+    g_lru_head = cache;
+}
+
+static BOOL has_dirty_pages(PageCache* cache)
+{
+    for (uint32_t i = 0; i < cache->page_count; ++i)
+    {
+        if (cache->dirty[i])
+        {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+//Drops least recently used caches that only their node holds until file pages are under the limit.
+//Mapped caches and the ones a reader holds a reference on stay, so the limit may be passed.
+static void reclaim()
+{
+    uint32_t limit = vmm_get_total_page_count() / PAGECACHE_MAX_SHARE;
+
+    PageCache* cache = g_lru_tail;
+
+    while (cache && g_file_page_count >= limit)
+    {
+        PageCache* previous = cache->lru_previous;
+
+        if (cache->reference_count == 1 && cache->resident_count > 0 && FALSE == has_dirty_pages(cache))
+        {
+            pagecache_invalidate(cache->node);
+        }
+
+        cache = previous;
+    }
+}
+
+//Makes room for page_count pages. The arrays grow by doubling so appending stays O(1).
+static BOOL reserve_pages(PageCache* cache, uint32_t page_count)
+{
+    if (page_count <= cache->page_capacity)
+    {
+        return TRUE;
+    }
+
+    uint32_t capacity = MAX(cache->page_capacity * 2, 8);
+    capacity = MAX(capacity, page_count);
+
+    uint8_t** pages = (uint8_t**)kmalloc(capacity * sizeof(uint8_t*));
+    uint8_t* dirty = (uint8_t*)kmalloc(capacity);
+
+    if (NULL == pages || NULL == dirty)
+    {
+        kfree(pages);
+        kfree(dirty);
+        return FALSE;
+    }
+
+    memset((uint8_t*)pages, 0, capacity * sizeof(uint8_t*));
+    memset(dirty, 0, capacity);
+
+    if (cache->pages)
+    {
+        memcpy((uint8_t*)pages, (uint8_t*)cache->pages, cache->page_capacity * sizeof(uint8_t*));
+        memcpy(dirty, cache->dirty, cache->page_capacity);
+
+        kfree(cache->pages);
+        kfree(cache->dirty);
+    }
+
+    cache->pages = pages;
+    cache->dirty = dirty;
+    cache->page_capacity = capacity;
+
+    return TRUE;
+}
+
+//Returns the cache of node, creating it on first use. Only regular files are cached.
+PageCache* pagecache_get(FileSystemNode* node)
+{
+    if (node->page_cache)
+    {
+        return node->page_cache;
+    }
+
+    if (node->node_type != FT_FILE || NULL == node->open || NULL == node->read)
+    {
+        return NULL;
+    }
+
+    File* file = (File*)kmalloc(sizeof(File));
+    memset((uint8_t*)file, 0, sizeof(File));
+    file->node = node;
+    file->fd = -1;
+
+    //Writable if possible, so pages dirtied through shared mappings can be written back
+    file->flags = O_RDWR;
+
+    if (NULL == node->write || FALSE == node->open(file, file->flags))
+    {
+        file->flags = O_RDONLY;
+
+        if (FALSE == node->open(file, file->flags))
+        {
+            kfree(file);
+            return NULL;
+        }
+    }
+
+    PageCache* cache = (PageCache*)kmalloc(sizeof(PageCache));
+    memset((uint8_t*)cache, 0, sizeof(PageCache));
+    cache->node = node;
+    cache->file = file;
+    cache->page_count = node->length == 0 ? 0 : PAGE_COUNT(node->length);
+    cache->reference_count = 1;//the node's
+
+    if (FALSE == reserve_pages(cache, cache->page_count))
+    {
+        if (node->close)
+        {
+            node->close(file);
+        }
+        kfree(file);
+        kfree(cache);
+        return NULL;
+    }
+
+    node->page_cache = cache;
+
+    lru_touch(cache);
+
+    return cache;
+}
+
+//Creates an empty cache that holds the data of node itself, for filesystems keeping files in memory.
+//Pages are allocated on first write, so unwritten ranges cost nothing and read as zero.
+PageCache* pagecache_create_storage(FileSystemNode* node)
+{
+    PageCache* cache = (PageCache*)kmalloc(sizeof(PageCache));
+    memset((uint8_t*)cache, 0, sizeof(PageCache));
+    cache->node = node;
+    cache->reference_count = 1;//the node's
+
+    node->page_cache = cache;
+
+    return cache;
+}
+
+void pagecache_acquire(PageCache* cache)
+{
+    ++cache->reference_count;
+}
+
+void pagecache_release(PageCache* cache)
+{
+    if (--cache->reference_count > 0)
+    {
+        return;
+    }
+
+    lru_unlink(cache);
+
+    for (uint32_t i = 0; i < cache->page_capacity; ++i)
+    {
+        if (cache->pages[i])
+        {
+            kfree_pages(cache->pages[i], 1);
+        }
+    }
+
+    if (cache->file)
+    {
+        g_file_page_count -= cache->resident_count;
+    }
+
+    kfree(cache->pages);
+    kfree(cache->dirty);
+
+    if (cache->file)
+    {
+        if (cache->file->node->close)
+        {
+            cache->file->node->close(cache->file);
+        }
+
+        kfree(cache->file);
+    }
+
+    kfree(cache);
+}
+
+//Returns the kernel address of the page, reading it from the file if needed. The part after the end of the file is zero.
+//The caller holds a reference on the cache (a mapping or pagecache_acquire), so reclaim leaves it alone.
+uint8_t* pagecache_get_page(PageCache* cache, uint32_t page_index)
+{
+    if (page_index >= cache->page_count)
+    {
+        return NULL;
+    }
+
+    File* file = cache->file;
+
+    if (file && cache->node)
+    {
+        lru_touch(cache);
+    }
+
+    if (cache->pages[page_index])
+    {
+        return cache->pages[page_index];
+    }
+
+    if (file)
+    {
+        reclaim();
+    }
+
+    uint8_t* page = (uint8_t*)kmalloc_pages(1);
+
+    if (NULL == file)
+    {
+        //Filling a hole of a storage cache
+        if (page)
+        {
+            memset(page, 0, PAGESIZE_4K);
+
+            cache->pages[page_index] = page;
+            ++cache->resident_count;
+        }
+
+        return page;
+    }
+
+    if (NULL == page)
+    {
+        return NULL;
+    }
+
+    int32_t bytes_read = -1;
+
+    if (NULL == file->node->lseek || file->node->lseek(file, page_index * PAGESIZE_4K, SEEK_SET) >= 0)
+    {
+        bytes_read = file->node->read(file, PAGESIZE_4K, page);
+    }
+
+    if (bytes_read < 0)
+    {
+        kfree_pages(page, 1);
+        return NULL;
+    }
+
+    memset(page + bytes_read, 0, PAGESIZE_4K - bytes_read);
+
+    cache->pages[page_index] = page;
+    ++cache->resident_count;
+    ++g_file_page_count;
+
+    return page;
+}
+
+//Copies from the cached pages. Returns the byte count copied, which is short at the end of the file.
+int32_t pagecache_read(PageCache* cache, uint32_t offset, uint32_t size, uint8_t* buffer)
+{
+    uint32_t length = cache->page_count * PAGESIZE_4K;
+
+    if (cache->node)
+    {
+        length = MIN(length, cache->node->length);
+    }
+
+    if (offset >= length)
+    {
+        return 0;
+    }
+
+    size = MIN(size, length - offset);
+
+    uint32_t copied = 0;
+    while (copied < size)
+    {
+        uint32_t position = offset + copied;
+
+        uint32_t page_index = position / PAGESIZE_4K;
+        uint32_t page_offset = position % PAGESIZE_4K;
+        uint32_t chunk = MIN(PAGESIZE_4K - page_offset, size - copied);
+
+        if (NULL == cache->file && NULL == cache->pages[page_index])
+        {
+            //Reading a hole does not allocate it
+            memset(buffer + copied, 0, chunk);
+
+            copied += chunk;
+            continue;
+        }
+
+        uint8_t* page = pagecache_get_page(cache, page_index);
+
+        if (NULL == page)
+        {
+            return copied > 0 ? (int32_t)copied : -1;
+        }
+
+        memcpy(buffer + copied, page + page_offset, chunk);
+
+        copied += chunk;
+    }
+
+    return copied;
+}
+
+//Copies into a storage cache, allocating the pages touched. The cache grows to cover the range written.
+//Returns the byte count copied, which is short if memory runs out. The caller updates the node length.
+int32_t pagecache_write(PageCache* cache, uint32_t offset, uint32_t size, const uint8_t* buffer)
+{
+    if (cache->file || offset + size < offset)
+    {
+        return -1;
+    }
+
+    if (0 == size)
+    {
+        return 0;
+    }
+
+    if (PAGE_COUNT(offset + size) > cache->page_count)
+    {
+        if (FALSE == pagecache_resize(cache, offset + size))
+        {
+            return -1;
+        }
+    }
+
+    uint32_t copied = 0;
+    while (copied < size)
+    {
+        uint32_t position = offset + copied;
+
+        uint8_t* page = pagecache_get_page(cache, position / PAGESIZE_4K);
+
+        if (NULL == page)
+        {
+            return copied > 0 ? (int32_t)copied : -1;
+        }
+
+        uint32_t page_offset = position % PAGESIZE_4K;
+        uint32_t chunk = MIN(PAGESIZE_4K - page_offset, size - copied);
+
+        memcpy(page + page_offset, buffer + copied, chunk);
+
+        copied += chunk;
+    }
+
+    return copied;
+}
+
+//Sets the size of a storage cache to cover length bytes.
+//Pages dropped by shrinking are freed unless a mapping may still use them, then they are only zeroed.
+BOOL pagecache_resize(PageCache* cache, uint32_t length)
+{
+    if (cache->file)
+    {
+        return FALSE;
+    }
+
+    uint32_t page_count = length == 0 ? 0 : PAGE_COUNT(length);
+
+    if (FALSE == reserve_pages(cache, page_count))
+    {
+        return FALSE;
+    }
+
+    BOOL mapped = cache->reference_count > 1;
+
+    for (uint32_t i = page_count; i < cache->page_count; ++i)
+    {
+        if (cache->pages[i])
+        {
+            if (mapped)
+            {
+                memset(cache->pages[i], 0, PAGESIZE_4K);
+            }
+            else
+            {
+                kfree_pages(cache->pages[i], 1);
+                cache->pages[i] = NULL;
+                --cache->resident_count;
+            }
+        }
+    }
+
+    //The part of the last page after the new end must read as zero if the file grows again
+    uint32_t tail = length % PAGESIZE_4K;
+    if (tail > 0 && cache->node && length < cache->node->length && cache->pages[page_count - 1])
+    {
+        memset(cache->pages[page_count - 1] + tail, 0, PAGESIZE_4K - tail);
+    }
+
+    cache->page_count = page_count;
+
+    return TRUE;
+}
+
+//Called after write() stored size bytes of buffer at offset of the file, so cached pages stay equal to the file.
+//The cache grows with the file, pages not read yet are read on demand as usual.
+void pagecache_update(PageCache* cache, uint32_t offset, uint32_t size, const uint8_t* buffer)
+{
+    if (NULL == cache->file || NULL == cache->node || 0 == size)
+    {
+        return;
+    }
+
+    uint32_t page_count = PAGE_COUNT(cache->node->length);
+
+    if (page_count > cache->page_count)
+    {
+        if (FALSE == reserve_pages(cache, page_count))
+        {
+            //Pages of the grown part can not be tracked, start over with a fresh cache
+            pagecache_invalidate(cache->node);
+            return;
+        }
+
+        cache->page_count = page_count;
+    }
+
+    uint32_t copied = 0;
+    while (copied < size)
+    {
+        uint32_t position = offset + copied;
+
+        uint32_t page_index = position / PAGESIZE_4K;
+        uint32_t page_offset = position % PAGESIZE_4K;
+        uint32_t chunk = MIN(PAGESIZE_4K - page_offset, size - copied);
+
+        if (page_index < cache->page_count && cache->pages[page_index])
+        {
+            memcpy(cache->pages[page_index] + page_offset, buffer + copied, chunk);
+        }
+
+        copied += chunk;
+    }
+}
+
+void pagecache_mark_dirty(PageCache* cache, uint32_t page_index)
+{
+    if (page_index < cache->page_count && cache->pages[page_index])
+    {
+        cache->dirty[page_index] = 1;
+    }
+}
+
+//Writes the pages modified through shared mappings to the file. Returns 0 or -1 if a write failed.
+int32_t pagecache_writeback(PageCache* cache)
+{
+    File* file = cache->file;
+
+    if (NULL == file || NULL == cache->node || NULL == file->node->write || CHECK_ACCESS(file->flags, O_RDONLY))
+    {
+        return 0;
+    }
+
+    int32_t result = 0;
+
+    for (uint32_t i = 0; i < cache->page_count; ++i)
+    {
+        if (0 == cache->dirty[i])
+        {
+            continue;
+        }
+
+        uint32_t position = i * PAGESIZE_4K;
+
+        if (position >= cache->node->length)
+        {
+            cache->dirty[i] = 0;
+            continue;
+        }
+
+        uint32_t size = MIN(PAGESIZE_4K, cache->node->length - position);
+
+        if ((NULL == file->node->lseek || file->node->lseek(file, position, SEEK_SET) >= 0) &&
+                file->node->write(file, size, cache->pages[i]) == (int32_t)size)
+        {
+            cache->dirty[i] = 0;
+        }
+        else
+        {
+            result = -1;
+        }
+    }
+
+    return result;
+}
+
+//Maps size bytes of the file from offset (page aligned) on into the current process. Pages come on first touch.
+//MAP_SHARED maps the cached pages themselves. MAP_PRIVATE copies a page when it is mapped writable.
+void* pagecache_mmap(File* file, uint32_t size, uint32_t offset, uint32_t prot, uint32_t flags)
+{
+    PageCache* cache = pagecache_get(file->node);
+
+    if (NULL == cache)
+    {
+        return NULL;
+    }
+
+    uint32_t vma_flags = 0;
+
+    BOOL writable = (prot & PROT_WRITE) == PROT_WRITE;
+
+    if ((flags & MAP_SHARED) == MAP_SHARED)
+    {
+        if (writable && (CHECK_ACCESS(file->flags, O_RDONLY) || (cache->file && CHECK_ACCESS(cache->file->flags, O_RDONLY))))
+        {
+            return NULL;
+        }
+
+        vma_flags |= VMA_SHARED;
+    }
+
+    if (writable)
+    {
+        vma_flags |= VMA_WRITE;
+    }
+
+    return vmm_reserve_file_memory(thread_get_current()->owner, USER_MMAP_START, size, vma_flags, cache, offset);
+}
+
+//Detaches the cache from node after the file changed. Mappings keep the old pages until they go away.
+//Storage caches are the file itself and stay.
+void pagecache_invalidate(FileSystemNode* node)
+{
+    PageCache* cache = node->page_cache;
+
+    if (NULL == cache || NULL == cache->file)
+    {
+        return;
+    }
+
+    node->page_cache = NULL;
+
+    cache->node = NULL;
+
+    lru_unlink(cache);
+
+    pagecache_release(cache);
+}
@@ -0,0 +1,40 @@
+#ifndef PAGECACHE_H
+#define PAGECACHE_H
+
+#include "common.h"
+#include "fs.h"
+
+//Pages of a file kept in memory so they can be mapped into processes instead of copied.
+//Page frames of a cache are kernel heap pages, so they are reachable from any page directory.
+//Caches read from a file may hold a share of the page frames. Past that, caches nobody maps
+//or uses are dropped whole, least recently used first.
+typedef struct PageCache
+{
+    FileSystemNode* node;//NULL after invalidation
+    File* file;//kernel side handle the pages are read through, NULL if the cache is the storage of the file
+    uint8_t** pages;//indexed by page number in the file, NULL if not read yet (a hole for storage caches)
+    uint32_t page_count;
+    uint32_t page_capacity;//length of pages, grows by doubling so appending stays O(1)
+    uint8_t* dirty;//per page, set when a shared mapping wrote the page and it is not written back yet
+    uint32_t reference_count;//the node, each memory area mapping it and each reader using it right now
+    uint32_t resident_count;//pages allocated
+    //Reclaim order of caches read from a file and still attached to their node, most recently used first
+    struct PageCache* lru_previous;
+    struct PageCache* lru_next;
+} PageCache;
+
+PageCache* pagecache_get(FileSystemNode* node);
+PageCache* pagecache_create_storage(FileSystemNode* node);
+void pagecache_acquire(PageCache* cache);
+void pagecache_release(PageCache* cache);
+uint8_t* pagecache_get_page(PageCache* cache, uint32_t page_index);
+int32_t pagecache_read(PageCache* cache, uint32_t offset, uint32_t size, uint8_t* buffer);
+int32_t pagecache_write(PageCache* cache, uint32_t offset, uint32_t size, const uint8_t* buffer);
+BOOL pagecache_resize(PageCache* cache, uint32_t length);
+void pagecache_update(PageCache* cache, uint32_t offset, uint32_t size, const uint8_t* buffer);
+void pagecache_mark_dirty(PageCache* cache, uint32_t page_index);
+int32_t pagecache_writeback(PageCache* cache);
+void* pagecache_mmap(File* file, uint32_t size, uint32_t offset, uint32_t prot, uint32_t flags);
+void pagecache_invalidate(FileSystemNode* node);
+
+#endif // PAGECACHE_H
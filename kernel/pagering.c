@@ -0,0 +1,154 @@
+#include "pagering.h"
+#include "alloc.h"
+
+struct PageRingPage
+{
+    PageRingPage* next;
+};
+
+#define PAGERING_DATA_SIZE (PAGESIZE_4K - sizeof(PageRingPage))
+#define PAGERING_DATA(page) ((uint8_t*)(page) + sizeof(PageRingPage))
+
+void pagering_initialize(PageRing* ring, uint32_t capacity)
+{
+    memset((uint8_t*)ring, 0, sizeof(PageRing));
+    ring->capacity = capacity;
+}
+
+void pagering_destroy(PageRing* ring)
+{
+    PageRingPage* page = ring->head;
+    while (page)
+    {
+        PageRingPage* next = page->next;
+
+        kfree_pages(page, 1);
+
+        page = next;
+    }
+
+    ring->head = NULL;
+    ring->tail = NULL;
+    ring->read_offset = 0;
+    ring->write_offset = 0;
+    ring->used_bytes = 0;
+}
+
+uint32_t pagering_get_size(PageRing* ring)
+{
+    return ring->used_bytes;
+}
+
+uint32_t pagering_get_capacity(PageRing* ring)
+{
+    return ring->capacity;
+}
+
+uint32_t pagering_get_free(PageRing* ring)
+{
+    if (ring->used_bytes >= ring->capacity)
+    {
+        return 0;
+    }
+
+    return ring->capacity - ring->used_bytes;
+}
+
+//Queued bytes above a lowered capacity stay, only new writes wait
+void pagering_set_capacity(PageRing* ring, uint32_t capacity)
+{
+    ring->capacity = capacity;
+}
+
+//Returns the byte count queued, short if the capacity is reached. -1 if no page could be taken for the first byte.
+int32_t pagering_enqueue(PageRing* ring, const uint8_t* data, uint32_t size)
+{
+    uint32_t count = MIN(size, pagering_get_free(ring));
+
+    uint32_t written = 0;
+    while (written < count)
+    {
+        if (NULL == ring->tail || ring->write_offset == PAGERING_DATA_SIZE)
+        {
+            PageRingPage* page = (PageRingPage*)kmalloc_pages(1);
+
+            if (NULL == page)
+            {
+                break;
+            }
+
+            page->next = NULL;
+
+            if (ring->tail)
+            {
+                ring->tail->next = page;
+            }
+            else
+            {
+                ring->head = page;
+                ring->read_offset = 0;
+            }
+
+            ring->tail = page;
+            ring->write_offset = 0;
+        }
+
+        uint32_t chunk = MIN(count - written, PAGERING_DATA_SIZE - ring->write_offset);
+
+        memcpy(PAGERING_DATA(ring->tail) + ring->write_offset, (uint8_t*)data + written, chunk);
+
+        ring->write_offset += chunk;
+        ring->used_bytes += chunk;
+        written += chunk;
+    }
+
+    if (written == 0 && count > 0)
+    {
+        return -1;
+    }
+
+    return written;
+}
+
+//data may be NULL to drop the bytes
+int32_t pagering_dequeue(PageRing* ring, uint8_t* data, uint32_t size)
+{
+    uint32_t count = MIN(size, ring->used_bytes);
+
+    uint32_t read = 0;
+    while (read < count)
+    {
+        uint32_t available = (ring->head == ring->tail ? ring->write_offset : PAGERING_DATA_SIZE) - ring->read_offset;
+
+        uint32_t chunk = MIN(count - read, available);
+
+        if (data)
+        {
+            memcpy(data + read, PAGERING_DATA(ring->head) + ring->read_offset, chunk);
+        }
+
+        ring->read_offset += chunk;
+        ring->used_bytes -= chunk;
+        read += chunk;
+
+        if (ring->head != ring->tail && ring->read_offset == PAGERING_DATA_SIZE)
+        {
+            //Drained pages go back as soon as the reader leaves them
+            PageRingPage* next = ring->head->next;
+
+            kfree_pages(ring->head, 1);
+
+            ring->head = next;
+            ring->read_offset = 0;
+        }
+    }
+
+    if (0 == ring->used_bytes && ring->head)
+    {
+        //The last page is reused from its start by the next write
+        ring->read_offset = 0;
+        ring->write_offset = 0;
+    }
+
+    return read;
+}
@@ -0,0 +1,29 @@
+#ifndef PAGERING_H
+#define PAGERING_H
+
+#include "common.h"
+
+typedef struct PageRingPage PageRingPage;
+
+//Byte queue made of a chain of pages taken on demand and given back as they drain.
+//An empty ring keeps at most the page it was last written to, an unused one owns no memory.
+typedef struct PageRing
+{
+    PageRingPage* head;//read from
+    PageRingPage* tail;//written to
+    uint32_t read_offset;//in head
+    uint32_t write_offset;//in tail
+    uint32_t used_bytes;
+    uint32_t capacity;//limit of used_bytes
+} PageRing;
+
+void pagering_initialize(PageRing* ring, uint32_t capacity);
+void pagering_destroy(PageRing* ring);
+uint32_t pagering_get_size(PageRing* ring);
+uint32_t pagering_get_capacity(PageRing* ring);
+uint32_t pagering_get_free(PageRing* ring);
+void pagering_set_capacity(PageRing* ring, uint32_t capacity);
+int32_t pagering_enqueue(PageRing* ring, const uint8_t* data, uint32_t size);
+int32_t pagering_dequeue(PageRing* ring, uint8_t* data, uint32_t size);
+
+#endif // PAGERING_H
@@ -118,6 +118,8 @@ static void wakeup_accessing_threads(Pipe* pipe, List* list)
     }
 
     end_critical_section();
+
+    fs_node_notify(pipe->fsNode);
 }
 
 static BOOL pipe_open(File *file, uint32_t flags)
@@ -337,6 +339,7 @@ BOOL pipe_destroy(const char* name)
             fifobuffer_destroy(p->buffer);
             list_destroy(p->readers);
             list_destroy(p->writers);
+            waitqueue_destroy(&p->fsNode->waiters);
             kfree(p->fsNode);
             kfree(p);
 
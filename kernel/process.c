@@ -11,6 +11,8 @@
 #include "list.h"
 #include "ttydev.h"
 #include "sharedmemory.h"
+#include "pagecache.h"
+#include "waitqueue.h"
 
 #define MESSAGE_QUEUE_SIZE 64
 
@@ -32,9 +34,30 @@ uint32_t g_thread_id_generator = 0;
 uint32_t g_system_context_switch_count = 0;
 uint32_t g_usage_mark_point = 0;
 
+typedef struct ThreadList
+{
+    Thread* head;
+    Thread* tail;
+} ThreadList;
+
+//One FIFO per priority level. Bit n of g_ready_bitmap is set when level n is not empty.
+static ThreadList g_ready_queues[THREAD_PRIORITY_COUNT];
+static uint32_t g_ready_bitmap = 0;
+
+static uint32_t g_last_aging_time = 0;
+
+//Sleeping threads and select threads with a timeout, sorted by wake up time, earliest first
+static ThreadList g_sleep_queue;
+
+//Killed processes waiting to be closed and destroyed by the reaper thread
+static List* g_dying_processes = NULL;
+static WaitQueue g_reaper_queue;
+
 extern Tss g_tss;
 
 static void fill_auxilary_vector(uint32_t location, void* elfData);
+static void thread_unqueue(Thread* thread);
+static void reaper_thread();
 
 uint32_t generate_process_id()
 {
@@ -71,6 +94,9 @@ void tasking_initialize()
     thread->threadId = generate_thread_id();
 
     thread->user_mode = 0;
+
+    //The idle thread is never queued. It runs when the ready queue is empty.
+    g_first_thread = thread;
     thread_resume(thread);
     thread->birth_time = get_uptime_milliseconds();
 
@@ -98,8 +124,12 @@ void tasking_initialize()
     thread->kstack.esp0 = 0;//For kernel threads, this is not required
 
 
-    g_first_thread = thread;
     g_current_thread = thread;
+
+    g_dying_processes = list_create();
+    waitqueue_initialize(&g_reaper_queue);
+
+    thread_create_kthread(reaper_thread);
 }
 
 void thread_create_kthread(Function0 func)
@@ -328,15 +358,58 @@ static void fill_auxilary_vector(uint32_t location, void* elf_data)
 
 Process* process_create_from_elf_data(const char* name, uint8_t* elf_data, char *const argv[], char *const envp[], Process* parent, FileSystemNode* tty)
 {
-    return process_create_ex(name, generate_process_id(), generate_thread_id(), NULL, elf_data, argv, envp, parent, tty);
+    return process_create_ex(name, generate_process_id(), generate_thread_id(), NULL, elf_data, NULL, argv, envp, parent, tty);
 }
 
 Process* process_create_from_function(const char* name, Function0 func, char *const argv[], char *const envp[], Process* parent, FileSystemNode* tty)
 {
-    return process_create_ex(name, generate_process_id(), generate_thread_id(), func, NULL, argv, envp, parent, tty);
+    return process_create_ex(name, generate_process_id(), generate_thread_id(), func, NULL, NULL, argv, envp, parent, tty);
 }
 
-Process* process_create_ex(const char* name, uint32_t process_id, uint32_t thread_id, Function0 func, uint8_t* elf_data, char *const argv[], char *const envp[], Process* parent, FileSystemNode* tty)
+//Maps the executable lazily from the page cache when its layout allows. Otherwise loads a full copy.
+//A process_id of 0 means a new one.
+Process* process_create_from_file(const char* name, uint32_t process_id, FileSystemNode* node, char *const argv[], char *const envp[], Process* parent, FileSystemNode* tty)
+{
+    PageCache* cache = pagecache_get(node);
+
+    if (NULL == cache)
+    {
+        return NULL;
+    }
+
+    //Kept until the segments are mapped, they hold their own references
+    pagecache_acquire(cache);
+
+    Process* process = NULL;
+
+    //Program headers normally follow the ELF header in the first page
+    uint8_t* headers = pagecache_get_page(cache, 0);
+
+    uint32_t header_size = MIN(node->length, PAGESIZE_4K);
+
+    if (headers && elf_can_map((char*)headers, header_size))
+    {
+        process = process_create_ex(name, process_id, 0, NULL, headers, cache, argv, envp, parent, tty);
+    }
+    else if (headers)
+    {
+        uint8_t* image = (uint8_t*)kmalloc(node->length);
+
+        if (pagecache_read(cache, 0, node->length, image) == (int32_t)node->length)
+        {
+            process = process_create_ex(name, process_id, 0, NULL, image, NULL, argv, envp, parent, tty);
+        }
+
+        kfree(image);
+    }
+
+    pagecache_release(cache);
+
+    return process;
+}
+
+//If image_cache is given, elf_data only needs to hold the headers and the segments are mapped from the cache
+Process* process_create_ex(const char* name, uint32_t process_id, uint32_t thread_id, Function0 func, uint8_t* elf_data, PageCache* image_cache, char *const argv[], char *const envp[], Process* parent, FileSystemNode* tty)
 {
     uint32_t image_data_end_in_memory = elf_get_end_in_memory((char*)elf_data);
 
@@ -373,6 +446,11 @@ Process* process_create_ex(const char* name, uint32_t process_id, uint32_t threa
 
     thread->user_mode = 1;
 
+    if (parent && g_current_thread && g_current_thread->owner == parent)
+    {
+        thread->nice = g_current_thread->nice;
+    }
+
     thread_resume(thread);
 
     thread->birth_time = get_uptime_milliseconds();
@@ -423,30 +501,15 @@ Process* process_create_ex(const char* name, uint32_t process_id, uint32_t threa
     //Change memory view (page directory)
     CHANGE_PD(process->pd);
 
-    vmm_initialize_process_pages(process);
-
     uint32_t size_in_memory = image_data_end_in_memory - USER_OFFSET;
 
     //printkf("image size_in_memory:%d\n", size_in_memory);
 
-    initialize_program_break(process, size_in_memory);
+    initialize_program_break(process, size_in_memory, NULL == image_cache);
 
 
-    const uint32_t stack_page_count = 50;
-    char* v_address_stack_page = (char *) (USER_STACK - PAGESIZE_4K * stack_page_count);
-    uint32_t stack_frames[stack_page_count];
-    for (uint32_t i = 0; i < stack_page_count; ++i)
-    {
-        stack_frames[i] = vmm_acquire_page_frame_4k();
-    }
-    void* stack_v_mem = vmm_map_memory(process, (uint32_t)v_address_stack_page, stack_frames, stack_page_count, TRUE);
-    if (NULL == stack_v_mem)
-    {
-        for (uint32_t i = 0; i < stack_page_count; ++i)
-        {
-            vmm_release_page_frame_4k(stack_frames[i]);
-        }
-    }
+    //The stack is only reserved. Its pages are faulted in as it grows down.
+    vmm_reserve_memory(process, USER_STACK - USER_STACK_SIZE, PAGE_COUNT(USER_STACK_SIZE), VMA_ANONYMOUS | VMA_STACK);
 
     uint32_t p_address_args_env_aux[1];
     p_address_args_env_aux[0] = vmm_acquire_page_frame_4k();
@@ -497,7 +560,16 @@ Process* process_create_ex(const char* name, uint32_t process_id, uint32_t threa
 
     if (elf_data)
     {
-        uint32_t start_location = elf_load((char*)elf_data);
+        uint32_t start_location = 0;
+
+        if (image_cache)
+        {
+            start_location = elf_map(process, image_cache, (char*)elf_data);
+        }
+        else
+        {
+            start_location = elf_load((char*)elf_data);
+        }
 
         //printkf("process start location:%x\n", start_location);
 
@@ -517,6 +589,148 @@ Process* process_create_ex(const char* name, uint32_t process_id, uint32_t threa
     return process;
 }
 
+//Replaces the descriptors of process with reopened copies of the ones of from
+void process_clone_files(Process* process, Process* from)
+{
+    Thread* thread = g_first_thread;
+    while (thread && thread->owner != process)
+    {
+        thread = thread->next;
+    }
+
+    if (NULL == thread)
+    {
+        return;
+    }
+
+    uint32_t count = MAX(process->fd_capacity, from->fd_capacity);
+
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        File* file = process_get_file(process, i);
+
+        if (file)
+        {
+            fs_close(file);
+        }
+
+        file = process_get_file(from, i);
+
+        if (file)
+        {
+            fs_clone_for_process(thread, file);
+        }
+    }
+}
+
+//This function should be called in interrupts disabled state, from a syscall of thread.
+//The child continues from the same syscall with 0 as the result. Its memory is shared copy-on-write.
+Process* process_fork(Thread* thread)
+{
+    Process* parent = thread->owner;
+    Registers* regs = thread->syscall_registers;
+
+    if (NULL == regs)
+    {
+        return NULL;
+    }
+
+    uint32_t* pd = vmm_acquire_page_directory();
+
+    if (NULL == pd)
+    {
+        return NULL;
+    }
+
+    Process* process = (Process*)kmalloc(sizeof(Process));
+    memset((uint8_t*)process, 0, sizeof(Process));
+    strcpy(process->name, parent->name);
+    process->pid = generate_process_id();
+    process->pd = pd;
+    process->b_exec = parent->b_exec;
+    process->e_exec = parent->e_exec;
+    process->b_bss = parent->b_bss;
+    process->e_bss = parent->e_bss;
+    process->brk_begin = parent->brk_begin;
+    process->brk_end = parent->brk_end;
+    process->brk_next_unallocated_page_begin = parent->brk_next_unallocated_page_begin;
+    process->tty = parent->tty;
+    process->working_directory = parent->working_directory;
+    process->parent = parent;
+
+    vmm_vma_copy_all(process, parent);
+
+    if (FALSE == vmm_fork_user_space(process))
+    {
+        vmm_vma_destroy_all(process);
+
+        kfree(process);
+
+        vmm_destroy_page_directory_with_memory((uint32_t)pd);
+
+        return NULL;
+    }
+
+    sharedmemory_fork(parent, process);
+
+    Thread* child = (Thread*)kmalloc(sizeof(Thread));
+    memset((uint8_t*)child, 0, sizeof(Thread));
+
+    child->owner = process;
+
+    child->threadId = generate_thread_id();
+
+    child->user_mode = 1;
+
+    child->nice = thread->nice;
+
+    child->birth_time = get_uptime_milliseconds();
+
+    child->message_queue = fifobuffer_create(sizeof(SosoMessage) * MESSAGE_QUEUE_SIZE);
+    spinlock_init(&(child->message_queue_lock));
+
+    child->signals = fifobuffer_create(SIGNAL_QUEUE_SIZE);
+
+    child->regs.cr3 = (uint32_t) process->pd;
+
+    child->regs.eax = 0;//fork returns 0 in the child
+    child->regs.ecx = regs->ecx;
+    child->regs.edx = regs->edx;
+    child->regs.ebx = regs->ebx;
+    child->regs.ebp = regs->ebp;
+    child->regs.esi = regs->esi;
+    child->regs.edi = regs->edi;
+    child->regs.eip = regs->eip;
+    child->regs.eflags = regs->eflags;
+    child->regs.cs = regs->cs;
+    child->regs.ss = regs->ss;
+    child->regs.ds = regs->ds;
+    child->regs.es = regs->es;
+    child->regs.fs = regs->fs;
+    child->regs.gs = regs->gs;
+    child->regs.esp = regs->userEsp;
+
+    child->kstack.ss0 = 0x10;
+    uint8_t* stack = (uint8_t*)kmalloc(KERN_STACK_SIZE);
+    child->kstack.esp0 = (uint32_t)(stack + KERN_STACK_SIZE - 4);
+    child->kstack.stack_start = (uint32_t)stack;
+
+    Thread* p = g_current_thread;
+
+    while (p->next != NULL)
+    {
+        p = p->next;
+    }
+
+    p->next = child;
+
+    process_clone_files(process, parent);
+
+    thread_resume(child);
+
+    return process;
+}
+
 //This function should be called in interrupts disabled state
 void thread_destroy(Thread* thread)
 {
@@ -526,6 +740,14 @@ void thread_destroy(Thread* thread)
     {
         previous_thread->next = thread->next;
 
+        thread_unqueue(thread);
+
+        waitqueue_remove_thread(thread);
+        if (thread->wait_queues)
+        {
+            list_destroy(thread->wait_queues);
+        }
+
         kfree((void*)thread->kstack.stack_start);
 
         spinlock_lock(&(thread->message_queue_lock));
@@ -564,6 +786,14 @@ void process_destroy(Process* process)
             {
                 previous->next = thread->next;
 
+                thread_unqueue(thread);
+
+                waitqueue_remove_thread(thread);
+                if (thread->wait_queues)
+                {
+                    list_destroy(thread->wait_queues);
+                }
+
                 kfree((void*)thread->kstack.stack_start);
 
                 spinlock_lock(&(thread->message_queue_lock));
@@ -589,14 +819,9 @@ void process_destroy(Process* process)
         thread = thread->next;
     }
 
-    //Cleanup opened files
-    for (int i = 0; i < SOSO_MAX_OPENED_FILES; ++i)
-    {
-        if (process->fd[i] != NULL)
-        {
-            fs_close(process->fd[i]);
-        }
-    }
+    kfree(process->fd);
+    process->fd = NULL;
+    process->fd_capacity = 0;
 
     if (process->parent)
     {
@@ -619,11 +844,83 @@ void process_destroy(Process* process)
 
     uint32_t physical_pd = (uint32_t)process->pd;
 
+    vmm_vma_destroy_all(process);
+
     kfree(process);
 
     vmm_destroy_page_directory_with_memory(physical_pd);
 }
 
+//Stops the threads of process and hands it to the reaper. Writing back mappings and closing
+//descriptors may sleep on file system mutexes, so it cannot be done in the scheduler.
+//Must be called in interrupts disabled.
+void process_kill(Process* process)
+{
+    if (process->exiting)
+    {
+        return;
+    }
+
+    process->exiting = TRUE;
+
+    process_change_state(process, TS_SUSPEND);
+
+    list_append(g_dying_processes, process);
+
+    waitqueue_wake_one(&g_reaper_queue);
+}
+
+//A thread of the process in the middle of a file system operation must finish it first,
+//otherwise its mutex is never released
+static BOOL process_holds_mutex(Process* process)
+{
+    for (Thread* thread = g_first_thread; thread; thread = thread->next)
+    {
+        if (thread->owner == process && thread->held_mutex_count > 0)
+        {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+//Closes and destroys killed processes in the context of a kernel thread
+static void reaper_thread()
+{
+    while (TRUE)
+    {
+        disable_interrupts();
+
+        while (list_is_empty(g_dying_processes))
+        {
+            waitqueue_sleep(&g_reaper_queue);
+        }
+
+        Process* process = (Process*)g_dying_processes->head->data;
+        list_remove_first_node(g_dying_processes);
+
+        enable_interrupts();
+
+        //Shared file mappings are written back like on munmap
+        vmm_vma_sync(process, USER_OFFSET, 0xFFFFFFFF);
+
+        for (uint32_t i = 0; i < process->fd_capacity; ++i)
+        {
+            if (process->fd[i] != NULL)
+            {
+                fs_close(process->fd[i]);
+            }
+        }
+
+        disable_interrupts();
+
+        process_destroy(process);
+
+        enable_interrupts();
+    }
+}
+
 void process_change_state(Process* process, ThreadState state)
 {
     Thread* thread = g_first_thread;
@@ -639,16 +936,189 @@ void process_change_state(Process* process, ThreadState state)
     }
 }
 
+static void thread_list_append(ThreadList* list, Thread* thread)
+{
+    thread->queue_next = NULL;
+    thread->queue_previous = list->tail;
+
+    if (list->tail)
+    {
+        list->tail->queue_next = thread;
+    }
+    else
+    {
+        list->head = thread;
+    }
+
+    list->tail = thread;
+}
+
+static void thread_list_insert_before(ThreadList* list, Thread* position, Thread* thread)
+{
+    if (NULL == position)
+    {
+        thread_list_append(list, thread);
+        return;
+    }
+
+    thread->queue_next = position;
+    thread->queue_previous = position->queue_previous;
+
+    if (position->queue_previous)
+    {
+        position->queue_previous->queue_next = thread;
+    }
+    else
+    {
+        list->head = thread;
+    }
+
+    position->queue_previous = thread;
+}
+
+static void thread_list_remove(ThreadList* list, Thread* thread)
+{
+    if (thread->queue_previous)
+    {
+        thread->queue_previous->queue_next = thread->queue_next;
+    }
+    else
+    {
+        list->head = thread->queue_next;
+    }
+
+    if (thread->queue_next)
+    {
+        thread->queue_next->queue_previous = thread->queue_previous;
+    }
+    else
+    {
+        list->tail = thread->queue_previous;
+    }
+
+    thread->queue_next = NULL;
+    thread->queue_previous = NULL;
+}
+
+static uint32_t thread_get_priority(Thread* thread)
+{
+    return ((thread->nice - THREAD_NICE_MIN) * THREAD_PRIORITY_COUNT) / (THREAD_NICE_MAX - THREAD_NICE_MIN + 1);
+}
+
+//Must be called in interrupts disabled
+static void thread_unqueue(Thread* thread)
+{
+    if (thread->queue_type == TQ_READY)
+    {
+        uint32_t priority = thread->queue_priority;
+
+        thread_list_remove(&g_ready_queues[priority], thread);
+
+        if (NULL == g_ready_queues[priority].head)
+        {
+            g_ready_bitmap &= ~(1 << priority);
+        }
+    }
+    else if (thread->queue_type == TQ_SLEEP)
+    {
+        thread_list_remove(&g_sleep_queue, thread);
+    }
+
+    thread->queue_type = TQ_NONE;
+}
+
+//Must be called in interrupts disabled
+static void thread_enqueue(Thread* thread)
+{
+    if (thread == g_first_thread)
+    {
+        //idle thread
+        return;
+    }
+
+    if (thread->queue_type != TQ_NONE)
+    {
+        return;
+    }
+
+    if (thread->state == TS_RUN)
+    {
+        uint32_t priority = thread_get_priority(thread);
+
+        thread_list_append(&g_ready_queues[priority], thread);
+        g_ready_bitmap |= (1 << priority);
+
+        thread->queue_type = TQ_READY;
+        thread->queue_priority = priority;
+        thread->queue_time = get_uptime_milliseconds();
+    }
+    else if (thread->state == TS_SLEEP || (thread->state == TS_SELECT && thread->state_privateData))
+    {
+        //A select thread without a timeout is not queued at all, fs_node_notify resumes it
+        uint32_t target = (uint32_t)thread->state_privateData;
+
+        Thread* position = g_sleep_queue.head;
+        while (position && (uint32_t)position->state_privateData <= target)
+        {
+            position = position->queue_next;
+        }
+
+        thread_list_insert_before(&g_sleep_queue, position, thread);
+
+        thread->queue_type = TQ_SLEEP;
+    }
+}
+
 void thread_change_state(Thread* thread, ThreadState state, void* private_data)
 {
+    BOOL interrupts_enabled = is_interrupts_enabled();
+    disable_interrupts();
+
+    thread_unqueue(thread);
+
     thread->state = state;
     thread->state_privateData = private_data;
+
+    thread_enqueue(thread);
+
+    if (interrupts_enabled)
+    {
+        enable_interrupts();
+    }
 }
 
 void thread_resume(Thread* thread)
 {
-    thread->state = TS_RUN;
-    thread->state_privateData = NULL;
+    thread_change_state(thread, TS_RUN, NULL);
+}
+
+void thread_set_nice(Thread* thread, int32_t nice)
+{
+    nice = MAX(nice, THREAD_NICE_MIN);
+    nice = MIN(nice, THREAD_NICE_MAX);
+
+    BOOL interrupts_enabled = is_interrupts_enabled();
+    disable_interrupts();
+
+    //Requeue in the new priority level if it is waiting to run
+    BOOL ready = (thread->queue_type == TQ_READY);
+
+    if (ready)
+    {
+        thread_unqueue(thread);
+    }
+
+    thread->nice = nice;
+
+    if (ready)
+    {
+        thread_enqueue(thread);
+    }
+
+    if (interrupts_enabled)
+    {
+        enable_interrupts();
+    }
 }
 
 //must be called in interrupts disabled
@@ -658,13 +1128,18 @@ BOOL thread_signal(Thread* thread, uint8_t signal)
 
     BOOL result = FALSE;
 
+    if (thread->owner->exiting)
+    {
+        return FALSE;
+    }
+
     if (signal < SIGNAL_COUNT)
     {
         if (signal == SIGCONT)
         {
             if (thread->state == TS_SUSPEND)
             {
-                thread->state = TS_RUN;
+                thread_resume(thread);
             }
         }
 
@@ -675,7 +1150,7 @@ BOOL thread_signal(Thread* thread, uint8_t signal)
 
             if (thread->state == TS_WAITIO)
             {
-                thread->state = TS_RUN;
+                thread_resume(thread);
                 //it should wake and it should return -EINTR
             }
 
@@ -762,13 +1237,48 @@ void wait_for_schedule()
     PANIC("wait_for_schedule(): Should not be reached here!!!\n");
 }
 
+//Makes room for descriptor fd, doubling the table. Must be called in a critical section.
+static BOOL process_grow_fd_table(Process* process, uint32_t fd)
+{
+    if (fd < process->fd_capacity)
+    {
+        return TRUE;
+    }
+
+    if (fd >= SOSO_MAX_OPENED_FILES)
+    {
+        return FALSE;
+    }
+
+    uint32_t capacity = MAX(process->fd_capacity, SOSO_MIN_OPENED_FILES);
+    while (capacity <= fd)
+    {
+        capacity *= 2;
+    }
+    capacity = MIN(capacity, SOSO_MAX_OPENED_FILES);
+
+    File** table = (File**)kmalloc(capacity * sizeof(File*));
+    memset((uint8_t*)table, 0, capacity * sizeof(File*));
+
+    if (process->fd)
+    {
+        memcpy((uint8_t*)table, (uint8_t*)process->fd, process->fd_capacity * sizeof(File*));
+        kfree(process->fd);
+    }
+
+    process->fd = table;
+    process->fd_capacity = capacity;
+
+    return TRUE;
+}
+
 int32_t process_get_empty_fd(Process* process)
 {
     int32_t result = -1;
 
     begin_critical_section();
 
-    for (int i = 0; i < SOSO_MAX_OPENED_FILES; ++i)
+    for (uint32_t i = 0; i < process->fd_capacity; ++i)
     {
         if (process->fd[i] == NULL)
         {
@@ -777,6 +1287,11 @@ int32_t process_get_empty_fd(Process* process)
         }
     }
 
+    if (result < 0 && process->fd_capacity < SOSO_MAX_OPENED_FILES)
+    {
+        result = process->fd_capacity;
+    }
+
     end_critical_section();
 
     return result;
@@ -788,18 +1303,36 @@ int32_t process_add_file(Process* process, File* file)
 
     begin_critical_section();
 
-    //Screen_PrintF("process_add_file: pid:%d\n", process->pid);
+    uint32_t i = 0;
+    while (i < process->fd_capacity && process->fd[i] != NULL)
+    {
+        ++i;
+    }
 
-    for (int i = 0; i < SOSO_MAX_OPENED_FILES; ++i)
+    if (process_grow_fd_table(process, i))
     {
-        //Screen_PrintF("process_add_file: i:%d fd[%d]:%x\n", i, i, process->fd[i]);
-        if (process->fd[i] == NULL)
-        {
-            result = i;
-            file->fd = i;
-            process->fd[i] = file;
-            break;
-        }
+        result = i;
+        file->fd = i;
+        process->fd[i] = file;
+    }
+
+    end_critical_section();
+
+    return result;
+}
+
+//Puts file at the given descriptor, which must be free
+int32_t process_add_file_at(Process* process, File* file, int32_t fd)
+{
+    int32_t result = -1;
+
+    begin_critical_section();
+
+    if (fd >= 0 && process_grow_fd_table(process, fd) && process->fd[fd] == NULL)
+    {
+        result = fd;
+        file->fd = fd;
+        process->fd[fd] = file;
     }
 
     end_critical_section();
@@ -813,14 +1346,10 @@ int32_t process_remove_file(Process* process, File* file)
 
     begin_critical_section();
 
-    for (int i = 0; i < SOSO_MAX_OPENED_FILES; ++i)
+    if (file->fd >= 0 && (uint32_t)file->fd < process->fd_capacity && process->fd[file->fd] == file)
     {
-        if (process->fd[i] == file)
-        {
-            result = i;
-            process->fd[i] = NULL;
-            break;
-        }
+        result = file->fd;
+        process->fd[file->fd] = NULL;
     }
 
     end_critical_section();
@@ -832,7 +1361,7 @@ File* process_find_file(Process* process, FileSystemNode* node)
 {
     File* result = NULL;
 
-    for (int i = 0; i < SOSO_MAX_OPENED_FILES; ++i)
+    for (uint32_t i = 0; i < process->fd_capacity; ++i)
     {
         if (process->fd[i] && process->fd[i]->node == node)
         {
@@ -844,6 +1373,16 @@ File* process_find_file(Process* process, FileSystemNode* node)
     return result;
 }
 
+File* process_get_file(Process* process, int32_t fd)
+{
+    if (fd >= 0 && (uint32_t)fd < process->fd_capacity)
+    {
+        return process->fd[fd];
+    }
+
+    return NULL;
+}
+
 Thread* thread_get_by_id(uint32_t threadId)
 {
     Thread* p = g_first_thread;
@@ -944,74 +1483,82 @@ static void thread_update_usage_metrics()
     }    
 }
 
-static void thread_update_state(Thread* t)
+//Wakes up sleepers whose time has come. The queue is sorted so only expired ones are visited.
+static void wake_sleeping_threads()
 {
-    if (t->state == TS_SLEEP)
-    {
-        uint32_t uptime = get_uptime_milliseconds();
-        uint32_t target = (uint32_t)t->state_privateData;
+    uint32_t uptime = get_uptime_milliseconds();
 
-        if (uptime >= target)
-        {
-            thread_resume(t);
-        }
-    }
-    else if (t->state == TS_SELECT)
+    while (g_sleep_queue.head && uptime >= (uint32_t)g_sleep_queue.head->state_privateData)
     {
-        select_update(t);
-
-        if (t->select.select_state == SS_FINISHED)
-        {
-            thread_resume(t);
-        }
+        thread_resume(g_sleep_queue.head);
     }
 }
 
-static Thread* look_threads(Thread* current)
+//Moves threads that waited a whole interval one level up. Levels are visited from the top,
+//so a raised thread is not raised again in the same pass. Running drops it back to its own level.
+static void age_ready_threads()
 {
-    Thread* t = current->next;
-    while (NULL != t)
-    {
-        thread_update_state(t);
+    uint32_t uptime = get_uptime_milliseconds();
 
-        if (t->state == TS_RUN)
-        {
-            //We definetly found a good one!
-            return t;
-        }
-        t = t->next;
+    if (uptime - g_last_aging_time < THREAD_AGING_INTERVAL_MS)
+    {
+        return;
     }
 
+    g_last_aging_time = uptime;
 
-    //Reached the last thread. Let's try from first thread up to the current including.
-    //Of course this makes sense if current is not the first one already.
+    uint32_t bitmap = g_ready_bitmap & ~1;
 
-    if (current == g_first_thread)
+    while (bitmap != 0)
     {
-        //We already searched for all threads
+        uint32_t priority = __builtin_ctz(bitmap);
+        bitmap &= ~(1 << priority);
 
-        //Desperately return idle thread
-        return g_first_thread;
-    }
-    else
-    {
-        t = g_first_thread->next;
-        while (NULL != t)
+        Thread* t = g_ready_queues[priority].head;
+
+        while (t)
         {
-            thread_update_state(t);
+            Thread* next = t->queue_next;
 
-            if (t->state == TS_RUN)
+            if (uptime - t->queue_time >= THREAD_AGING_INTERVAL_MS)
             {
-                //We definetly found a good one!
-                return t;
-            }
+                thread_list_remove(&g_ready_queues[priority], t);
 
-            if (t == current)
-            {
-                //We reached the last point to search
-                break;
+                thread_list_append(&g_ready_queues[priority - 1], t);
+                g_ready_bitmap |= (1 << (priority - 1));
+
+                t->queue_priority = priority - 1;
+                t->queue_time = uptime;
             }
-            t = t->next;
+
+            t = next;
+        }
+
+        if (NULL == g_ready_queues[priority].head)
+        {
+            g_ready_bitmap &= ~(1 << priority);
+        }
+    }
+}
+
+//Takes the first thread of the highest priority non-empty level or returns the idle thread
+static Thread* pick_next_thread()
+{
+    wake_sleeping_threads();
+
+    age_ready_threads();
+
+    while (g_ready_bitmap != 0)
+    {
+        uint32_t priority = __builtin_ctz(g_ready_bitmap);
+
+        Thread* t = g_ready_queues[priority].head;
+
+        thread_unqueue(t);
+
+        if (t->state == TS_RUN)
+        {
+            return t;
         }
     }
 
@@ -1100,18 +1647,17 @@ void schedule(TimerInt_Registers* registers)
 
         end_context(registers, current);
 
-        ready_thread = look_threads(current);
+        //Round robin in the same priority level: a preempted thread goes to the tail
+        thread_enqueue(current);
     }
-    else
-    {
-        //current is NULL. This means the thread is destroyed.
 
-        ready_thread = look_threads(g_first_thread);
-    }
+    //current can be NULL. This means the thread is destroyed.
+
+    ready_thread = pick_next_thread();
 
     if (ready_thread != g_first_thread)
     {
-        if (fifobuffer_get_size(ready_thread->signals) > 0)
+        if (fifobuffer_get_size(ready_thread->signals) > 0 && FALSE == process_holds_mutex(ready_thread->owner))
         {
             uint8_t signal = 0;
             fifobuffer_dequeue(ready_thread->signals, &signal, 1);
@@ -1130,15 +1676,15 @@ void schedule(TimerInt_Registers* registers)
             case SIGILL:
                 printkf("Killing pid:%d in scheduler!\n", ready_thread->owner->pid);
             
-                process_destroy(ready_thread->owner);
+                process_kill(ready_thread->owner);
 
-                ready_thread = look_threads(g_first_thread);
+                ready_thread = pick_next_thread();
                 break;
             case SIGSTOP:
             case SIGTSTP:
-                ready_thread->state = TS_SUSPEND;
+                thread_change_state(ready_thread, TS_SUSPEND, NULL);
 
-                ready_thread = look_threads(g_first_thread);
+                ready_thread = pick_next_thread();
                 break;
             
             default:
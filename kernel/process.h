@@ -4,7 +4,8 @@
 #define KERNELMODE	0
 #define USERMODE	1
 
-#define SOSO_MAX_OPENED_FILES 20
+#define SOSO_MAX_OPENED_FILES 1024
+#define SOSO_MIN_OPENED_FILES 16
 
 #define SOSO_PROCESS_NAME_MAX 32
 
@@ -34,6 +35,21 @@ typedef enum ThreadState
     
 } ThreadState;
 
+typedef enum ThreadQueueType
+{
+    TQ_NONE,
+    TQ_READY,
+    TQ_SLEEP
+} ThreadQueueType;
+
+#define THREAD_PRIORITY_COUNT 32
+
+//A ready thread waiting this long moves one priority level up, so lower levels are never starved
+#define THREAD_AGING_INTERVAL_MS 100
+
+#define THREAD_NICE_MIN -20
+#define THREAD_NICE_MAX 19
+
 typedef enum SelectState
 {
     SS_NOTSTARTED,
@@ -60,7 +76,11 @@ struct Process
     char *brk_end;
     char *brk_next_unallocated_page_begin;
 
-    uint8_t mmapped_virtual_memory[RAM_AS_4K_PAGES / 8];
+    //Sorted by address, also kept in a tree. The heap one is resized by sbrk.
+    //Together with the program break area they are all the used user address space.
+    struct VirtualMemoryArea* vmas;
+    struct VirtualMemoryArea* vma_tree;
+    struct VirtualMemoryArea* heap_vma;
 
     FileSystemNode* tty;
 
@@ -68,7 +88,11 @@ struct Process
 
     Process* parent;
 
-    File* fd[SOSO_MAX_OPENED_FILES];
+    //Descriptor table, kmalloc'ed and doubled when full, up to SOSO_MAX_OPENED_FILES
+    File** fd;
+    uint32_t fd_capacity;
+
+    BOOL exiting;//handed to the reaper, its threads never run again
 
 } __attribute__ ((packed));
 
@@ -106,6 +130,12 @@ struct Thread
         int result;
     } select;
 
+    List* wait_queues;//WaitQueues this thread is registered in: the one it sleeps in or the nodes it selects on
+
+    uint32_t held_mutex_count;//a page fault needing file I/O is refused while it is not 0
+
+    struct Registers* syscall_registers;//user registers of the latest syscall, only valid during it. fork copies them
+
     uint32_t user_mode;
 
     FifoBuffer* signals;//no need to lock as this always accessed in interrupts disabled
@@ -114,6 +144,15 @@ struct Thread
     ThreadState state;
     void* state_privateData;
 
+    int32_t nice;
+
+    //Links for the ready queue or the sleep queue. A thread is in at most one of them.
+    ThreadQueueType queue_type;
+    struct Thread* queue_next;
+    struct Thread* queue_previous;
+    uint32_t queue_priority;//ready level it is queued in, raised by aging above the one of its nice
+    uint32_t queue_time;//when it was queued or last raised
+
     Process* owner;
 
     uint32_t birth_time;
@@ -148,20 +187,27 @@ void tasking_initialize();
 void thread_create_kthread(Function0 func);
 Process* process_create_from_elf_data(const char* name, uint8_t* elf_data, char *const argv[], char *const envp[], Process* parent, FileSystemNode* tty);
 Process* process_create_from_function(const char* name, Function0 func, char *const argv[], char *const envp[], Process* parent, FileSystemNode* tty);
-Process* process_create_ex(const char* name, uint32_t process_id, uint32_t thread_id, Function0 func, uint8_t* elf_data, char *const argv[], char *const envp[], Process* parent, FileSystemNode* tty);
+Process* process_create_from_file(const char* name, uint32_t process_id, FileSystemNode* node, char *const argv[], char *const envp[], Process* parent, FileSystemNode* tty);
+Process* process_create_ex(const char* name, uint32_t process_id, uint32_t thread_id, Function0 func, uint8_t* elf_data, PageCache* image_cache, char *const argv[], char *const envp[], Process* parent, FileSystemNode* tty);
+Process* process_fork(Thread* thread);
+void process_clone_files(Process* process, Process* from);
 void thread_destroy(Thread* thread);
 void process_destroy(Process* process);
+void process_kill(Process* process);
 void process_change_state(Process* process, ThreadState state);
 void thread_change_state(Thread* thread, ThreadState state, void* private_data);
 void thread_resume(Thread* thread);
+void thread_set_nice(Thread* thread, int32_t nice);
 BOOL thread_signal(Thread* thread, uint8_t signal);
 BOOL process_signal(uint32_t pid, uint8_t signal);
 void thread_state_to_string(ThreadState state, uint8_t* buffer, uint32_t buffer_size);
 void wait_for_schedule();
 int32_t process_get_empty_fd(Process* process);
 int32_t process_add_file(Process* process, File* file);
+int32_t process_add_file_at(Process* process, File* file, int32_t fd);
 int32_t process_remove_file(Process* process, File* file);
 File* process_find_file(Process* process, FileSystemNode* node);
+File* process_get_file(Process* process, int32_t fd);
 Thread* thread_get_by_id(uint32_t thread_id);
 Thread* thread_get_previous(Thread* thread);
 Thread* thread_get_first();
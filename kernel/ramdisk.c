@@ -45,6 +45,21 @@ BOOL ramdisk_create(const char* devName, uint32_t size)
     return FALSE;
 }
 
+//Copies with interrupts enabled, so a large transfer does not hold off the timer and input IRQs.
+//Callers serialize access to the device (the block cache holds its mutex during device I/O).
+static void copy_with_interrupts(uint8_t* dest, uint8_t* src, uint32_t size)
+{
+    BOOL interrupts_enabled = is_interrupts_enabled();
+    enable_interrupts();
+
+    memcpy(dest, src, size);
+
+    if (!interrupts_enabled)
+    {
+        disable_interrupts();
+    }
+}
+
 static BOOL open(File *file, uint32_t flags)
 {
     return TRUE;
@@ -66,11 +81,7 @@ static int32_t read_block(FileSystemNode* node, uint32_t block_number, uint32_t
         return -1;
     }
 
-    begin_critical_section();
-
-    memcpy(buffer, ramdisk->buffer + location, size);
-
-    end_critical_section();
+    copy_with_interrupts(buffer, ramdisk->buffer + location, size);
 
     return 0;
 }
@@ -87,11 +98,7 @@ static int32_t write_block(FileSystemNode* node, uint32_t block_number, uint32_t
         return -1;
     }
 
-    begin_critical_section();
-
-    memcpy(ramdisk->buffer + location, buffer, size);
-
-    end_critical_section();
+    copy_with_interrupts(ramdisk->buffer + location, buffer, size);
 
     return 0;
 }
@@ -17,6 +17,7 @@ FileSystemNode* rootfs_initialize()
     root->readdir = rootfs_readdir;
     root->finddir = rootfs_finddir;
     root->mkdir = rootfs_mkdir;
+    root->cache_lookups = TRUE;
 
     return root;
 }
@@ -90,6 +91,7 @@ static BOOL rootfs_mkdir(FileSystemNode *node, const char *name, uint32_t flags)
     new_node->readdir = rootfs_readdir;
     new_node->finddir = rootfs_finddir;
     new_node->mkdir = rootfs_mkdir;
+    new_node->cache_lookups = TRUE;
     new_node->parent = node;
 
     if (node->first_child == NULL)
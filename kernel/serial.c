@@ -11,6 +11,7 @@
 
 static FifoBuffer* g_buffer_com1 = NULL;
 static List* g_accessing_threads = NULL;
+static FileSystemNode* g_com1_node = NULL;
 
 static void handle_serial_interrupt(Registers *regs);
 
@@ -50,7 +51,7 @@ void serial_initialize()
     device.read_test_ready = serial_read_test_ready;
     device.write_test_ready = serial_write_test_ready;
 
-    devfs_register_device(&device);
+    g_com1_node = devfs_register_device(&device);
 }
 
 static int port_received()
@@ -104,6 +105,8 @@ static void handle_serial_interrupt(Registers *regs)
             }
         }
     }
+
+    fs_node_notify(g_com1_node);
 }
 
 void serial_printf(const char *format, ...)
@@ -168,6 +168,23 @@ static int32_t sharedmemory_ftruncate(File *file, int32_t length)
 
     for (int i = 0; i < page_count; ++i)
     {
+        //Whole 4MB chunks are taken physically contiguous and aligned, so mappings of them get 4MB pages
+        if (page_count - i >= 1024 && (i % 1024) == 0)
+        {
+            uint32_t p_address = vmm_acquire_page_frames_4k(1024, 1024);
+
+            if (p_address != (uint32_t)-1)
+            {
+                for (int j = 0; j < 1024; ++j)
+                {
+                    list_append(shared_mem->physical_address_list, (void*)(p_address + j * PAGESIZE_4K));
+                }
+
+                i += 1023;
+                continue;
+            }
+        }
+
         uint32_t p_address = vmm_acquire_page_frame_4k();
 
         list_append(shared_mem->physical_address_list, (void*)p_address);
@@ -275,6 +292,40 @@ void sharedmemory_unmap_for_process_all(Process* process)
     list_destroy(process_shared_mapped_list);
 }
 
+//The child of a fork inherits the mappings of its parent at the same addresses
+void sharedmemory_fork(Process* parent, Process* child)
+{
+    list_foreach (n, g_shm_list)
+    {
+        SharedMemory* p = (SharedMemory*)n->data;
+
+        List* inherited = list_create();
+
+        list_foreach (e, p->mmapped_list)
+        {
+            MapInfo* info = (MapInfo*)e->data;
+
+            if (info->process == parent)
+            {
+                MapInfo* child_info = (MapInfo*)kmalloc(sizeof(MapInfo));
+                memset((uint8_t*)child_info, 0, sizeof(MapInfo));
+                child_info->process = child;
+                child_info->v_address = info->v_address;
+                child_info->page_count = info->page_count;
+
+                list_append(inherited, child_info);
+            }
+        }
+
+        list_foreach (e, inherited)
+        {
+            list_append(p->mmapped_list, e->data);
+        }
+
+        list_destroy(inherited);
+    }
+}
+
 FileSystemNode* sharedmemory_get_node(const char* name)
 {
     FileSystemNode* result = NULL;
@@ -316,6 +367,7 @@ FileSystemNode* sharedmemory_create(const char* name)
     node->unlink = sharedmemory_unlink;
     node->ftruncate = sharedmemory_ftruncate;
     node->mmap = sharedmemory_mmap;
+    node->passable = TRUE;
     node->private_node_data = shared_mem;
 
     shared_mem->node = node;
@@ -352,6 +404,7 @@ void sharedmemory_destroy(SharedMemory* shared_mem)
 
     //spinlock_lock(&shared_mem->physical_address_list_lock);
 
+    waitqueue_destroy(&shared_mem->node->waiters);
     kfree(shared_mem->node);
 
     list_destroy(shared_mem->physical_address_list);
@@ -10,5 +10,6 @@ BOOL sharedmemory_destroy_by_name(const char* name);
 FileSystemNode* sharedmemory_get_node(const char* name);
 BOOL sharedmemory_unmap_if_exists(Process* process, uint32_t address);
 void sharedmemory_unmap_for_process_all(Process* process);
+void sharedmemory_fork(Process* parent, Process* child);
 
 #endif // SHAREDMEMORY_H
@@ -6,6 +6,7 @@
 #include "list.h"
 #include "fs.h"
 #include "alloc.h"
+#include "timer.h"
 
 #define DOMAIN_SIZE 3
 
@@ -32,7 +33,7 @@ static Socket* get_socket(int sockfd, int* error)
     {
         if (sockfd >= 0 && sockfd < SOSO_MAX_OPENED_FILES)
         {
-            File* file = process->fd[sockfd];
+            File* file = process_get_file(process, sockfd);
 
             if (file)
             {
@@ -42,11 +43,7 @@ static Socket* get_socket(int sockfd, int* error)
                     return NULL;
                 }
 
-                Socket* socket = (Socket*)file->node->private_node_data;
-
-                socket->last_thread = g_current_thread;
-
-                return socket;
+                return (Socket*)file->node->private_node_data;
             }
             else
             {
@@ -72,8 +69,12 @@ static Socket* socket_create()
     Socket* socket = (Socket*)kmalloc(sizeof(Socket));
     memset((uint8_t*)socket, 0, sizeof(Socket));
 
-    socket->buffer_out = fifobuffer_create(SOCKET_BUFFER_SIZE);
-    socket->buffer_in = fifobuffer_create(SOCKET_BUFFER_SIZE);
+    pagering_initialize(&socket->buffer_in, SOCKET_BUFFER_SIZE);
+    socket->send_buffer_size = SOCKET_BUFFER_SIZE;
+
+    waitqueue_initialize(&socket->readers);
+    waitqueue_initialize(&socket->writers);
+    waitqueue_initialize(&socket->acceptors);
 
     socket->accept_queue = queue_create();
 
@@ -86,8 +87,12 @@ static void socket_destroy(Socket* socket)
 {
     list_remove_first_occurrence(g_socket_list, socket);
 
-    fifobuffer_destroy(socket->buffer_out);
-    fifobuffer_destroy(socket->buffer_in);
+    pagering_destroy(&socket->buffer_in);
+
+    //Sleepers wake up to find the socket gone from their connection or name lookup
+    waitqueue_destroy(&socket->readers);
+    waitqueue_destroy(&socket->writers);
+    waitqueue_destroy(&socket->acceptors);
 
     queue_destroy(socket->accept_queue);
 
@@ -123,8 +128,13 @@ static void socket_fs_close(File* file)
 
         socket->connection->connection = NULL;
         socket->connection->disconnected = TRUE;
+
+        waitqueue_wake_all(&socket->connection->readers);
+
+        fs_node_notify(socket->connection->node);
     }
 
+    waitqueue_destroy(&socket->node->waiters);
     kfree(socket->node);
     socket->node = NULL;
 
@@ -135,17 +145,24 @@ int syscall_socket(int domain, int type, int protocol)
 {
     //printkf("socket %d %d %d\n", domain, type, protocol);
 
+    type &= ~(SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+    //What the unix domain, the only one, supports
+    if (type != SOCK_STREAM && type != SOCK_DGRAM && type != SOCK_SEQPACKET)
+    {
+        return -ESOCKTNOSUPPORT;
+    }
+
     if (domain >= 0 && domain < DOMAIN_SIZE)
     {
         Socket* socket = socket_create();
 
         socket->domain = domain;
+        socket->type = type;
 
         FileSystemNode* node = (FileSystemNode*)kmalloc(sizeof(FileSystemNode));
         memset((uint8_t*)node, 0, sizeof(FileSystemNode));
 
-        socket->last_thread = g_current_thread;
-
         socket->node = node;
         node->private_node_data = socket;
 
@@ -153,6 +170,8 @@ int syscall_socket(int domain, int type, int protocol)
 
         node->open = socket_fs_open;
         node->close = socket_fs_close;
+        node->single_open = TRUE;
+        node->shareable = TRUE;
 
         File* file = fs_open_for_process(g_current_thread, node, O_RDWR);
 
@@ -244,61 +263,327 @@ int syscall_getpeername(int sockfd, struct sockaddr *addr, socklen_t *addrlen)
 }
 
 
-ssize_t syscall_send(int sockfd, const void *buf, size_t len, int flags)
+//Checks the user memory a msghdr points to
+static int check_msghdr(const struct msghdr* msg)
 {
-    int error = -1;
+    if (NULL == msg || !check_user_access((void*)msg))
+    {
+        return -EFAULT;
+    }
+
+    if (!check_user_access(msg->msg_name) || !check_user_access(msg->msg_control))
+    {
+        return -EFAULT;
+    }
+
+    if (msg->msg_iovlen < 0 || msg->msg_iovlen > UIO_MAXIOV)
+    {
+        return -EMSGSIZE;
+    }
+
+    if (msg->msg_iovlen > 0 && (NULL == msg->msg_iov || !check_user_access(msg->msg_iov)))
+    {
+        return -EFAULT;
+    }
+
+    for (int i = 0; i < msg->msg_iovlen; ++i)
+    {
+        if (!check_user_access(msg->msg_iov[i].iov_base))
+        {
+            return -EFAULT;
+        }
+    }
+
+    return 0;
+}
+
+static ssize_t socket_sendmsg(int sockfd, const struct msghdr *msg, int flags)
+{
+    int error = check_msghdr(msg);
+
+    if (error < 0)
+    {
+        return error;
+    }
+
+    error = -1;
     Socket* socket = get_socket(sockfd, &error);
 
-    if (socket && socket->socket_send)
+    if (socket && socket->socket_sendmsg)
     {
-        return socket->socket_send(socket, sockfd, buf, len, flags);
+        return socket->socket_sendmsg(socket, sockfd, msg, flags);
     }
 
     return error;
 }
 
-ssize_t syscall_recv(int sockfd, void *buf, size_t len, int flags)
+static ssize_t socket_recvmsg(int sockfd, struct msghdr *msg, int flags)
 {
-    int error = -1;
+    int error = check_msghdr(msg);
+
+    if (error < 0)
+    {
+        return error;
+    }
+
+    error = -1;
     Socket* socket = get_socket(sockfd, &error);
 
-    if (socket && socket->socket_recv)
+    if (socket && socket->socket_recvmsg)
     {
-        return socket->socket_recv(socket, sockfd, buf, len, flags);
+        return socket->socket_recvmsg(socket, sockfd, msg, flags);
     }
 
     return error;
 }
 
+ssize_t syscall_send(int sockfd, const void *buf, size_t len, int flags)
+{
+    return syscall_sendto(sockfd, buf, len, flags, NULL, 0);
+}
+
+ssize_t syscall_recv(int sockfd, void *buf, size_t len, int flags)
+{
+    return syscall_recvfrom(sockfd, buf, len, flags, NULL, NULL);
+}
+
 ssize_t syscall_sendto(int sockfd, const void *buf, size_t len, int flags,
                       const struct sockaddr *dest_addr, socklen_t addrlen)
 {
-    return -EPERM;
+    struct iovec iov;
+    iov.iov_base = (void*)buf;
+    iov.iov_len = len;
+
+    struct msghdr msg;
+    memset((uint8_t*)&msg, 0, sizeof(msg));
+    msg.msg_name = (void*)dest_addr;
+    msg.msg_namelen = addrlen;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    return socket_sendmsg(sockfd, &msg, flags);
 }
 
 ssize_t syscall_recvfrom(int sockfd, void *buf, size_t len, int flags,
                         struct sockaddr *src_addr, socklen_t *addrlen)
 {
-    return -EPERM;
+    if (!check_user_access(addrlen))
+    {
+        return -EFAULT;
+    }
+
+    struct iovec iov;
+    iov.iov_base = buf;
+    iov.iov_len = len;
+
+    struct msghdr msg;
+    memset((uint8_t*)&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (src_addr && addrlen)
+    {
+        msg.msg_name = src_addr;
+        msg.msg_namelen = *addrlen;
+    }
+
+    ssize_t result = socket_recvmsg(sockfd, &msg, flags);
+
+    if (result >= 0 && src_addr && addrlen)
+    {
+        *addrlen = msg.msg_namelen;
+    }
+
+    return result;
 }
 
 ssize_t syscall_sendmsg(int sockfd, const struct msghdr *msg, int flags)
 {
-    return -EPERM;
+    return socket_sendmsg(sockfd, msg, flags);
 }
 
 ssize_t syscall_recvmsg(int sockfd, struct msghdr *msg, int flags)
 {
-    return -EPERM;
+    return socket_recvmsg(sockfd, msg, flags);
+}
+
+//Like Linux, stops at the first failure and reports it only if nothing was sent
+int syscall_sendmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags)
+{
+    if (!check_user_access(msgvec))
+    {
+        return -EFAULT;
+    }
+
+    vlen = MIN(vlen, UIO_MAXIOV);
+
+    unsigned int count = 0;
+    for (; count < vlen; ++count)
+    {
+        ssize_t result = socket_sendmsg(sockfd, &msgvec[count].msg_hdr, flags);
+
+        if (result < 0)
+        {
+            if (count == 0)
+            {
+                return result;
+            }
+            break;
+        }
+
+        msgvec[count].msg_len = (unsigned int)result;
+    }
+
+    return count;
+}
+
+//The timeout is checked after each message only, as on Linux. MSG_WAITFORONE makes all but the first non blocking.
+int syscall_recvmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags, struct timespec *timeout)
+{
+    if (!check_user_access(msgvec) || !check_user_access(timeout))
+    {
+        return -EFAULT;
+    }
+
+    time_t target_time = 0;
+    if (timeout)
+    {
+        target_time = get_uptime_milliseconds64() + timeout->tv_sec * 1000 + timeout->tv_nsec / 1000000;
+    }
+
+    vlen = MIN(vlen, UIO_MAXIOV);
+
+    unsigned int count = 0;
+    for (; count < vlen; ++count)
+    {
+        ssize_t result = socket_recvmsg(sockfd, &msgvec[count].msg_hdr, flags & ~MSG_WAITFORONE);
+
+        if (result < 0)
+        {
+            if (count == 0)
+            {
+                return result;
+            }
+            break;
+        }
+
+        msgvec[count].msg_len = (unsigned int)result;
+
+        if (flags & MSG_WAITFORONE)
+        {
+            flags |= MSG_DONTWAIT;
+        }
+
+        if (target_time > 0 && get_uptime_milliseconds64() >= target_time)
+        {
+            ++count;
+            break;
+        }
+    }
+
+    return count;
 }
 
 
 int syscall_getsockopt(int sockfd, int level, int optname, void *optval, socklen_t *optlen)
 {
-    return -EPERM;
+    if (!check_user_access(optval) || !check_user_access(optlen))
+    {
+        return -EFAULT;
+    }
+
+    int error = -1;
+    Socket* socket = get_socket(sockfd, &error);
+
+    if (NULL == socket)
+    {
+        return error;
+    }
+
+    if (NULL == optval || NULL == optlen || *optlen < sizeof(int))
+    {
+        return -EINVAL;
+    }
+
+    if (level != SOL_SOCKET)
+    {
+        return -ENOPROTOOPT;
+    }
+
+    int value = 0;
+
+    switch (optname)
+    {
+    case SO_RCVBUF:
+        value = (int)pagering_get_capacity(&socket->buffer_in);
+        break;
+    case SO_SNDBUF:
+        value = (int)socket->send_buffer_size;
+        break;
+    case SO_ACCEPTCONN:
+        value = BITMAP_CHECK(socket->opts, SO_ACCEPTCONN) ? 1 : 0;
+        break;
+    default:
+        return -ENOPROTOOPT;
+    }
+
+    *(int*)optval = value;
+    *optlen = sizeof(int);
+
+    return 0;
 }
 
 int syscall_setsockopt(int sockfd, int level, int optname, const void *optval, socklen_t optlen)
 {
-    return -EPERM;
+    if (!check_user_access((void*)optval))
+    {
+        return -EFAULT;
+    }
+
+    int error = -1;
+    Socket* socket = get_socket(sockfd, &error);
+
+    if (NULL == socket)
+    {
+        return error;
+    }
+
+    if (NULL == optval || optlen < sizeof(int))
+    {
+        return -EINVAL;
+    }
+
+    if (level != SOL_SOCKET)
+    {
+        return -ENOPROTOOPT;
+    }
+
+    int value = *(const int*)optval;
+
+    //Sizes only bound the queue, memory is taken as data arrives
+    uint32_t size = (uint32_t)MAX(value, SOCKET_BUFFER_SIZE_MIN);
+    size = MIN(size, SOCKET_BUFFER_SIZE_MAX);
+
+    switch (optname)
+    {
+    case SO_RCVBUF:
+    case SO_RCVBUFFORCE:
+        pagering_set_capacity(&socket->buffer_in, size);
+        break;
+    case SO_SNDBUF:
+    case SO_SNDBUFFORCE:
+        socket->send_buffer_size = size;
+        break;
+    default:
+        return -ENOPROTOOPT;
+    }
+
+    //Pollers waiting for room see the new size
+    fs_node_notify(socket->node);
+    if (socket->connection)
+    {
+        fs_node_notify(socket->connection->node);
+    }
+
+    return 0;
 }
@@ -6,17 +6,20 @@
 #include "spinlock.h"
 #include "process.h"
 #include "list.h"
+#include "pagering.h"
+#include "time.h"
+#include "waitqueue.h"
 
-#define SOCKET_NAME_SIZE 64
-#define SOCKET_BUFFER_SIZE (500*1024)
+#define SOCKET_NAME_SIZE 108 //sun_path
+#define SOCKET_BUFFER_SIZE (500*1024)//default SO_RCVBUF/SO_SNDBUF, pages are only taken for queued bytes
+#define SOCKET_BUFFER_SIZE_MIN 256
+#define SOCKET_BUFFER_SIZE_MAX (8*1024*1024)
 
 typedef uint16_t sa_family_t;
 typedef uint32_t socklen_t;
 
 typedef int32_t ssize_t;
 
-struct msghdr;
-
 
 #define SHUT_RD 0
 #define SHUT_WR 1
@@ -289,6 +292,13 @@ struct msghdr;
 #define MSG_FASTOPEN  0x20000000
 #define MSG_CMSG_CLOEXEC 0x40000000
 
+#define SCM_RIGHTS      0x01
+#define SCM_CREDENTIALS 0x02
+
+#define SCM_MAX_FD      16 //descriptors one message may carry
+
+#define UIO_MAXIOV      1024
+
 void net_initialize();
 
 struct sockaddr {
@@ -296,6 +306,41 @@ struct sockaddr {
 	char sa_data[14];
 };
 
+struct msghdr {
+	void *msg_name;
+	socklen_t msg_namelen;
+	struct iovec *msg_iov;
+	int msg_iovlen;
+	void *msg_control;
+	socklen_t msg_controllen;
+	int msg_flags;
+};
+
+struct cmsghdr {
+	socklen_t cmsg_len;
+	int cmsg_level;
+	int cmsg_type;
+};
+
+struct mmsghdr {
+	struct msghdr msg_hdr;
+	unsigned int  msg_len;
+};
+
+#define __CMSG_LEN(cmsg) (((cmsg)->cmsg_len + sizeof(long) - 1) & ~(long)(sizeof(long) - 1))
+#define __CMSG_NEXT(cmsg) ((unsigned char *)(cmsg) + __CMSG_LEN(cmsg))
+#define __MHDR_END(mhdr) ((unsigned char *)(mhdr)->msg_control + (mhdr)->msg_controllen)
+
+#define CMSG_DATA(cmsg) ((unsigned char *) (((struct cmsghdr *)(cmsg)) + 1))
+#define CMSG_NXTHDR(mhdr, cmsg) ((cmsg)->cmsg_len < sizeof (struct cmsghdr) || \
+	__CMSG_LEN(cmsg) + sizeof(struct cmsghdr) >= (size_t)(__MHDR_END(mhdr) - (unsigned char *)(cmsg)) \
+	? 0 : (struct cmsghdr *)__CMSG_NEXT(cmsg))
+#define CMSG_FIRSTHDR(mhdr) ((size_t) (mhdr)->msg_controllen >= sizeof (struct cmsghdr) ? (struct cmsghdr *) (mhdr)->msg_control : (struct cmsghdr *) 0)
+
+#define CMSG_ALIGN(len) (((len) + sizeof (size_t) - 1) & (size_t) ~(sizeof (size_t) - 1))
+#define CMSG_SPACE(len) (CMSG_ALIGN (len) + CMSG_ALIGN (sizeof (struct cmsghdr)))
+#define CMSG_LEN(len)   (CMSG_ALIGN (sizeof (struct cmsghdr)) + (len))
+
 struct sockaddr_storage {
 	sa_family_t ss_family;
 	char __ss_padding[128-sizeof(long)-sizeof(sa_family_t)];
@@ -324,6 +369,8 @@ ssize_t syscall_recvfrom(int sockfd, void *buf, size_t len, int flags,
                         struct sockaddr *src_addr, socklen_t *addrlen);
 ssize_t syscall_sendmsg(int sockfd, const struct msghdr *msg, int flags);
 ssize_t syscall_recvmsg(int sockfd, struct msghdr *msg, int flags);
+int syscall_sendmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags);
+int syscall_recvmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags, struct timespec *timeout);
 
 int syscall_getsockopt(int sockfd, int level, int optname, void *optval, socklen_t *optlen);
 int syscall_setsockopt(int sockfd, int level, int optname, const void *optval, socklen_t optlen);
@@ -336,21 +383,27 @@ typedef void (*SocketFunction)(Socket* socket);
 typedef int (*SocketICAddrLen)(Socket* socket, int sockfd, const struct sockaddr *addr, socklen_t addrlen);
 typedef int (*SocketIIFunction)(Socket* socket, int, int);
 typedef int (*SocketIAddrLen)(Socket* socket, int sockfd, struct sockaddr *addr, socklen_t *addrlen);
-typedef ssize_t (*SocketSend)(Socket* socket, int sockfd, const void *buf, size_t len, int flags);
-typedef ssize_t (*SocketRecv)(Socket* socket, int sockfd, void *buf, size_t len, int flags);
+typedef ssize_t (*SocketSendMsg)(Socket* socket, int sockfd, const struct msghdr *msg, int flags);
+typedef ssize_t (*SocketRecvMsg)(Socket* socket, int sockfd, struct msghdr *msg, int flags);
 
 typedef struct Socket
 {
     FileSystemNode* node;
-    FifoBuffer* buffer_out;
-    FifoBuffer* buffer_in;
+    PageRing buffer_in;
+    uint32_t send_buffer_size;//bytes this socket may have queued at the other end
     BOOL disconnected;
     Socket* connection;
     int32_t domain;
-    Thread* last_thread;
+    int32_t type;//SOCK_STREAM, SOCK_DGRAM or SOCK_SEQPACKET
     BITMAP_DEFINE(opts, 128);
 
+    WaitQueue readers;//for data in buffer_in or the other end going away
+    WaitQueue writers;//for room in buffer_in
+    WaitQueue acceptors;//accept for connections, connect for room in the backlog and for being accepted
+
     Queue* accept_queue; //no lock required
+    uint32_t accept_queue_length;
+    uint32_t backlog;//connections accept_queue holds beyond the first
     
     void* custom_socket;
     SocketFunction socket_closing;
@@ -358,8 +411,8 @@ typedef struct Socket
     SocketIIFunction socket_listen;
     SocketIAddrLen socket_accept;
     SocketICAddrLen socket_connect;
-    SocketSend socket_send;
-    SocketRecv socket_recv;
+    SocketSendMsg socket_sendmsg;//msg and what it points to are checked user memory
+    SocketRecvMsg socket_recvmsg;
 } Socket;
 
 typedef struct List List;
@@ -0,0 +1,324 @@
+#include "process.h"
+#include "timer.h"
+#include "common.h"
+#include "errno.h"
+#include "alloc.h"
+#include "list.h"
+#include "syscall_select.h"
+#include "syscall_epoll.h"
+
+//Level triggered only. The interest list lives on the epoll node, readiness is re-tested on each wake up.
+
+typedef struct EpollItem
+{
+    int32_t fd;
+    File* file;
+    uint32_t events;
+    uint64_t data;
+} EpollItem;
+
+typedef struct Epoll
+{
+    FileSystemNode* node;
+    List* items;
+} Epoll;
+
+static BOOL epoll_open(File* file, uint32_t flags);
+static void epoll_close(File* file);
+
+static Epoll* epoll_get(Process* process, int epfd)
+{
+    File* file = process_get_file(process, epfd);
+
+    if (file && file->node->close == epoll_close)
+    {
+        return (Epoll*)file->node->private_node_data;
+    }
+
+    return NULL;
+}
+
+static EpollItem* epoll_find_item(Epoll* epoll, int fd)
+{
+    list_foreach (n, epoll->items)
+    {
+        EpollItem* item = (EpollItem*)n->data;
+
+        if (item->fd == fd)
+        {
+            return item;
+        }
+    }
+
+    return NULL;
+}
+
+static BOOL epoll_open(File* file, uint32_t flags)
+{
+    return TRUE;
+}
+
+static void epoll_close(File* file)
+{
+    Epoll* epoll = (Epoll*)file->node->private_node_data;
+
+    list_foreach (n, epoll->items)
+    {
+        kfree(n->data);
+    }
+    list_destroy(epoll->items);
+
+    waitqueue_destroy(&epoll->node->waiters);
+    kfree(epoll->node);
+
+    kfree(epoll);
+}
+
+int syscall_epoll_create1(int flags)
+{
+    Thread* thread = thread_get_current();
+
+    if (NULL == thread->owner)
+    {
+        return -1;
+    }
+
+    Epoll* epoll = (Epoll*)kmalloc(sizeof(Epoll));
+    memset((uint8_t*)epoll, 0, sizeof(Epoll));
+
+    epoll->items = list_create();
+
+    FileSystemNode* node = (FileSystemNode*)kmalloc(sizeof(FileSystemNode));
+    memset((uint8_t*)node, 0, sizeof(FileSystemNode));
+
+    strcpy(node->name, "epoll");
+    node->node_type = FT_CHARACTER_DEVICE;
+    node->private_node_data = epoll;
+    node->open = epoll_open;
+    node->close = epoll_close;
+    //Items refer to Files of the creating process, so a forked or executed process does not inherit it
+    node->single_open = TRUE;
+
+    epoll->node = node;
+
+    File* file = fs_open_for_process(thread, node, O_RDWR);
+
+    if (file)
+    {
+        return file->fd;
+    }
+
+    list_destroy(epoll->items);
+    kfree(node);
+    kfree(epoll);
+
+    return -EMFILE;
+}
+
+int syscall_epoll_ctl(int epfd, int op, int fd, struct epoll_event* event)
+{
+    if (!check_user_access(event))
+    {
+        return -EFAULT;
+    }
+
+    Process* process = thread_get_current()->owner;
+
+    if (NULL == process)
+    {
+        return -1;
+    }
+
+    Epoll* epoll = epoll_get(process, epfd);
+
+    if (NULL == epoll)
+    {
+        return -EBADF;
+    }
+
+    File* file = process_get_file(process, fd);
+
+    if (NULL == file)
+    {
+        return -EBADF;
+    }
+
+    if (fd == epfd)
+    {
+        return -EINVAL;
+    }
+
+    EpollItem* item = epoll_find_item(epoll, fd);
+
+    if (op == EPOLL_CTL_ADD)
+    {
+        if (NULL == event)
+        {
+            return -EFAULT;
+        }
+
+        if (item && item->file == file)
+        {
+            return -EEXIST;
+        }
+
+        if (NULL == item)
+        {
+            item = (EpollItem*)kmalloc(sizeof(EpollItem));
+            list_append(epoll->items, item);
+        }
+
+        item->fd = fd;
+        item->file = file;
+        item->events = event->events;
+        item->data = event->data;
+
+        return 0;
+    }
+    else if (op == EPOLL_CTL_MOD)
+    {
+        if (NULL == event)
+        {
+            return -EFAULT;
+        }
+
+        if (NULL == item || item->file != file)
+        {
+            return -ENOENT;
+        }
+
+        item->events = event->events;
+        item->data = event->data;
+
+        return 0;
+    }
+    else if (op == EPOLL_CTL_DEL)
+    {
+        if (NULL == item)
+        {
+            return -ENOENT;
+        }
+
+        list_remove_first_occurrence(epoll->items, item);
+        kfree(item);
+
+        return 0;
+    }
+
+    return -EINVAL;
+}
+
+//Fills events with ready items and registers the thread on every watched node.
+static int epoll_update(Thread* thread, Epoll* epoll, struct epoll_event* events, int maxevents)
+{
+    Process* process = thread->owner;
+
+    int count = 0;
+
+    //Closing the epoll descriptor from another thread must end the wait too
+    waitqueue_add(&epoll->node->waiters, thread);
+
+    ListNode* n = epoll->items->head;
+    while (n)
+    {
+        ListNode* next = n->next;
+
+        EpollItem* item = (EpollItem*)n->data;
+
+        if (process_get_file(process, item->fd) != item->file)
+        {
+            //The descriptor was closed, forget it like Linux does
+            list_remove_node(epoll->items, n);
+            kfree(item);
+
+            n = next;
+            continue;
+        }
+
+        File* file = item->file;
+
+        uint32_t revents = 0;
+
+        if ((item->events & EPOLLIN) && file->node->read_test_ready && file->node->read_test_ready(file))
+        {
+            revents |= EPOLLIN;
+        }
+
+        if ((item->events & EPOLLOUT) && file->node->write_test_ready && file->node->write_test_ready(file))
+        {
+            revents |= EPOLLOUT;
+        }
+
+        if (revents && count < maxevents)
+        {
+            events[count].events = revents;
+            events[count].data = item->data;
+
+            ++count;
+        }
+
+        waitqueue_add(&file->node->waiters, thread);
+
+        n = next;
+    }
+
+    return count;
+}
+
+//Also serves epoll_pwait. The signal mask argument is ignored.
+int syscall_epoll_wait(int epfd, struct epoll_event* events, int maxevents, int timeout)
+{
+    if (!check_user_access(events))
+    {
+        return -EFAULT;
+    }
+
+    if (NULL == events || maxevents <= 0)
+    {
+        return -EINVAL;
+    }
+
+    Thread* thread = thread_get_current();
+
+    if (NULL == thread->owner)
+    {
+        return -1;
+    }
+
+    time_t target_time = 0;
+    if (timeout >= 0)
+    {
+        target_time = select_get_target_time(timeout);
+    }
+
+    while (TRUE)
+    {
+        disable_interrupts();
+
+        Epoll* epoll = epoll_get(thread->owner, epfd);
+
+        if (NULL == epoll)
+        {
+            waitqueue_remove_thread(thread);
+
+            return -EBADF;
+        }
+
+        int result = epoll_update(thread, epoll, events, maxevents);
+
+        BOOL timed_out = (target_time > 0 && get_uptime_milliseconds64() >= target_time);
+
+        if (result > 0 || timed_out)
+        {
+            waitqueue_remove_thread(thread);
+
+            thread_resume(thread);
+
+            return result;
+        }
+
+        select_wait(thread, target_time);
+    }
+
+    return -1;
+}
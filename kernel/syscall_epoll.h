@@ -0,0 +1,25 @@
+#ifndef SYSCALL_EPOLL_H
+#define SYSCALL_EPOLL_H
+
+#include "stdint.h"
+
+#define EPOLL_CTL_ADD 1
+#define EPOLL_CTL_DEL 2
+#define EPOLL_CTL_MOD 3
+
+#define EPOLLIN  0x001
+#define EPOLLOUT 0x004
+#define EPOLLERR 0x008
+#define EPOLLHUP 0x010
+
+struct epoll_event
+{
+    uint32_t events;
+    uint64_t data;
+};
+
+int syscall_epoll_create1(int flags);
+int syscall_epoll_ctl(int epfd, int op, int fd, struct epoll_event* event);
+int syscall_epoll_wait(int epfd, struct epoll_event* events, int maxevents, int timeout);
+
+#endif //SYSCALL_EPOLL_H
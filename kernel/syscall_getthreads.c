@@ -90,9 +90,9 @@ int32_t syscall_getprocs(ProcInfo* procs, uint32_t max_count, uint32_t flags)
                 info->parent_process_id = process->parent->pid;
             }
 
-            for (uint32_t k = 0; k < SOSO_MAX_OPENED_FILES; ++k)
+            for (uint32_t k = 0; k < SOSO_PROCINFO_MAX_FILES; ++k)
             {
-                File* file = process->fd[k];
+                File* file = process_get_file(process, k);
                 if (file && file->node)
                 {
                     info->fd[k] = file->node->node_type;
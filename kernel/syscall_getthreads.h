@@ -4,6 +4,9 @@
 #include "stdint.h"
 #include "process.h"
 
+//Only the first descriptors are reported, the ProcInfo layout is shared with userspace
+#define SOSO_PROCINFO_MAX_FILES 20
+
 typedef struct ThreadInfo
 {
     uint32_t thread_id;
@@ -24,7 +27,7 @@ typedef struct ProcInfo
 {
     uint32_t process_id;
     int32_t parent_process_id;
-    uint32_t fd[SOSO_MAX_OPENED_FILES];
+    uint32_t fd[SOSO_PROCINFO_MAX_FILES];
 
     char name[SOSO_PROCESS_NAME_MAX];
     char tty[128];
@@ -6,22 +6,27 @@
 #include "isr.h"
 #include "syscall_select.h"
 
-void select_update(Thread* thread)
+//Also registers the thread on the watched nodes, so a driver notification ends the wait.
+static void select_update(Thread* thread)
 {
     Process* process = thread->owner;
 
     int total_ready = 0;
     uint32_t count = (uint32_t)thread->select.nfds;
-    count = MIN(count, SOSO_MAX_OPENED_FILES);
+    count = MIN(count, process->fd_capacity);
 
     for (uint32_t fd = 0; fd < count; ++fd)
     {
-        File* file = process->fd[fd];
+        File* file = process_get_file(process, fd);
 
         if (file)
         {
+            BOOL watched = FALSE;
+
             if (FD_ISSET(fd, &thread->select.read_set))
             {
+                watched = TRUE;
+
                 if (file->node->read_test_ready && file->node->read_test_ready(file))
                 {
                     FD_SET(fd, &thread->select.read_set_result);
@@ -32,6 +37,8 @@ void select_update(Thread* thread)
 
             if (FD_ISSET(fd, &thread->select.write_set))
             {
+                watched = TRUE;
+
                 if (file->node->write_test_ready && file->node->write_test_ready(file))
                 {
                     FD_SET(fd, &thread->select.write_set_result);
@@ -39,6 +46,11 @@ void select_update(Thread* thread)
                     ++total_ready;
                 }
             }
+
+            if (watched)
+            {
+                waitqueue_add(&file->node->waiters, thread);
+            }
         }
     }
 
@@ -51,7 +63,7 @@ void select_update(Thread* thread)
     {
         time_t now = get_uptime_milliseconds64();
 
-        if (now > thread->select.target_time)
+        if (now >= thread->select.target_time)
         {
             thread->select.result = 0;
             thread->select.select_state = SS_FINISHED;
@@ -59,8 +71,26 @@ void select_update(Thread* thread)
     }
 }
 
+//Must be called in interrupts disabled. Sleeps until a watched node notifies or target_time (0: none) passes.
+void select_wait(Thread* thread, time_t target_time)
+{
+    thread_change_state(thread, TS_SELECT, (void*)(uint32_t)target_time);
+    enable_interrupts();
+    halt();
+}
+
+time_t select_get_target_time(uint32_t milliseconds)
+{
+    time_t target_time = get_uptime_milliseconds64() + milliseconds;
+
+    //0 means no timeout
+    return MAX(target_time, 1);
+}
+
 static int select_finish(Thread* thread, fd_set* rfds, fd_set* wfds)
 {
+    waitqueue_remove_thread(thread);
+
     if (rfds)
     {
         *rfds = thread->select.read_set_result;
@@ -128,7 +158,7 @@ int syscall_select(int n, fd_set* rfds, fd_set* wfds, fd_set* efds, struct timev
         thread->select.target_time = 0;
         if (tv)
         {
-            thread->select.target_time = get_uptime_milliseconds64() + tv->tv_sec * 1000 + tv->tv_usec / 1000;
+            thread->select.target_time = select_get_target_time(tv->tv_sec * 1000 + tv->tv_usec / 1000);
         }
 
         while (TRUE)
@@ -146,11 +176,109 @@ int syscall_select(int n, fd_set* rfds, fd_set* wfds, fd_set* efds, struct timev
                 return result;
             }
 
-            thread_change_state(thread, TS_SELECT, NULL);
-            enable_interrupts();
-            halt();
+            select_wait(thread, thread->select.target_time);
+        }
+    }
+
+    return -1;
+}
+
+static int poll_update(Thread* thread, struct pollfd* fds, uint32_t nfds)
+{
+    Process* process = thread->owner;
+
+    int total_ready = 0;
+
+    for (uint32_t i = 0; i < nfds; ++i)
+    {
+        struct pollfd* p = fds + i;
+
+        p->revents = 0;
+
+        if (p->fd < 0)
+        {
+            continue;
+        }
+
+        File* file = process_get_file(process, p->fd);
+
+        if (NULL == file)
+        {
+            p->revents = POLLNVAL;
+        }
+        else
+        {
+            if ((p->events & POLLIN) && file->node->read_test_ready && file->node->read_test_ready(file))
+            {
+                p->revents |= POLLIN;
+            }
+
+            if ((p->events & POLLOUT) && file->node->write_test_ready && file->node->write_test_ready(file))
+            {
+                p->revents |= POLLOUT;
+            }
+
+            waitqueue_add(&file->node->waiters, thread);
+        }
+
+        if (p->revents)
+        {
+            ++total_ready;
         }
     }
 
+    return total_ready;
+}
+
+int syscall_poll(struct pollfd* fds, uint32_t nfds, int timeout)
+{
+    if (!check_user_access(fds))
+    {
+        return -EFAULT;
+    }
+
+    if (nfds > SOSO_MAX_OPENED_FILES)
+    {
+        return -EINVAL;
+    }
+
+    if (NULL == fds && nfds > 0)
+    {
+        return -EFAULT;
+    }
+
+    Thread* thread = thread_get_current();
+
+    if (NULL == thread->owner)
+    {
+        return -1;
+    }
+
+    time_t target_time = 0;
+    if (timeout >= 0)
+    {
+        target_time = select_get_target_time(timeout);
+    }
+
+    while (TRUE)
+    {
+        disable_interrupts();
+
+        int result = poll_update(thread, fds, nfds);
+
+        BOOL timed_out = (target_time > 0 && get_uptime_milliseconds64() >= target_time);
+
+        if (result > 0 || timed_out)
+        {
+            waitqueue_remove_thread(thread);
+
+            thread_resume(thread);
+
+            return result;
+        }
+
+        select_wait(thread, target_time);
+    }
+
     return -1;
-}
\ No newline at end of file
+}
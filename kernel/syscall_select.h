@@ -17,8 +17,26 @@ typedef struct {
 #define FD_CLR(d, s)   ((s)->fds_bits[(d)/(8*sizeof(long))] &= ~(1UL<<((d)%(8*sizeof(long)))))
 #define FD_ISSET(d, s) !!((s)->fds_bits[(d)/(8*sizeof(long))] & (1UL<<((d)%(8*sizeof(long)))))
 
-void select_update(Thread* thread);
+#define POLLIN     0x001
+#define POLLPRI    0x002
+#define POLLOUT    0x004
+#define POLLERR    0x008
+#define POLLHUP    0x010
+#define POLLNVAL   0x020
+
+struct pollfd
+{
+    int fd;
+    short events;
+    short revents;
+};
+
+typedef struct Thread Thread;
+
+void select_wait(Thread* thread, time_t target_time);
+time_t select_get_target_time(uint32_t milliseconds);
 
 int syscall_select(int n, fd_set* rfds, fd_set* wfds, fd_set* efds, struct timeval* tv);
+int syscall_poll(struct pollfd* fds, uint32_t nfds, int timeout);
 
 #endif //SYSCALL_SELECT_H
\ No newline at end of file
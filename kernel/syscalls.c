@@ -18,15 +18,22 @@
 #include "list.h"
 #include "ttydev.h"
 #include "syscall_select.h"
+#include "syscall_epoll.h"
 #include "errno.h"
 #include "ipc.h"
 #include "socket.h"
 #include "syscall_getthreads.h"
+#include "dcache.h"
 
-struct iovec {
-               void  *iov_base;    /* Starting address */
-               size_t iov_len;     /* Number of bytes to transfer */
-           };
+//Record layout of getdents64
+struct dirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    uint16_t d_reclen;
+    uint8_t d_type;
+    char d_name[];
+} __attribute__((packed));
 
 struct statx {
     uint32_t stx_mask;
@@ -100,13 +107,17 @@ int syscall_getcwd(char *buf, size_t size);
 int syscall_chdir(const char *path);
 int syscall_manage_pipe(const char *pipe_name, int operation, int data);
 int syscall_soso_read_dir(int fd, void *dirent, int index);
+int syscall_soso_read_dir_stat(int fd, FileSystemDirentStat* entries, int max_count);
 uint32_t syscall_get_uptime_ms();
 int syscall_sleep_ms(int ms);
 int syscall_execute_on_tty(const char *path, char *const argv[], char *const envp[], const char *tty_path);
 int syscall_manage_message(int command, void* message);
 int syscall_rt_sigaction(int signum, const struct k_sigaction *act, struct k_sigaction *oldact, uint32_t sigsetsize);
-void* syscall_mmap(void *addr, int length, int flags, int prot, int fd, int offset);
+void* syscall_mmap(void *addr, int length, int prot, int flags, int fd, int offset);
 int syscall_munmap(void *addr, int length);
+int syscall_msync(void *addr, int length, int flags);
+int syscall_sendfile(int out_fd, int in_fd, int64_t *offset, size_t count);
+int syscall_splice(int in_fd, int64_t *in_offset, int out_fd, int64_t *out_offset, size_t count, uint32_t flags);
 int syscall_shm_open(const char *name, int oflag, int mode);
 int syscall_unlink(const char *name);
 int syscall_ftruncate(int fd, int size);
@@ -132,6 +143,8 @@ void * syscall_shmat(int shmid, const void *shmaddr, int shmflg);
 int syscall_shmdt(const void *shmaddr);
 int syscall_shmctl(int shmid, int cmd, struct shmid_ds *buf);
 int syscall_nanosleep(struct timespec *req, struct timespec *rem);
+int syscall_getpriority(int which, int who);
+int syscall_setpriority(int which, int who, int prio);
 
 void syscalls_initialize()
 {
@@ -211,6 +224,18 @@ void syscalls_initialize()
     g_syscall_table[SYS_nanosleep] = syscall_nanosleep;
     g_syscall_table[SYS_getthreads] = syscall_getthreads;
     g_syscall_table[SYS_getprocs] = syscall_getprocs;
+    g_syscall_table[SYS_getpriority] = syscall_getpriority;
+    g_syscall_table[SYS_setpriority] = syscall_setpriority;
+    g_syscall_table[SYS_poll] = syscall_poll;
+    g_syscall_table[SYS_epoll_create1] = syscall_epoll_create1;
+    g_syscall_table[SYS_epoll_ctl] = syscall_epoll_ctl;
+    g_syscall_table[SYS_epoll_wait] = syscall_epoll_wait;
+    g_syscall_table[SYS_soso_read_dir_stat] = syscall_soso_read_dir_stat;
+    g_syscall_table[SYS_msync] = syscall_msync;
+    g_syscall_table[SYS_sendfile] = syscall_sendfile;
+    g_syscall_table[SYS_splice] = syscall_splice;
+    g_syscall_table[SYS_sendmmsg] = syscall_sendmmsg;
+    g_syscall_table[SYS_recvmmsg] = syscall_recvmmsg;
 
     // Register our syscall handler.
     interrupt_register (0x80, &handle_syscall);
@@ -248,6 +273,8 @@ static void handle_syscall(Registers* regs)
 
     //I think it is better to enable interrupts in syscall implementations if it is needed.
 
+    thread->syscall_registers = regs;
+
     int ret;
     asm volatile (" \
       pushl %1; \
@@ -277,6 +304,46 @@ int syscall_printk(const char *str, int num)
     return 0;
 }
 
+//Creates the file pathname names in its parent directory, for open with O_CREAT
+static FileSystemNode* create_file(const char *pathname, Process* process, uint32_t flags)
+{
+    char parent_path[128];
+    const char* name = pathname;
+    FileSystemNode* parent = process->working_directory;
+
+    int length = strlen(pathname);
+    for (int i = length - 1; i >= 0; --i)
+    {
+        if (pathname[i] == '/')
+        {
+            if (i >= (int)sizeof(parent_path))
+            {
+                return NULL;
+            }
+
+            name = pathname + i + 1;
+            strncpy(parent_path, pathname, i);
+            parent_path[i] = '\0';
+
+            if (0 == i)
+            {
+                parent_path[0] = '/';
+                parent_path[1] = '\0';
+            }
+
+            parent = fs_get_node_absolute_or_relative(parent_path, process);
+            break;
+        }
+    }
+
+    if (NULL == parent || '\0' == name[0])
+    {
+        return NULL;
+    }
+
+    return fs_create(parent, name, flags);
+}
+
 int syscall_open(const char *pathname, int flags)
 {
     if (!check_user_access((char*)pathname))
@@ -288,12 +355,28 @@ int syscall_open(const char *pathname, int flags)
     if (process)
     {
         FileSystemNode* node = fs_get_node_absolute_or_relative(pathname, process);
+
+        if (node && (flags & (O_CREAT | O_EXCL)) == (O_CREAT | O_EXCL))
+        {
+            return -EEXIST;
+        }
+
+        if (NULL == node && (flags & O_CREAT) == O_CREAT)
+        {
+            node = create_file(pathname, process, flags);
+        }
+
         if (node)
         {
             File* file = fs_open(node, flags);
 
             if (file)
             {
+                if ((flags & O_TRUNC) == O_TRUNC && FALSE == CHECK_ACCESS(flags, O_RDONLY) && file->node->node_type == FT_FILE)
+                {
+                    fs_ftruncate(file, 0);
+                }
+
                 return file->fd;
             }
         }
@@ -309,7 +392,7 @@ int syscall_close(int fd)
     {
         if (fd < SOSO_MAX_OPENED_FILES)
         {
-            File* file = process->fd[fd];
+            File* file = process_get_file(process, fd);
 
             if (file)
             {
@@ -349,7 +432,7 @@ int syscall_read(int fd, void *buf, int nbytes)
     {
         if (fd < SOSO_MAX_OPENED_FILES)
         {
-            File* file = process->fd[fd];
+            File* file = process_get_file(process, fd);
 
             if (file)
             {
@@ -396,7 +479,7 @@ int syscall_write(int fd, void *buf, int nbytes)
 
         if (fd < SOSO_MAX_OPENED_FILES)
         {
-            File* file = process->fd[fd];
+            File* file = process_get_file(process, fd);
 
             if (file)
             {
@@ -517,7 +600,7 @@ int syscall_lseek(int fd, int offset, int whence)
     {
         if (fd < SOSO_MAX_OPENED_FILES)
         {
-            File* file = process->fd[fd];
+            File* file = process_get_file(process, fd);
 
             if (file)
             {
@@ -574,6 +657,133 @@ int syscall_llseek(unsigned int fd, unsigned int offset_high,
     return  0;
 }
 
+//Transfers from in to out, at the given offsets if not NULL. Those offsets are advanced
+//while the file offsets stay where they were.
+static int splice_files(File* in, int64_t *in_offset, File* out, int64_t *out_offset, size_t count)
+{
+    if (CHECK_ACCESS(in->flags, O_WRONLY) || CHECK_ACCESS(out->flags, O_RDONLY))
+    {
+        return -EBADF;
+    }
+
+    int32_t in_saved = in->offset;
+    int32_t out_saved = out->offset;
+
+    if (in_offset)
+    {
+        if (NULL == in->node->lseek)
+        {
+            return -ESPIPE;
+        }
+
+        if (*in_offset < 0 || *in_offset > 0x7FFFFFFF || fs_lseek(in, (int32_t)*in_offset, 0) < 0)//SEEK_SET
+        {
+            return -EINVAL;
+        }
+    }
+
+    if (out_offset)
+    {
+        if (NULL == out->node->lseek)
+        {
+            fs_lseek(in, in_saved, 0);
+            return -ESPIPE;
+        }
+
+        if (*out_offset < 0 || *out_offset > 0x7FFFFFFF || fs_lseek(out, (int32_t)*out_offset, 0) < 0)
+        {
+            fs_lseek(in, in_saved, 0);
+            return -EINVAL;
+        }
+    }
+
+    int32_t result = fs_splice(in, out, MIN(count, 0x7FFFFFFF));
+
+    if (in_offset)
+    {
+        if (result > 0)
+        {
+            *in_offset += result;
+        }
+
+        fs_lseek(in, in_saved, 0);
+    }
+
+    if (out_offset)
+    {
+        if (result > 0)
+        {
+            *out_offset += result;
+        }
+
+        fs_lseek(out, out_saved, 0);
+    }
+
+    return result;
+}
+
+int syscall_sendfile(int out_fd, int in_fd, int64_t *offset, size_t count)
+{
+    if (!check_user_access(offset))
+    {
+        return -EFAULT;
+    }
+
+    Process* process = thread_get_current()->owner;
+    if (process)
+    {
+        File* in = process_get_file(process, in_fd);
+        File* out = process_get_file(process, out_fd);
+
+        if (NULL == in || NULL == out)
+        {
+            return -EBADF;
+        }
+
+        return splice_files(in, offset, out, NULL, count);
+    }
+    else
+    {
+        PANIC("Process is NULL!\n");
+    }
+
+    return -1;
+}
+
+//Unlike Linux neither end has to be a pipe. flags (SPLICE_F_*) are hints and ignored.
+int syscall_splice(int in_fd, int64_t *in_offset, int out_fd, int64_t *out_offset, size_t count, uint32_t flags)
+{
+    if (!check_user_access(in_offset))
+    {
+        return -EFAULT;
+    }
+
+    if (!check_user_access(out_offset))
+    {
+        return -EFAULT;
+    }
+
+    Process* process = thread_get_current()->owner;
+    if (process)
+    {
+        File* in = process_get_file(process, in_fd);
+        File* out = process_get_file(process, out_fd);
+
+        if (NULL == in || NULL == out)
+        {
+            return -EBADF;
+        }
+
+        return splice_files(in, in_offset, out, out_offset, count);
+    }
+    else
+    {
+        PANIC("Process is NULL!\n");
+    }
+
+    return -1;
+}
+
 int syscall_stat(const char *path, struct stat *buf)
 {
     if (!check_user_access((char*)path))
@@ -616,7 +826,7 @@ int syscall_fstat(int fd, struct stat *buf)
     {
         if (fd < SOSO_MAX_OPENED_FILES)
         {
-            File* file = process->fd[fd];
+            File* file = process_get_file(process, fd);
 
             if (file)
             {
@@ -653,7 +863,7 @@ int syscall_ioctl(int fd, int32_t request, void *arg)
 
         if (fd < SOSO_MAX_OPENED_FILES)
         {
-            File* file = process->fd[fd];
+            File* file = process_get_file(process, fd);
 
             if (file)
             {
@@ -707,7 +917,22 @@ void* syscall_sbrk(uint32_t increment)
 
 int syscall_fork()
 {
-    //Not implemented
+    Thread* thread = thread_get_current();
+
+    Process* process = thread->owner;
+    if (process)
+    {
+        Process* child = process_fork(thread);
+
+        if (child)
+        {
+            return child->pid;
+        }
+    }
+    else
+    {
+        PANIC("Process is NULL!\n");
+    }
 
     return -1;
 }
@@ -753,36 +978,17 @@ int syscall_execute(const char *path, char *const argv[], char *const envp[])
         FileSystemNode* node = fs_get_node_absolute_or_relative(path, process);
         if (node)
         {
-            File* f = fs_open(node, 0);
-            if (f)
+            char* name = "UserProcess";
+            if (NULL != argv)
             {
-                void* image = kmalloc(node->length);
-
-                //Screen_PrintF("executing %s and its %d bytes\n", filename, node->length);
-
-                int32_t bytes_read = fs_read(f, node->length, image);
-
-                //Screen_PrintF("syscall_execute: fs_read returned %d bytes\n", bytes_read);
-
-                if (bytes_read > 0)
-                {
-                    char* name = "UserProcess";
-                    if (NULL != argv)
-                    {
-                        name = argv[0];
-                    }
-                    Process* new_process = process_create_from_elf_data(name, image, argv, envp, process, NULL);
-
-                    if (new_process)
-                    {
-                        result = new_process->pid;
-                    }
-                }
-                fs_close(f);
-
-                kfree(image);
+                name = argv[0];
             }
+            Process* new_process = process_create_from_file(name, 0, node, argv, envp, process, NULL);
 
+            if (new_process)
+            {
+                result = new_process->pid;
+            }
         }
     }
     else
@@ -824,36 +1030,17 @@ int syscall_execute_on_tty(const char *path, char *const argv[], char *const env
         FileSystemNode* tty_node = fs_get_node_absolute_or_relative(tty_path, process);
         if (node && tty_node)
         {
-            File* f = fs_open(node, 0);
-            if (f)
+            char* name = "UserProcess";
+            if (NULL != argv)
             {
-                void* image = kmalloc(node->length);
-
-                //Screen_PrintF("executing %s and its %d bytes\n", filename, node->length);
-
-                int32_t bytesRead = fs_read(f, node->length, image);
-
-                //Screen_PrintF("syscall_execute: fs_read returned %d bytes\n", bytesRead);
-
-                if (bytesRead > 0)
-                {
-                    char* name = "UserProcess";
-                    if (NULL != argv)
-                    {
-                        name = argv[0];
-                    }
-                    Process* new_process = process_create_from_elf_data(name, image, argv, envp, process, tty_node);
-
-                    if (new_process)
-                    {
-                        result = new_process->pid;
-                    }
-                }
-                fs_close(f);
-
-                kfree(image);
+                name = argv[0];
             }
+            Process* new_process = process_create_from_file(name, 0, node, argv, envp, process, tty_node);
 
+            if (new_process)
+            {
+                result = new_process->pid;
+            }
         }
     }
     else
@@ -886,34 +1073,24 @@ int syscall_execve(const char *path, char *const argv[], char *const envp[])
     FileSystemNode* node = fs_get_node(path);
     if (node)
     {
-        File* f = fs_open(node, 0);
-        if (f)
-        {
-            void* image = kmalloc(node->length);
+        disable_interrupts(); //just in case if a file operation left interrupts enabled.
 
-            if (fs_read(f, node->length, image) > 0)
-            {
-                disable_interrupts(); //just in case if a file operation left interrupts enabled.
+        Process* new_process = process_create_from_file("fromExecve", calling_process->pid, node, argv, envp, calling_process->parent, calling_process->tty);
 
-                Process* new_process = process_create_ex("fromExecve", calling_process->pid, 0, NULL, image, argv, envp, NULL, calling_process->tty);
+        if (new_process)
+        {
+            //The new image takes over the identity, descriptors and the parent of the caller
+            new_process->working_directory = calling_process->working_directory;
 
-                fs_close(f);
+            process_clone_files(new_process, calling_process);
 
-                kfree(image);
+            calling_process->parent = NULL;
 
-                if (new_process)
-                {
-                    process_destroy(calling_process);
+            process_kill(calling_process);
 
-                    wait_for_schedule();
+            wait_for_schedule();
 
-                    //unreachable
-                }
-            }
-
-            fs_close(f);
-
-            kfree(image);
+            //unreachable
         }
     }
 
@@ -1103,6 +1280,8 @@ int syscall_unmount(const char *target)//non-posix
 
             targetNode->mount_point = NULL;
 
+            dcache_purge();
+
             //TODO: check conditions, maybe busy. make clean up.
 
             return 0;//on success
@@ -1173,6 +1352,35 @@ int syscall_rmdir(const char *path)
     return -1;//on error
 }
 
+//d_type values of getdents
+static uint8_t get_dirent_type(uint32_t file_type)
+{
+    if ((file_type & FT_DIRECTORY) == FT_DIRECTORY)
+    {
+        return 4;//DT_DIR
+    }
+
+    switch (file_type)
+    {
+    case FT_FILE:
+        return 8;//DT_REG
+    case FT_CHARACTER_DEVICE:
+        return 2;//DT_CHR
+    case FT_BLOCK_DEVICE:
+        return 6;//DT_BLK
+    case FT_PIPE:
+        return 1;//DT_FIFO
+    case FT_SYMBOLIC_LINK:
+        return 10;//DT_LNK
+    case FT_SOCKET:
+        return 12;//DT_SOCK
+    default:
+        break;
+    }
+
+    return 0;//DT_UNKNOWN
+}
+
 int syscall_getdents(int fd, char *buf, int nbytes)
 {
     if (!check_user_access(buf))
@@ -1185,7 +1393,7 @@ int syscall_getdents(int fd, char *buf, int nbytes)
     {
         if (fd < SOSO_MAX_OPENED_FILES)
         {
-            File* file = process->fd[fd];
+            File* file = process_get_file(process, fd);
 
             if (file)
             {
@@ -1193,19 +1401,40 @@ int syscall_getdents(int fd, char *buf, int nbytes)
 
                 int byte_counter = 0;
 
-                int index = 0;
-                FileSystemDirent* dirent = fs_readdir(file->node, index);
+                //continue from the entry after the last returned one
+                int index = file->offset;
+                FileSystemDirent* dirent = fs_readdir_file(file, index, NULL);
 
-                while (NULL != dirent && (byte_counter + sizeof(FileSystemDirent) <= nbytes))
+                while (NULL != dirent)
                 {
-                    memcpy((uint8_t*)buf + byte_counter, (uint8_t*)dirent, sizeof(FileSystemDirent));
+                    int name_length = strlen(dirent->name);
+                    int record_length = (sizeof(struct dirent64) + name_length + 1 + 7) & ~7;
+
+                    if (byte_counter + record_length > nbytes)
+                    {
+                        if (0 == byte_counter)
+                        {
+                            return -EINVAL;
+                        }
+
+                        break;
+                    }
 
-                    byte_counter += sizeof(FileSystemDirent);
+                    struct dirent64* record = (struct dirent64*)(buf + byte_counter);
+                    record->d_ino = dirent->inode;
+                    record->d_off = index + 1;
+                    record->d_reclen = record_length;
+                    record->d_type = get_dirent_type(dirent->file_type);
+                    strcpy(record->d_name, dirent->name);
+
+                    byte_counter += record_length;
 
                     index += 1;
-                    dirent = fs_readdir(file->node, index);
+                    dirent = fs_readdir_file(file, index, NULL);
                 }
 
+                file->offset = index;
+
                 return byte_counter;
             }
             else
@@ -1238,11 +1467,11 @@ int syscall_soso_read_dir(int fd, void *dirent, int index)
     {
         if (fd < SOSO_MAX_OPENED_FILES)
         {
-            File* file = process->fd[fd];
+            File* file = process_get_file(process, fd);
 
             if (file)
             {
-                FileSystemDirent* dirent_fs = fs_readdir(file->node, index);
+                FileSystemDirent* dirent_fs = fs_readdir_file(file, index, NULL);
 
                 if (dirent_fs)
                 {
@@ -1269,6 +1498,66 @@ int syscall_soso_read_dir(int fd, void *dirent, int index)
     return -1;//on error
 }
 
+//Reads up to max_count entries with their sizes from the directory offset, for listings not wanting a stat per entry
+int syscall_soso_read_dir_stat(int fd, FileSystemDirentStat* entries, int max_count)
+{
+    if (!check_user_access(entries))
+    {
+        return -EFAULT;
+    }
+
+    Process* process = thread_get_current()->owner;
+    if (process)
+    {
+        if (fd >= 0 && fd < SOSO_MAX_OPENED_FILES)
+        {
+            File* file = process_get_file(process, fd);
+
+            if (file)
+            {
+                int count = 0;
+
+                int index = file->offset;
+
+                while (count < max_count)
+                {
+                    uint32_t size = 0;
+                    FileSystemDirent* dirent = fs_readdir_file(file, index, &size);
+
+                    if (NULL == dirent)
+                    {
+                        break;
+                    }
+
+                    memcpy((uint8_t*)&entries[count].dirent, (uint8_t*)dirent, sizeof(FileSystemDirent));
+                    entries[count].size = size;
+
+                    ++count;
+                    ++index;
+                }
+
+                file->offset = index;
+
+                return count;
+            }
+            else
+            {
+                return -EBADF;
+            }
+        }
+        else
+        {
+            return -EBADF;
+        }
+    }
+    else
+    {
+        PANIC("Process is NULL!\n");
+    }
+
+    return -1;//on error
+}
+
 int syscall_getcwd(char *buf, size_t size)
 {
     if (!check_user_access(buf))
@@ -1395,7 +1684,7 @@ int syscall_rt_sigaction(int signum, const struct k_sigaction *act, struct k_sig
     return -1;
 }
 
-void* syscall_mmap(void *addr, int length, int flags, int prot, int fd, int offset)
+void* syscall_mmap(void *addr, int length, int prot, int flags, int fd, int offset)
 {
     uint32_t v_address_hint = (uint32_t)addr;
 
@@ -1416,34 +1705,19 @@ void* syscall_mmap(void *addr, int length, int flags, int prot, int fd, int offs
         if (fd < 0)
         {
             int needed_pages = PAGE_COUNT(length);
-            uint32_t free_pages = vmm_get_free_page_count();
-            //printkf("alloc from mmap length:%x neededPages:%d freePages:%d\n", length, neededPages, freePages);
-            if ((uint32_t)needed_pages + 1 > free_pages)
+            //printkf("alloc from mmap length:%x neededPages:%d\n", length, neededPages);
+
+            //Pages are backed lazily, so only reject what could never fit
+            if ((uint32_t)needed_pages + 1 > vmm_get_total_page_count())
             {
                 return (void*)-1;
             }
-            uint32_t* physical_array = (uint32_t*)kmalloc(needed_pages * sizeof(uint32_t));
-            for (int i = 0; i < needed_pages; ++i)
-            {
-                uint32_t page_frame = vmm_acquire_page_frame_4k();
-                physical_array[i] = page_frame;
-            }
 
-            void* mem = vmm_map_memory(process, v_address_hint, physical_array, needed_pages, TRUE);
-            if (mem != NULL)
+            void* mem = vmm_reserve_memory(process, v_address_hint, needed_pages, VMA_ANONYMOUS);
+            if (mem == NULL)
             {
-                memset((uint8_t*)mem, 0, length);
-            }
-            else
-            {
-                for (int i = 0; i < needed_pages; ++i)
-                {
-                    vmm_release_page_frame_4k(physical_array[i]);
-                }
-
                 mem = (void*)-1;
             }
-            kfree(physical_array);
 
             return mem;
         }
@@ -1451,11 +1725,11 @@ void* syscall_mmap(void *addr, int length, int flags, int prot, int fd, int offs
         {
             if (fd < SOSO_MAX_OPENED_FILES)
             {
-                File* file = process->fd[fd];
+                File* file = process_get_file(process, fd);
 
                 if (file)
                 {
-                    void* ret = fs_mmap(file, length, offset, flags);
+                    void* ret = fs_mmap(file, length, offset, prot, flags);
 
                     if (ret)
                     {
@@ -1515,6 +1789,48 @@ int syscall_munmap(void *addr, int length)
     return -1;
 }
 
+//Writing back is synchronous, so MS_ASYNC and MS_SYNC do the same
+int syscall_msync(void *addr, int length, int flags)
+{
+    if (!check_user_access(addr))
+    {
+        return -EFAULT;
+    }
+
+    if (((uint32_t)addr % PAGESIZE_4K) != 0 || length < 0 || (flags & (MS_ASYNC | MS_SYNC)) == (MS_ASYNC | MS_SYNC))
+    {
+        return -EINVAL;
+    }
+
+    Process* process = thread_get_current()->owner;
+
+    if (process)
+    {
+        if ((uint32_t)addr < USER_OFFSET)
+        {
+            return -ENOMEM;
+        }
+
+        if (length == 0)
+        {
+            return 0;
+        }
+
+        if (vmm_vma_sync(process, (uint32_t)addr, (uint32_t)addr + PAGE_COUNT(length) * PAGESIZE_4K) < 0)
+        {
+            return -EIO;
+        }
+
+        return 0;
+    }
+    else
+    {
+        PANIC("Process is NULL!\n");
+    }
+
+    return -1;
+}
+
 #define AT_FDCWD (-100)
 #define AT_SYMLINK_NOFOLLOW 0x100
 #define AT_REMOVEDIR 0x200
@@ -1561,8 +1877,8 @@ int syscall_statx(int dirfd, const char *pathname, int flags, unsigned int mask,
                 }
                 else if (dirfd >= 0 && dirfd < SOSO_MAX_OPENED_FILES)
                 {
-                    File* dir_fd_dir = process->fd[dirfd];
-                    if ((dir_fd_dir->node->node_type & FT_DIRECTORY) == FT_DIRECTORY) //pathname is relative to the directory that dirfd refers to
+                    File* dir_fd_dir = process_get_file(process, dirfd);
+                    if (dir_fd_dir && (dir_fd_dir->node->node_type & FT_DIRECTORY) == FT_DIRECTORY) //pathname is relative to the directory that dirfd refers to
                     {
                         node = fs_get_node_relative_to_node(pathname, dir_fd_dir->node);
                     }
@@ -1573,9 +1889,10 @@ int syscall_statx(int dirfd, const char *pathname, int flags, unsigned int mask,
         {
             if ((flags & AT_EMPTY_PATH) == AT_EMPTY_PATH)
             {
-                if (dirfd >= 0 && dirfd < SOSO_MAX_OPENED_FILES)
+                File* dir_fd_file = process_get_file(process, dirfd);
+                if (dir_fd_file)
                 {
-                    node = process->fd[dirfd]->node;
+                    node = dir_fd_file->node;
                 }
             }
         }
@@ -1603,7 +1920,8 @@ int syscall_statx(int dirfd, const char *pathname, int flags, unsigned int mask,
     return -1;
 }
 
-#define O_CREAT 0x200
+//shm_open flag of the old interface, userspace passes it as is
+#define SHM_O_CREAT 0x200
 
 int syscall_shm_open(const char *name, int oflag, int mode)
 {
@@ -1614,7 +1932,7 @@ int syscall_shm_open(const char *name, int oflag, int mode)
 
     FileSystemNode* node = NULL;
 
-    if ((oflag & O_CREAT) == O_CREAT)
+    if ((oflag & SHM_O_CREAT) == SHM_O_CREAT)
     {
         node = sharedmemory_create(name);
     }
@@ -1656,7 +1974,7 @@ int syscall_unlink(const char *name)
 
     if (node && node->unlink)
     {
-        return node->unlink(node, 0);
+        return fs_unlink(node, 0);
     }
 
     return -1;
@@ -1669,7 +1987,7 @@ int syscall_ftruncate(int fd, int size)
     {
         if (fd < SOSO_MAX_OPENED_FILES)
         {
-            File* file = process->fd[fd];
+            File* file = process_get_file(process, fd);
 
             if (file)
             {
@@ -1729,11 +2047,11 @@ int syscall_shmget(int32_t key, size_t size, int flag)
         if (process)
         {
             BOOL already_opened = FALSE;
-            for (size_t i = 0; i < SOSO_MAX_OPENED_FILES; i++)
+            for (size_t i = 0; i < process->fd_capacity; i++)
             {
-                File* file = process->fd[i];
+                File* file = process_get_file(process, i);
 
-                if (file->node == node)
+                if (file && file->node == node)
                 {
                     already_opened = TRUE;
                     break;
@@ -1777,11 +2095,11 @@ void * syscall_shmat(int shmid, const void *shmaddr, int shmflg)
         Process* process = thread_get_current()->owner;
         if (process)
         {
-            for (size_t i = 0; i < SOSO_MAX_OPENED_FILES; i++)
+            for (size_t i = 0; i < process->fd_capacity; i++)
             {
-                File* file = process->fd[i];
+                File* file = process_get_file(process, i);
 
-                if (file->node == node)
+                if (file && file->node == node)
                 {
                     return syscall_mmap((void*)shmaddr, file->node->length, shmflg, 0, file->fd, 0);
                 }
@@ -1844,7 +2162,7 @@ int syscall_ptsname_r(int fd, char *buf, int buflen)
     {
         if (fd < SOSO_MAX_OPENED_FILES)
         {
-            File* file = process->fd[fd];
+            File* file = process_get_file(process, fd);
 
             if (file)
             {
@@ -1897,4 +2215,58 @@ int syscall_nanosleep(struct timespec *req, struct timespec *rem)
     }
 
     return -1;
-}
\ No newline at end of file
+}
+
+#define PRIO_PROCESS 0
+
+//Like Linux, returns 20 - nice so that the result is never negative
+int syscall_getpriority(int which, int who)
+{
+    if (which != PRIO_PROCESS)
+    {
+        return -EINVAL;
+    }
+
+    uint32_t pid = (who == 0) ? thread_get_current()->owner->pid : (uint32_t)who;
+
+    Thread* t = thread_get_first();
+    while (t)
+    {
+        if (t->owner->pid == pid)
+        {
+            return 20 - t->nice;
+        }
+
+        t = t->next;
+    }
+
+    return -ESRCH;
+}
+
+//Applies the nice value to all threads of the process
+int syscall_setpriority(int which, int who, int prio)
+{
+    if (which != PRIO_PROCESS)
+    {
+        return -EINVAL;
+    }
+
+    uint32_t pid = (who == 0) ? thread_get_current()->owner->pid : (uint32_t)who;
+
+    int result = -ESRCH;
+
+    Thread* t = thread_get_first();
+    while (t)
+    {
+        if (t->owner->pid == pid)
+        {
+            thread_set_nice(t, prio);
+
+            result = 0;
+        }
+
+        t = t->next;
+    }
+
+    return result;
+}
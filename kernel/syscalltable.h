@@ -85,6 +85,22 @@ enum
     SYS_getthreads,
     SYS_getprocs,
 
+    SYS_getpriority,
+    SYS_setpriority,
+
+    SYS_poll,
+    SYS_epoll_create1,
+    SYS_epoll_ctl,
+    SYS_epoll_wait,
+
+    SYS_soso_read_dir_stat,
+
+    SYS_msync,
+    SYS_sendfile,
+    SYS_splice,
+    SYS_sendmmsg,
+    SYS_recvmmsg,
+
     SYSCALL_COUNT
 };
 
@@ -5,6 +5,8 @@
 #include "device.h"
 #include "vmm.h"
 #include "process.h"
+#include "benchmark.h"
+#include "blockcache.h"
 
 static FileSystemNode* g_systemfs_root = NULL;
 
@@ -21,6 +23,10 @@ static int32_t systemfs_read_meminfo_totalpages(File *file, uint32_t size, uint8
 static int32_t systemfs_read_meminfo_usedpages(File *file, uint32_t size, uint8_t *buffer);
 static BOOL systemfs_open_threads_dir(File *file, uint32_t flags);
 static void systemfs_close_threads_dir(File *file);
+static int32_t systemfs_read_benchmark_memory(File *file, uint32_t size, uint8_t *buffer);
+static int32_t systemfs_read_benchmark_seek(File *file, uint32_t size, uint8_t *buffer);
+static void systemfs_close_benchmark(File *file);
+static int32_t systemfs_read_blockcache(File *file, uint32_t size, uint8_t *buffer);
 
 void systemfs_initialize()
 {
@@ -125,6 +131,54 @@ static void create_nodes()
     node_shm->parent = g_systemfs_root;
 
     node_pipes->next_sibling = node_shm;
+
+    //
+
+    FileSystemNode* node_benchmark = kmalloc(sizeof(FileSystemNode));
+    memset((uint8_t*)node_benchmark, 0, sizeof(FileSystemNode));
+
+    strcpy(node_benchmark->name, "benchmark");
+    node_benchmark->node_type = FT_DIRECTORY;
+    node_benchmark->open = systemfs_open;
+    node_benchmark->finddir = systemfs_finddir;
+    node_benchmark->readdir = systemfs_readdir;
+    node_benchmark->parent = g_systemfs_root;
+
+    node_shm->next_sibling = node_benchmark;
+
+    FileSystemNode* node_benchmark_memory = kmalloc(sizeof(FileSystemNode));
+    memset((uint8_t*)node_benchmark_memory, 0, sizeof(FileSystemNode));
+    strcpy(node_benchmark_memory->name, "memory");
+    node_benchmark_memory->node_type = FT_FILE;
+    node_benchmark_memory->open = systemfs_open;
+    node_benchmark_memory->close = systemfs_close_benchmark;
+    node_benchmark_memory->read = systemfs_read_benchmark_memory;
+    node_benchmark_memory->parent = node_benchmark;
+
+    node_benchmark->first_child = node_benchmark_memory;
+
+    FileSystemNode* node_benchmark_seek = kmalloc(sizeof(FileSystemNode));
+    memset((uint8_t*)node_benchmark_seek, 0, sizeof(FileSystemNode));
+    strcpy(node_benchmark_seek->name, "seek");
+    node_benchmark_seek->node_type = FT_FILE;
+    node_benchmark_seek->open = systemfs_open;
+    node_benchmark_seek->close = systemfs_close_benchmark;
+    node_benchmark_seek->read = systemfs_read_benchmark_seek;
+    node_benchmark_seek->parent = node_benchmark;
+
+    node_benchmark_memory->next_sibling = node_benchmark_seek;
+
+    //
+
+    FileSystemNode* node_blockcache = kmalloc(sizeof(FileSystemNode));
+    memset((uint8_t*)node_blockcache, 0, sizeof(FileSystemNode));
+    strcpy(node_blockcache->name, "blockcache");
+    node_blockcache->node_type = FT_FILE;
+    node_blockcache->open = systemfs_open;
+    node_blockcache->read = systemfs_read_blockcache;
+    node_blockcache->parent = g_systemfs_root;
+
+    node_benchmark->next_sibling = node_blockcache;
 }
 
 static BOOL systemfs_open(File *file, uint32_t flags)
@@ -223,6 +277,89 @@ static int32_t systemfs_read_meminfo_usedpages(File *file, uint32_t size, uint8_
     return -1;
 }
 
+#define BENCHMARK_REPORT_SIZE 4096
+
+//The benchmark runs on first read. The report is kept in the File so it can be read in chunks.
+static int32_t read_benchmark_report(File *file, uint32_t size, uint8_t *buffer, uint32_t (*run)(char*, uint32_t))
+{
+    if (NULL == file->private_data)
+    {
+        char* report = kmalloc(BENCHMARK_REPORT_SIZE);
+        memset((uint8_t*)report, 0, BENCHMARK_REPORT_SIZE);
+
+        run(report, BENCHMARK_REPORT_SIZE);
+
+        file->private_data = report;
+    }
+
+    char* report = (char*)file->private_data;
+
+    int32_t remaining = strlen(report) - file->offset;
+
+    if (remaining <= 0)
+    {
+        return 0;
+    }
+
+    uint32_t len = MIN((uint32_t)remaining, size);
+
+    memcpy(buffer, (uint8_t*)report + file->offset, len);
+
+    file->offset += len;
+
+    return len;
+}
+
+static int32_t systemfs_read_benchmark_memory(File *file, uint32_t size, uint8_t *buffer)
+{
+    return read_benchmark_report(file, size, buffer, benchmark_memory);
+}
+
+static int32_t systemfs_read_benchmark_seek(File *file, uint32_t size, uint8_t *buffer)
+{
+    return read_benchmark_report(file, size, buffer, benchmark_file_seek);
+}
+
+static void systemfs_close_benchmark(File *file)
+{
+    kfree(file->private_data);
+    file->private_data = NULL;
+}
+
+static int32_t systemfs_read_blockcache(File *file, uint32_t size, uint8_t *buffer)
+{
+    if (size >= 128)
+    {
+        if (file->offset == 0)
+        {
+            uint32_t hits = 0;
+            uint32_t misses = 0;
+            uint32_t read_aheads = 0;
+            uint32_t write_backs = 0;
+            uint32_t dirty = 0;
+            blockcache_get_statistics(&hits, &misses, &read_aheads, &write_backs, &dirty);
+
+            uint32_t char_index = 0;
+            char_index += sprintf((char*)buffer + char_index, size - char_index, "hits:%d\n", hits);
+            char_index += sprintf((char*)buffer + char_index, size - char_index, "misses:%d\n", misses);
+            char_index += sprintf((char*)buffer + char_index, size - char_index, "readAheads:%d\n", read_aheads);
+            char_index += sprintf((char*)buffer + char_index, size - char_index, "writeBacks:%d\n", write_backs);
+            char_index += sprintf((char*)buffer + char_index, size - char_index, "dirty:%d\n", dirty);
+
+            int len = char_index;
+
+            file->offset += len;
+
+            return len;
+        }
+        else
+        {
+            return 0;
+        }
+    }
+    return -1;
+}
+
 static BOOL systemfs_open_thread_file(File *file, uint32_t flags)
 {
     return TRUE;
@@ -250,6 +387,7 @@ static int32_t systemfs_read_thread_file(File *file, uint32_t size, uint8_t *buf
                 uint8_t state[10];
                 thread_state_to_string(thread->state, state, 10);
                 char_index += sprintf((char*)buffer + char_index, size - char_index, "state:%s\n", state);
+                char_index += sprintf((char*)buffer + char_index, size - char_index, "nice:%d\n", thread->nice);
                 char_index += sprintf((char*)buffer + char_index, size - char_index, "syscalls:%d\n", thread->called_syscall_count);
                 char_index += sprintf((char*)buffer + char_index, size - char_index, "contextSwitches:%d\n", thread->context_switch_count);
                 char_index += sprintf((char*)buffer + char_index, size - char_index, "cpuTime:%d\n", thread->consumed_cpu_time_ms);
@@ -286,6 +424,7 @@ static void clean_thread_nodes(File *file)
     {
         FileSystemNode* next = node->next_sibling;
 
+        waitqueue_destroy(&node->waiters);
         kfree(node);
 
         node = next;
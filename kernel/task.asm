@@ -21,8 +21,13 @@ switch_task:
         mov al, 0x20
         out 0x20, al
 
+        ; threads of the same process share the page directory, reloading CR3 would only flush the TLB
         mov eax, [esi+56]
+        mov edx, cr3
+        cmp eax, edx
+        je .same_page_directory
         mov cr3, eax
+.same_page_directory:
 
         pop gs
         pop fs
@@ -0,0 +1,486 @@
+#include "tmpfs.h"
+#include "fs.h"
+#include "alloc.h"
+#include "process.h"
+#include "pagecache.h"
+#include "errno.h"
+
+#define SEEK_SET	0	/* Seek from beginning of file.  */
+#define SEEK_CUR	1	/* Seek from current position.  */
+#define SEEK_END	2
+
+//Files live in memory only. The data of a file is its page cache, so mmap (fs_mmap) maps those very pages.
+
+//private_node_data of a regular file and of a directory
+typedef struct TmpfsFile
+{
+    uint32_t open_count;
+    BOOL unlinked;//freed when the last File is closed
+} TmpfsFile;
+
+static uint32_t g_next_inode = 1;
+
+static FileSystemDirent g_dirent;
+
+static BOOL tmpfs_mount(const char* source_path, const char* target_path, uint32_t flags, void *data);
+static BOOL tmpfs_check_mount(const char* source_path, const char* target_path, uint32_t flags, void *data);
+static BOOL tmpfs_dir_open(File *file, uint32_t flags);
+static void tmpfs_dir_close(File *file);
+static FileSystemDirent *tmpfs_readdir(FileSystemNode *node, uint32_t index);
+static FileSystemNode *tmpfs_finddir(FileSystemNode *node, char *name);
+static BOOL tmpfs_mkdir(FileSystemNode *node, const char *name, uint32_t flags);
+static FileSystemNode *tmpfs_create(FileSystemNode *node, const char *name, uint32_t flags);
+static int32_t tmpfs_unlink(FileSystemNode* node, uint32_t flags);
+static int32_t tmpfs_stat(FileSystemNode *node, struct stat *buf);
+static BOOL tmpfs_open(File *file, uint32_t flags);
+static void tmpfs_close(File *file);
+static int32_t tmpfs_read(File *file, uint32_t size, uint8_t *buffer);
+static int32_t tmpfs_write(File *file, uint32_t size, uint8_t *buffer);
+static int32_t tmpfs_lseek(File *file, int32_t offset, int32_t whence);
+static int32_t tmpfs_ftruncate(File *file, int32_t length);
+
+void tmpfs_initialize()
+{
+    FileSystem fs;
+    memset((uint8_t*)&fs, 0, sizeof(fs));
+    strcpy(fs.name, "tmpfs");
+    fs.mount = tmpfs_mount;
+    fs.check_mount = tmpfs_check_mount;
+
+    fs_register(&fs);
+}
+
+static FileSystemNode* create_directory_node(const char* name, FileSystemNode* parent)
+{
+    TmpfsFile* tmpfs_directory = (TmpfsFile*)kmalloc(sizeof(TmpfsFile));
+    memset((uint8_t*)tmpfs_directory, 0, sizeof(TmpfsFile));
+
+    FileSystemNode* node = (FileSystemNode*)kmalloc(sizeof(FileSystemNode));
+    memset((uint8_t*)node, 0, sizeof(FileSystemNode));
+    strcpy(node->name, name);
+    node->node_type = FT_DIRECTORY;
+    node->inode = g_next_inode++;
+    node->open = tmpfs_dir_open;
+    node->close = tmpfs_dir_close;
+    node->readdir = tmpfs_readdir;
+    node->finddir = tmpfs_finddir;
+    node->mkdir = tmpfs_mkdir;
+    node->create = tmpfs_create;
+    node->unlink = tmpfs_unlink;
+    node->stat = tmpfs_stat;
+    node->cache_lookups = TRUE;
+    node->parent = parent;
+    node->private_node_data = tmpfs_directory;
+
+    return node;
+}
+
+static void add_child(FileSystemNode* directory, FileSystemNode* child)
+{
+    if (directory->first_child == NULL)
+    {
+        directory->first_child = child;
+    }
+    else
+    {
+        FileSystemNode *n = directory->first_child;
+        while (NULL != n->next_sibling)
+        {
+            n = n->next_sibling;
+        }
+        n->next_sibling = child;
+    }
+}
+
+static void remove_child(FileSystemNode* directory, FileSystemNode* child)
+{
+    FileSystemNode** link = &directory->first_child;
+    while (NULL != *link)
+    {
+        if (*link == child)
+        {
+            *link = child->next_sibling;
+            child->next_sibling = NULL;
+            return;
+        }
+        link = &(*link)->next_sibling;
+    }
+}
+
+static void destroy_file_node(FileSystemNode* node)
+{
+    PageCache* cache = node->page_cache;
+
+    node->page_cache = NULL;
+
+    //Mappings still holding the cache keep the pages until they are unmapped
+    cache->node = NULL;
+    pagecache_release(cache);
+
+    kfree(node->private_node_data);
+    waitqueue_destroy(&node->waiters);
+    kfree(node);
+}
+
+static BOOL tmpfs_check_mount(const char* source_path, const char* target_path, uint32_t flags, void *data)
+{
+    FileSystemNode* target_node = fs_get_node(target_path);
+    if (target_node)
+    {
+        if (target_node->node_type == FT_DIRECTORY)
+        {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+static BOOL tmpfs_mount(const char* source_path, const char* target_path, uint32_t flags, void *data)
+{
+    FileSystemNode* target_node = fs_get_node(target_path);
+    if (target_node && target_node->node_type == FT_DIRECTORY)
+    {
+        FileSystemNode* root = create_directory_node(target_node->name, target_node->parent);
+
+        //The root goes away only with the mount
+        root->unlink = NULL;
+
+        target_node->node_type |= FT_MOUNT_POINT;
+        target_node->mount_point = root;
+
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+static BOOL tmpfs_dir_open(File *file, uint32_t flags)
+{
+    TmpfsFile* tmpfs_directory = (TmpfsFile*)file->node->private_node_data;
+
+    ++tmpfs_directory->open_count;
+
+    return TRUE;
+}
+
+static void tmpfs_dir_close(File *file)
+{
+    TmpfsFile* tmpfs_directory = (TmpfsFile*)file->node->private_node_data;
+
+    --tmpfs_directory->open_count;
+
+    if (tmpfs_directory->unlinked && 0 == tmpfs_directory->open_count)
+    {
+        kfree(tmpfs_directory);
+        waitqueue_destroy(&file->node->waiters);
+        kfree(file->node);
+    }
+}
+
+static FileSystemDirent *tmpfs_readdir(FileSystemNode *node, uint32_t index)
+{
+    FileSystemNode *n = node->first_child;
+    uint32_t i = 0;
+    while (NULL != n)
+    {
+        if (index == i)
+        {
+            g_dirent.file_type = n->node_type;
+            g_dirent.inode = n->inode;
+            strcpy(g_dirent.name, n->name);
+
+            return &g_dirent;
+        }
+        n = n->next_sibling;
+        ++i;
+    }
+
+    return NULL;
+}
+
+static FileSystemNode *tmpfs_finddir(FileSystemNode *node, char *name)
+{
+    FileSystemNode *n = node->first_child;
+    while (NULL != n)
+    {
+        if (strcmp(name, n->name) == 0)
+        {
+            return n;
+        }
+        n = n->next_sibling;
+    }
+
+    return NULL;
+}
+
+static BOOL is_valid_name(FileSystemNode *directory, const char *name)
+{
+    //Still open but removed, nothing can be added to it
+    if (((TmpfsFile*)directory->private_node_data)->unlinked)
+    {
+        return FALSE;
+    }
+
+    int length = strlen(name);
+
+    if (length == 0 || length >= (int)sizeof(directory->name))
+    {
+        return FALSE;
+    }
+
+    return NULL == tmpfs_finddir(directory, (char*)name);
+}
+
+static BOOL tmpfs_mkdir(FileSystemNode *node, const char *name, uint32_t flags)
+{
+    if (FALSE == is_valid_name(node, name))
+    {
+        return FALSE;
+    }
+
+    add_child(node, create_directory_node(name, node));
+
+    return TRUE;
+}
+
+static FileSystemNode *tmpfs_create(FileSystemNode *node, const char *name, uint32_t flags)
+{
+    if (FALSE == is_valid_name(node, name))
+    {
+        return NULL;
+    }
+
+    TmpfsFile* tmpfs_file = (TmpfsFile*)kmalloc(sizeof(TmpfsFile));
+    memset((uint8_t*)tmpfs_file, 0, sizeof(TmpfsFile));
+
+    FileSystemNode* new_node = (FileSystemNode*)kmalloc(sizeof(FileSystemNode));
+    memset((uint8_t*)new_node, 0, sizeof(FileSystemNode));
+    strcpy(new_node->name, name);
+    new_node->node_type = FT_FILE;
+    new_node->inode = g_next_inode++;
+    new_node->open = tmpfs_open;
+    new_node->close = tmpfs_close;
+    new_node->read = tmpfs_read;
+    new_node->write = tmpfs_write;
+    new_node->lseek = tmpfs_lseek;
+    new_node->ftruncate = tmpfs_ftruncate;
+    new_node->unlink = tmpfs_unlink;
+    new_node->stat = tmpfs_stat;
+    new_node->parent = node;
+    new_node->private_node_data = tmpfs_file;
+
+    pagecache_create_storage(new_node);
+
+    add_child(node, new_node);
+
+    return new_node;
+}
+
+static BOOL is_working_directory(FileSystemNode* node)
+{
+    for (Thread* thread = thread_get_first(); thread != NULL; thread = thread->next)
+    {
+        if (thread->owner && thread->owner->working_directory == node)
+        {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+static int32_t tmpfs_unlink(FileSystemNode* node, uint32_t flags)
+{
+    if (node->node_type == FT_DIRECTORY)
+    {
+        if (node->first_child)
+        {
+            return -ENOTEMPTY;
+        }
+
+        if (is_working_directory(node))
+        {
+            return -EBUSY;
+        }
+
+        remove_child(node->parent, node);
+
+        //An open directory goes away with its last File, reading it meanwhile shows it empty
+        TmpfsFile* tmpfs_directory = (TmpfsFile*)node->private_node_data;
+
+        if (tmpfs_directory->open_count > 0)
+        {
+            tmpfs_directory->unlinked = TRUE;
+        }
+        else
+        {
+            kfree(tmpfs_directory);
+            waitqueue_destroy(&node->waiters);
+            kfree(node);
+        }
+
+        return 0;
+    }
+
+    if (node->node_type != FT_FILE)
+    {
+        //a mount point
+        return -EBUSY;
+    }
+
+    TmpfsFile* tmpfs_file = (TmpfsFile*)node->private_node_data;
+
+    remove_child(node->parent, node);
+
+    if (tmpfs_file->open_count > 0)
+    {
+        tmpfs_file->unlinked = TRUE;
+    }
+    else
+    {
+        destroy_file_node(node);
+    }
+
+    return 0;
+}
+
+static int32_t tmpfs_stat(FileSystemNode *node, struct stat *buf)
+{
+    buf->st_ino = node->inode;
+    buf->st_blksize = PAGESIZE_4K;
+
+    if (node->page_cache)
+    {
+        //only the pages written count, holes of sparse files are free
+        uint32_t pages = 0;
+        for (uint32_t i = 0; i < node->page_cache->page_count; ++i)
+        {
+            if (node->page_cache->pages[i])
+            {
+                ++pages;
+            }
+        }
+
+        buf->st_blocks = pages * (PAGESIZE_4K / 512);
+    }
+
+    return 1;
+}
+
+static BOOL tmpfs_open(File *file, uint32_t flags)
+{
+    TmpfsFile* tmpfs_file = (TmpfsFile*)file->node->private_node_data;
+
+    ++tmpfs_file->open_count;
+
+    return TRUE;
+}
+
+static void tmpfs_close(File *file)
+{
+    TmpfsFile* tmpfs_file = (TmpfsFile*)file->node->private_node_data;
+
+    --tmpfs_file->open_count;
+
+    if (tmpfs_file->unlinked && 0 == tmpfs_file->open_count)
+    {
+        destroy_file_node(file->node);
+    }
+}
+
+static int32_t tmpfs_read(File *file, uint32_t size, uint8_t *buffer)
+{
+    if (file->offset < 0)
+    {
+        return -1;
+    }
+
+    int32_t bytes_read = pagecache_read(file->node->page_cache, file->offset, size, buffer);
+
+    if (bytes_read > 0)
+    {
+        file->offset += bytes_read;
+    }
+
+    return bytes_read;
+}
+
+static int32_t tmpfs_write(File *file, uint32_t size, uint8_t *buffer)
+{
+    FileSystemNode* node = file->node;
+
+    if ((file->flags & O_APPEND) == O_APPEND)
+    {
+        file->offset = node->length;
+    }
+
+    if (file->offset < 0)
+    {
+        return -1;
+    }
+
+    int32_t written = pagecache_write(node->page_cache, file->offset, size, buffer);
+
+    if (written > 0)
+    {
+        file->offset += written;
+
+        node->length = MAX(node->length, (uint32_t)file->offset);
+    }
+    else if (written < 0)
+    {
+        return -ENOSPC;
+    }
+
+    return written;
+}
+
+static int32_t tmpfs_lseek(File *file, int32_t offset, int32_t whence)
+{
+    int32_t position = -1;
+
+    switch (whence)
+    {
+    case SEEK_SET:
+        position = offset;
+        break;
+    case SEEK_CUR:
+        position = file->offset + offset;
+        break;
+    case SEEK_END:
+        position = (int32_t)file->node->length + offset;
+        break;
+    default:
+        break;
+    }
+
+    //Seeking after the end is fine, writing there leaves a hole
+    if (position < 0)
+    {
+        return -EINVAL;
+    }
+
+    file->offset = position;
+
+    return position;
+}
+
+static int32_t tmpfs_ftruncate(File *file, int32_t length)
+{
+    if (length < 0)
+    {
+        return -EINVAL;
+    }
+
+    FileSystemNode* node = file->node;
+
+    if (FALSE == pagecache_resize(node->page_cache, length))
+    {
+        return -ENOSPC;
+    }
+
+    node->length = length;
+
+    return 0;
+}
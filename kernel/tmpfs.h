@@ -0,0 +1,8 @@
+#ifndef TMPFS_H
+#define TMPFS_H
+
+#include "common.h"
+
+void tmpfs_initialize();
+
+#endif // TMPFS_H
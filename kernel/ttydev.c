@@ -121,6 +121,8 @@ static void wake_slave_readers(TtyDev* tty)
         }
     }
     spinlock_unlock(&tty->slave_readers_lock);
+
+    fs_node_notify(tty->slave_node);
 }
 
 static BOOL master_open(File *file, uint32_t flags)
@@ -420,6 +422,8 @@ static int32_t master_write(File *file, uint32_t size, uint8_t *buffer)
                     thread_resume(tty->master_reader);
                 }
             }
+
+            fs_node_notify(tty->master_node);
         }
     }
 
@@ -714,7 +718,9 @@ static int32_t slave_write(File *file, uint32_t size, uint8_t *buffer)
                 thread_resume(tty->master_reader);
             }
         }
-        
+
+        fs_node_notify(tty->master_node);
+
         return written;
     }
 
@@ -1,26 +1,59 @@
 #include "unixsocket.h"
-#include "fifobuffer.h"
+#include "pagering.h"
 #include "list.h"
 #include "fs.h"
 #include "alloc.h"
 #include "common.h"
 #include "socket.h"
 #include "errno.h"
-typedef struct
+
+#define UNIXSOCKET_BUCKET_COUNT 256
+
+//Address of a socket. A path name ends at its first '\0', an abstract one starts with '\0' and may hold any byte.
+typedef struct UnixName
+{
+    char path[SOCKET_NAME_SIZE];
+    uint32_t length;//0 if unnamed
+} UnixName;
+
+//A record of the receive queue: a message of a datagram/seqpacket socket,
+//or on a stream socket the bytes that were sent together with descriptors.
+typedef struct UnixMessage
+{
+    uint32_t position;//stream offset of the first byte
+    uint32_t length;
+    UnixName sender;//of a datagram
+    uint32_t file_count;
+    File* files[SCM_MAX_FD];//detached until received
+} UnixMessage;
+
+typedef struct UnixSocket
 {
     Socket* owner;
-    char name[SOCKET_NAME_SIZE];
+    UnixName name;
+    uint32_t name_hash;
+    struct UnixSocket* hash_next;//in the bucket of bound sockets
+    UnixName peer_name;//default destination of a connected datagram socket
+    Socket* listener;//while waiting in its accept queue
+    BOOL refused;//the listener went away before accepting
+    List* messages;//records of buffer_in, oldest first
+    uint32_t queued;//stream bytes ever put in buffer_in
+    uint32_t received;//stream bytes ever taken from buffer_in
 } UnixSocket;
 
+//Bound sockets by name
+static UnixSocket* g_buckets[UNIXSOCKET_BUCKET_COUNT];
+
 static void unixsocket_closing(Socket* socket);
 static int unixsocket_bind(Socket* socket, int sockfd, const struct sockaddr *addr, socklen_t addrlen);
 static int unixsocket_listen(Socket* socket, int sockfd, int backlog);
 static int unixsocket_accept(Socket* socket, int sockfd, struct sockaddr *addr, socklen_t *addrlen);
 static int unixsocket_connect(Socket* socket, int sockfd, const struct sockaddr *addr, socklen_t addrlen);
-static ssize_t unixsocket_send(Socket* socket, int sockfd, const void *buf, size_t len, int flags);
-static ssize_t unixsocket_recv(Socket* socket, int sockfd, void *buf, size_t len, int flags);
+static ssize_t unixsocket_sendmsg(Socket* socket, int sockfd, const struct msghdr *msg, int flags);
+static ssize_t unixsocket_recvmsg(Socket* socket, int sockfd, struct msghdr *msg, int flags);
 
 static BOOL unixsocket_fs_read_test_ready(File *file);
+static BOOL unixsocket_fs_write_test_ready(File *file);
 static int32_t unixsocket_fs_read(File *file, uint32_t len, uint8_t *buf);
 static int32_t unixsocket_fs_write(File *file, uint32_t len, uint8_t *buf);
 
@@ -33,65 +66,468 @@ void unixsocket_setup(Socket* socket)
 
     socket->custom_socket = unix_socket;
     unix_socket->owner = socket;
+    unix_socket->messages = list_create();
 
     socket->socket_closing = unixsocket_closing;
     socket->socket_bind = unixsocket_bind;
     socket->socket_listen = unixsocket_listen;
     socket->socket_accept = unixsocket_accept;
     socket->socket_connect = unixsocket_connect;
-    socket->socket_send = unixsocket_send;
-    socket->socket_recv = unixsocket_recv;
+    socket->socket_sendmsg = unixsocket_sendmsg;
+    socket->socket_recvmsg = unixsocket_recvmsg;
 
     socket->node->read_test_ready = unixsocket_fs_read_test_ready;
+    socket->node->write_test_ready = unixsocket_fs_write_test_ready;
     socket->node->read = unixsocket_fs_read;
     socket->node->write = unixsocket_fs_write;
 }
 
-static int unixsocket_bind(Socket* socket, int sockfd, const struct sockaddr *addr, socklen_t addrlen)
+static uint32_t hash_name(const UnixName* name)
 {
-    //printkf("unixsocket_bind\n");
+    //FNV-1a, abstract names may contain '\0'
+    uint32_t hash = 2166136261u;
 
-    UnixSocket* unix_socket = (UnixSocket*)socket->custom_socket;
+    for (uint32_t i = 0; i < name->length; ++i)
+    {
+        hash ^= (uint8_t)name->path[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
 
-    if (strlen(unix_socket->name) > 0)
+static BOOL is_same_name(const UnixName* name, const UnixName* other)
+{
+    if (name->length != other->length)
     {
-        return -EINVAL; //The socket is already bound to an address.
+        return FALSE;
     }
 
-    if (strlen(addr->sa_data) == 0)
+    for (uint32_t i = 0; i < name->length; ++i)
+    {
+        if (name->path[i] != other->path[i])
+        {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static Socket* find_bound_socket(const UnixName* name)
+{
+    uint32_t hash = hash_name(name);
+
+    for (UnixSocket* us = g_buckets[hash % UNIXSOCKET_BUCKET_COUNT]; us != NULL; us = us->hash_next)
+    {
+        if (us->name_hash == hash && is_same_name(&us->name, name))
+        {
+            return us->owner;
+        }
+    }
+
+    return NULL;
+}
+
+static void unbind(UnixSocket* unix_socket)
+{
+    UnixSocket** link = &g_buckets[unix_socket->name_hash % UNIXSOCKET_BUCKET_COUNT];
+
+    while (*link != NULL)
+    {
+        if (*link == unix_socket)
+        {
+            *link = unix_socket->hash_next;
+            break;
+        }
+
+        link = &(*link)->hash_next;
+    }
+
+    unix_socket->hash_next = NULL;
+}
+
+static int get_name(const struct sockaddr *addr, socklen_t addrlen, UnixName* name)
+{
+    if (NULL == addr || addrlen <= sizeof(sa_family_t))
     {
         return -EINVAL;
     }
 
-    list_foreach (n, g_socket_list)
+    if (!check_user_access((void*)addr))
+    {
+        return -EFAULT;
+    }
+
+    uint32_t size = addrlen - sizeof(sa_family_t);
+    uint32_t length = 0;
+
+    if (addr->sa_data[0] == '\0')
     {
-        Socket* s = (Socket*)n->data;
-        UnixSocket* us = (UnixSocket*)s->custom_socket;
+        length = size;
 
-        if (strcmp(addr->sa_data, us->name) == 0)
+        if (length == 1)
+        {
+            return -EINVAL;
+        }
+    }
+    else
+    {
+        while (length < size && addr->sa_data[length] != '\0')
         {
-            return -EADDRINUSE;
+            ++length;
         }
     }
 
-    sprintf(unix_socket->name, SOCKET_NAME_SIZE, addr->sa_data);
+    if (length >= SOCKET_NAME_SIZE)
+    {
+        return -ENAMETOOLONG;
+    }
+
+    memset((uint8_t*)name, 0, sizeof(UnixName));
+    memcpy((uint8_t*)name->path, (const uint8_t*)addr->sa_data, length);
+    name->length = length;
+
+    return 0;
+}
+
+//Room in the receive queue of target, bounded by its SO_RCVBUF and the SO_SNDBUF of socket
+static uint32_t get_send_space(Socket* socket, Socket* target)
+{
+    PageRing* ring = &target->buffer_in;
+
+    uint32_t used = pagering_get_size(ring);
+
+    if (used >= socket->send_buffer_size)
+    {
+        return 0;
+    }
+
+    return MIN(pagering_get_free(ring), socket->send_buffer_size - used);
+}
+
+static uint32_t get_iov_length(const struct msghdr *msg)
+{
+    uint32_t length = 0;
+
+    for (int i = 0; i < msg->msg_iovlen; ++i)
+    {
+        length += msg->msg_iov[i].iov_len;
+    }
+
+    return length;
+}
+
+//Queues up to size bytes gathered from the iovecs of msg. Returns the count, -1 if no page could be taken.
+static int32_t enqueue_iov(PageRing* ring, const struct msghdr *msg, uint32_t size)
+{
+    uint32_t total = 0;
+
+    for (int i = 0; i < msg->msg_iovlen && total < size; ++i)
+    {
+        uint32_t chunk = MIN(msg->msg_iov[i].iov_len, size - total);
+
+        if (chunk == 0)
+        {
+            continue;
+        }
+
+        int32_t queued = pagering_enqueue(ring, (const uint8_t*)msg->msg_iov[i].iov_base, chunk);
+
+        if (queued < 0)
+        {
+            return total > 0 ? (int32_t)total : -1;
+        }
+
+        total += queued;
+
+        if ((uint32_t)queued < chunk)
+        {
+            break;
+        }
+    }
+
+    return total;
+}
+
+//Scatters up to size bytes into the iovecs of msg
+static uint32_t dequeue_iov(PageRing* ring, struct msghdr *msg, uint32_t size)
+{
+    uint32_t total = 0;
+
+    for (int i = 0; i < msg->msg_iovlen && total < size; ++i)
+    {
+        uint32_t chunk = MIN(msg->msg_iov[i].iov_len, size - total);
+
+        total += pagering_dequeue(ring, (uint8_t*)msg->msg_iov[i].iov_base, chunk);
+    }
+
+    return total;
+}
+
+static void close_files(File** files, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        fs_close(files[i]);
+    }
+}
+
+//Opens again, detached, the files of the SCM_RIGHTS descriptors in msg. Returns their count or an error.
+//Only Files whose node does not track its openers may travel, see FileSystemNode::passable.
+static int collect_files(const struct msghdr *msg, File** files)
+{
+    Process* process = g_current_thread->owner;
+
+    if (NULL == msg->msg_control || msg->msg_controllen < sizeof(struct cmsghdr))
+    {
+        return 0;
+    }
+
+    int count = 0;
+    int error = 0;
+
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg); cmsg && error == 0; cmsg = CMSG_NXTHDR(msg, cmsg))
+    {
+        if (cmsg->cmsg_len < CMSG_LEN(0) || cmsg->cmsg_len > (size_t)(__MHDR_END(msg) - (unsigned char*)cmsg))
+        {
+            error = -EINVAL;
+            break;
+        }
+
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        {
+            error = -EINVAL;
+            break;
+        }
+
+        int fd_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int* fds = (int*)CMSG_DATA(cmsg);
+
+        for (int i = 0; i < fd_count; ++i)
+        {
+            if (count == SCM_MAX_FD)
+            {
+                error = -ETOOMANYREFS;
+                break;
+            }
+
+            File* file = process_get_file(process, fds[i]);
+
+            if (NULL == file)
+            {
+                error = -EBADF;
+                break;
+            }
+
+            if (file->node->node_type != FT_FILE && FALSE == file->node->passable)
+            {
+                error = -EOPNOTSUPP;
+                break;
+            }
+
+            File* detached = fs_open_detached(file);
+
+            if (NULL == detached)
+            {
+                error = -EBADF;
+                break;
+            }
+
+            files[count++] = detached;
+        }
+    }
+
+    if (error < 0)
+    {
+        close_files(files, count);
+
+        return error;
+    }
+
+    return count;
+}
+
+//Gives the files of message descriptors in the receiving process and reports them in an SCM_RIGHTS header.
+//The ones that do not fit the control buffer or the descriptor table are closed and MSG_CTRUNC is set.
+static void deliver_files(UnixMessage* message, struct msghdr *msg, uint32_t control_size)
+{
+    struct cmsghdr* cmsg = NULL;
+    uint32_t room = 0;
+
+    if (msg->msg_control && control_size >= CMSG_LEN(sizeof(int)))
+    {
+        cmsg = (struct cmsghdr*)msg->msg_control;
+        room = (control_size - CMSG_LEN(0)) / sizeof(int);
+    }
+
+    uint32_t delivered = 0;
+
+    for (uint32_t i = 0; i < message->file_count; ++i)
+    {
+        File* file = message->files[i];
+        message->files[i] = NULL;
+
+        if (delivered < room)
+        {
+            int32_t fd = fs_attach_to_process(g_current_thread, file);
+
+            if (fd >= 0)
+            {
+                ((int*)CMSG_DATA(cmsg))[delivered++] = fd;
+                continue;
+            }
+        }
+
+        fs_close(file);
+
+        msg->msg_flags |= MSG_CTRUNC;
+    }
+
+    message->file_count = 0;
+
+    if (delivered > 0)
+    {
+        cmsg->cmsg_len = CMSG_LEN(delivered * sizeof(int));
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+
+        msg->msg_controllen = MIN(CMSG_SPACE(delivered * sizeof(int)), control_size);
+    }
+}
+
+static void destroy_message(UnixMessage* message)
+{
+    close_files(message->files, message->file_count);
+
+    kfree(message);
+}
+
+static UnixMessage* append_message(Socket* target, uint32_t position, uint32_t length, File** files, uint32_t file_count)
+{
+    UnixSocket* unix_target = (UnixSocket*)target->custom_socket;
+
+    UnixMessage* message = (UnixMessage*)kmalloc(sizeof(UnixMessage));
+    memset((uint8_t*)message, 0, sizeof(UnixMessage));
+    message->position = position;
+    message->length = length;
+    message->file_count = file_count;
+    memcpy((uint8_t*)message->files, (uint8_t*)files, file_count * sizeof(File*));
+
+    list_append(unix_target->messages, message);
+
+    return message;
+}
+
+static void set_address(struct msghdr *msg, const UnixName* name)
+{
+    if (NULL == msg->msg_name)
+    {
+        return;
+    }
+
+    struct sockaddr* addr = (struct sockaddr*)msg->msg_name;
+
+    BOOL is_path = name->length > 0 && name->path[0] != '\0';
+
+    //The full length, longer than given if the name was cut
+    uint32_t length = sizeof(sa_family_t) + name->length + (is_path ? 1 : 0);
+
+    if (msg->msg_namelen >= sizeof(sa_family_t))
+    {
+        addr->sa_family = AF_UNIX;
+
+        uint32_t room = msg->msg_namelen - sizeof(sa_family_t);
+
+        memcpy((uint8_t*)addr->sa_data, (const uint8_t*)name->path, MIN(room, name->length));
+
+        if (is_path && room > name->length)
+        {
+            addr->sa_data[name->length] = '\0';
+        }
+    }
+
+    msg->msg_namelen = length;
+}
+
+static void wake_receiver(Socket* target)
+{
+    waitqueue_wake_all(&target->readers);
+
+    fs_node_notify(target->node);
+}
+
+//After the receive queue of socket shrank
+static void wake_senders(Socket* socket)
+{
+    waitqueue_wake_all(&socket->writers);
+
+    //Pollers of unconnected datagram senders are not known, they are woken by their own activity only
+    if (socket->connection)
+    {
+        fs_node_notify(socket->connection->node);
+    }
+}
+
+static int unixsocket_bind(Socket* socket, int sockfd, const struct sockaddr *addr, socklen_t addrlen)
+{
+    //printkf("unixsocket_bind\n");
+
+    UnixSocket* unix_socket = (UnixSocket*)socket->custom_socket;
+
+    if (unix_socket->name.length > 0)
+    {
+        return -EINVAL; //The socket is already bound to an address.
+    }
+
+    UnixName name;
+    int error = get_name(addr, addrlen, &name);
+
+    if (error < 0)
+    {
+        return error;
+    }
+
+    if (find_bound_socket(&name))
+    {
+        return -EADDRINUSE;
+    }
+
+    unix_socket->name = name;
+    unix_socket->name_hash = hash_name(&name);
+
+    UnixSocket** bucket = &g_buckets[unix_socket->name_hash % UNIXSOCKET_BUCKET_COUNT];
+    unix_socket->hash_next = *bucket;
+    *bucket = unix_socket;
 
     return 0; //success
 }
 
 static int unixsocket_listen(Socket* socket, int sockfd, int backlog)
 {
-    UnixSocket* unix_socket = (UnixSocket*)socket->custom_socket;
-    
+    if (socket->type == SOCK_DGRAM)
+    {
+        return -EOPNOTSUPP;
+    }
+
+    //As on Linux, a negative or too large backlog means SOMAXCONN
+    socket->backlog = MIN((uint32_t)backlog, SOMAXCONN);
+
     BITMAP_SET(socket->opts, SO_ACCEPTCONN);
 
+    //Waiting connects may fit now
+    waitqueue_wake_all(&socket->acceptors);
+
     return 0;
 }
 
 static int unixsocket_accept(Socket* socket, int sockfd, struct sockaddr *addr, socklen_t *addrlen)
 {
-    UnixSocket* unix_socket = (UnixSocket*)socket->custom_socket;
-    
+    if (socket->type == SOCK_DGRAM)
+    {
+        return -EOPNOTSUPP;
+    }
+
     if (!BITMAP_CHECK(socket->opts, SO_ACCEPTCONN))
     {
         //Socket is not listening for connections
@@ -103,36 +539,35 @@ static int unixsocket_accept(Socket* socket, int sockfd, struct sockaddr *addr,
     {
         disable_interrupts();
 
-        Socket* other_end = NULL;
-
         if (queue_is_empty(socket->accept_queue) == FALSE)
         {
-            other_end = (Socket*)queue_dequeue(socket->accept_queue);
-        }
+            //The connection stays queued if there is no descriptor for it
+            int new_socket_fd = syscall_socket(socket->domain, socket->type, 0);
 
-        if (other_end)
-        {
-            int new_socket_fd = syscall_socket(socket->domain, 1, 0);
-
-            if (new_socket_fd >= 0 && new_socket_fd < SOSO_MAX_OPENED_FILES)
+            if (new_socket_fd < 0 || new_socket_fd >= SOSO_MAX_OPENED_FILES)
             {
-                File* file = g_current_thread->owner->fd[new_socket_fd];
+                return -EMFILE;
+            }
 
-                if (file)
-                {
-                    Socket* new_socket = (Socket*)file->node->private_node_data;
+            Socket* new_socket = (Socket*)process_get_file(g_current_thread->owner, new_socket_fd)->node->private_node_data;
 
-                    new_socket->connection = other_end;
-                    other_end->connection = new_socket;
+            Socket* other_end = (Socket*)queue_dequeue(socket->accept_queue);
+            --socket->accept_queue_length;
 
-                    return new_socket_fd;
-                }
-            }
+            ((UnixSocket*)other_end->custom_socket)->listener = NULL;
+
+            new_socket->connection = other_end;
+            other_end->connection = new_socket;
+
+            //The connecting thread and the ones waiting for room in the backlog
+            waitqueue_wake_all(&socket->acceptors);
+
+            fs_node_notify(other_end->node);
+
+            return new_socket_fd;
         }
 
-        thread_change_state(g_current_thread, TS_WAITIO, unixsocket_accept);
-        enable_interrupts();
-        halt();
+        waitqueue_sleep(&socket->acceptors);
     }
 
     return -1;
@@ -140,9 +575,34 @@ static int unixsocket_accept(Socket* socket, int sockfd, struct sockaddr *addr,
 
 static int unixsocket_connect(Socket* socket, int sockfd, const struct sockaddr *addr, socklen_t addrlen)
 {
-    if (strlen(addr->sa_data) == 0)
+    UnixSocket* unix_socket = (UnixSocket*)socket->custom_socket;
+
+    UnixName name;
+    int error = get_name(addr, addrlen, &name);
+
+    if (error < 0)
     {
-        return -EINVAL;
+        return error;
+    }
+
+    if (socket->type == SOCK_DGRAM)
+    {
+        //Only sets the default destination, there is no connection
+        Socket* target = find_bound_socket(&name);
+
+        if (NULL == target)
+        {
+            return -ECONNREFUSED;
+        }
+
+        if (target->type != SOCK_DGRAM)
+        {
+            return -EPROTOTYPE;
+        }
+
+        unix_socket->peer_name = name;
+
+        return 0;
     }
 
     if (socket->connection != NULL)
@@ -150,117 +610,392 @@ static int unixsocket_connect(Socket* socket, int sockfd, const struct sockaddr
         return -EISCONN; //The socket is already connected.
     }
 
-    Socket* accepting_socket = NULL;
-    list_foreach (n, g_socket_list)
+    while (TRUE)
     {
-        Socket* s = (Socket*)n->data;
-        UnixSocket* us = (UnixSocket*)s->custom_socket;
+        disable_interrupts();
 
-        if (strcmp(addr->sa_data, us->name) == 0)
+        if (socket->connection)
         {
-            accepting_socket = s;
-            break;
+            return 0;
         }
-    }
-
-    if (accepting_socket && BITMAP_CHECK(accepting_socket->opts, SO_ACCEPTCONN))
-    {
-        queue_enqueue(accepting_socket->accept_queue, socket);
 
-        if (accepting_socket->last_thread->state == TS_WAITIO && accepting_socket->last_thread->state_privateData == unixsocket_accept)
+        if (unix_socket->refused)
         {
-            thread_resume(accepting_socket->last_thread);
+            unix_socket->refused = FALSE;
+
+            return -ECONNREFUSED;
         }
 
-        while (socket->connection == NULL)
+        Socket* listener = unix_socket->listener;
+
+        if (NULL == listener)
         {
-            enable_interrupts();
-            halt();
+            //Not queued yet, looked up again after each wait as the listener may have gone
+            listener = find_bound_socket(&name);
+
+            if (NULL == listener || !BITMAP_CHECK(listener->opts, SO_ACCEPTCONN))
+            {
+                return -ECONNREFUSED;
+            }
+
+            if (listener->type != socket->type)
+            {
+                return -EPROTOTYPE;
+            }
+
+            if (listener->accept_queue_length <= listener->backlog)
+            {
+                queue_enqueue(listener->accept_queue, socket);
+                ++listener->accept_queue_length;
+
+                unix_socket->listener = listener;
+
+                waitqueue_wake_all(&listener->acceptors);
+
+                fs_node_notify(listener->node);
+
+                continue;
+            }
         }
-        return 0;
+
+        waitqueue_sleep(&listener->acceptors);
     }
 
     return -1;
 }
 
-static ssize_t unixsocket_send(Socket* socket, int sockfd, const void *buf, size_t len, int flags)
+//Where a message of a datagram or seqpacket socket goes
+static Socket* get_destination(Socket* socket, const struct msghdr *msg, int* error)
 {
-    if (len == 0)
+    if (socket->type == SOCK_SEQPACKET)
+    {
+        if (NULL == socket->connection)
+        {
+            *error = socket->disconnected ? -EPIPE : -ENOTCONN;
+        }
+
+        return socket->connection;
+    }
+
+    UnixSocket* unix_socket = (UnixSocket*)socket->custom_socket;
+
+    UnixName name = unix_socket->peer_name;
+
+    if (msg->msg_name)
+    {
+        int result = get_name((const struct sockaddr*)msg->msg_name, msg->msg_namelen, &name);
+
+        if (result < 0)
+        {
+            *error = result;
+            return NULL;
+        }
+    }
+    else if (name.length == 0)
+    {
+        *error = -ENOTCONN;
+        return NULL;
+    }
+
+    Socket* target = find_bound_socket(&name);
+
+    if (NULL == target)
+    {
+        *error = -ECONNREFUSED;
+        return NULL;
+    }
+
+    if (target->type != SOCK_DGRAM)
     {
-        return -1;
+        *error = -EPROTOTYPE;
+        return NULL;
     }
 
+    return target;
+}
 
+static ssize_t send_stream(Socket* socket, const struct msghdr *msg, uint32_t len, File** files, uint32_t file_count, int flags)
+{
     while (TRUE)
     {
         disable_interrupts();
 
-        if (!socket->connection)
+        Socket* target = socket->connection;
+
+        if (NULL == target)
         {
-            return -1;
+            return socket->disconnected ? -EPIPE : -ENOTCONN;
         }
 
-        uint32_t free = fifobuffer_get_free(socket->connection->buffer_in);
+        uint32_t free = get_send_space(socket, target);
 
         if (free > 0)
         {
-            uint32_t smaller = MIN(free, len);
+            UnixSocket* unix_target = (UnixSocket*)target->custom_socket;
 
-            uint32_t written = fifobuffer_enqueue(socket->connection->buffer_in, (uint8_t*)buf, smaller);
+            uint32_t position = unix_target->queued;
 
-            if (socket->connection->last_thread->state == TS_WAITIO && socket->connection->last_thread->state_privateData == unixsocket_recv)
+            int32_t written = enqueue_iov(&target->buffer_in, msg, MIN(free, len));
+
+            if (written < 0)
             {
-                thread_resume(socket->connection->last_thread);
+                return -ENOBUFS;
             }
 
+            unix_target->queued += written;
+
+            if (file_count > 0)
+            {
+                append_message(target, position, written, files, file_count);
+            }
+
+            wake_receiver(target);
+
             return written;
         }
-        else
+
+        if (flags & MSG_DONTWAIT)
         {
-            thread_change_state(g_current_thread, TS_WAITIO, unixsocket_send);
-            enable_interrupts();
-            halt();
+            return -EAGAIN;
         }
+
+        waitqueue_sleep(&target->writers);
     }
 
     return -1;
 }
 
-static ssize_t unixsocket_recv(Socket* socket, int sockfd, void *buf, size_t len, int flags)
+//Datagram and seqpacket: the message is queued whole or not at all
+static ssize_t send_record(Socket* socket, const struct msghdr *msg, uint32_t len, File** files, uint32_t file_count, int flags)
 {
-    if (len == 0)
-    {
-        return -1;
-    }
+    UnixSocket* unix_socket = (UnixSocket*)socket->custom_socket;
 
     while (TRUE)
     {
         disable_interrupts();
 
-        if (socket->disconnected)
+        int error = 0;
+        Socket* target = get_destination(socket, msg, &error);
+
+        if (NULL == target)
+        {
+            return error;
+        }
+
+        if (len > MIN(pagering_get_capacity(&target->buffer_in), socket->send_buffer_size))
+        {
+            return -EMSGSIZE;
+        }
+
+        if (get_send_space(socket, target) >= len)
+        {
+            int32_t written = enqueue_iov(&target->buffer_in, msg, len);
+
+            if (written < 0)
+            {
+                return -ENOBUFS;
+            }
+
+            //Out of pages midway, the message keeps what could be queued
+            UnixMessage* message = append_message(target, 0, written, files, file_count);
+
+            message->sender = unix_socket->name;
+
+            wake_receiver(target);
+
+            return written;
+        }
+
+        if (flags & MSG_DONTWAIT)
+        {
+            return -EAGAIN;
+        }
+
+        waitqueue_sleep(&target->writers);
+    }
+
+    return -1;
+}
+
+static ssize_t unixsocket_sendmsg(Socket* socket, int sockfd, const struct msghdr *msg, int flags)
+{
+    uint32_t len = get_iov_length(msg);
+
+    if (socket->type == SOCK_STREAM)
+    {
+        if (msg->msg_name)
+        {
+            return socket->connection ? -EISCONN : -EOPNOTSUPP;
+        }
+
+        if (len == 0)
         {
             return 0;
         }
+    }
+
+    File* files[SCM_MAX_FD];
+    int file_count = collect_files(msg, files);
+
+    if (file_count < 0)
+    {
+        return file_count;
+    }
+
+    ssize_t result = 0;
+
+    if (socket->type == SOCK_STREAM)
+    {
+        result = send_stream(socket, msg, len, files, file_count, flags);
+    }
+    else
+    {
+        result = send_record(socket, msg, len, files, file_count, flags);
+    }
+
+    if (result < 0)
+    {
+        close_files(files, file_count);
+    }
+
+    return result;
+}
+
+static ssize_t receive_stream(Socket* socket, struct msghdr *msg, uint32_t control_size)
+{
+    UnixSocket* unix_socket = (UnixSocket*)socket->custom_socket;
+
+    uint32_t size = pagering_get_size(&socket->buffer_in);
+
+    ListNode* node = list_get_first_node(unix_socket->messages);
+
+    if (node)
+    {
+        UnixMessage* message = (UnixMessage*)node->data;
 
-        uint32_t size = fifobuffer_get_size(socket->buffer_in);
+        uint32_t ahead = message->position - unix_socket->received;
 
-        if (size > 0)
+        if (ahead > 0)
+        {
+            //Stop before the bytes that carry descriptors
+            size = MIN(size, ahead);
+        }
+        else
         {
-            uint32_t smaller = MIN(size, len);
+            //Descriptors arrive with the first of their bytes, and no read goes past those bytes
+            deliver_files(message, msg, control_size);
+
+            size = MIN(size, message->length);
+
+            list_remove_first_node(unix_socket->messages);
+
+            destroy_message(message);
+        }
+    }
+
+    uint32_t read = dequeue_iov(&socket->buffer_in, msg, size);
+
+    unix_socket->received += read;
+
+    return read;
+}
+
+static ssize_t receive_record(Socket* socket, struct msghdr *msg, uint32_t control_size, int flags)
+{
+    UnixSocket* unix_socket = (UnixSocket*)socket->custom_socket;
+
+    UnixMessage* message = (UnixMessage*)list_get_first_node(unix_socket->messages)->data;
+
+    list_remove_first_node(unix_socket->messages);
+
+    uint32_t read = dequeue_iov(&socket->buffer_in, msg, message->length);
+
+    if (read < message->length)
+    {
+        //The rest of the message is lost
+        pagering_dequeue(&socket->buffer_in, NULL, message->length - read);
+
+        msg->msg_flags |= MSG_TRUNC;
+    }
+
+    if (socket->type == SOCK_DGRAM)
+    {
+        set_address(msg, &message->sender);
+    }
+
+    deliver_files(message, msg, control_size);
+
+    ssize_t result = (flags & MSG_TRUNC) ? (ssize_t)message->length : (ssize_t)read;
+
+    destroy_message(message);
+
+    return result;
+}
+
+static ssize_t unixsocket_recvmsg(Socket* socket, int sockfd, struct msghdr *msg, int flags)
+{
+    UnixSocket* unix_socket = (UnixSocket*)socket->custom_socket;
+
+    uint32_t control_size = msg->msg_control ? msg->msg_controllen : 0;
+
+    msg->msg_controllen = 0;
+    msg->msg_flags = 0;
+
+    if (socket->type != SOCK_DGRAM)
+    {
+        msg->msg_namelen = 0;
+    }
+
+    if (socket->type == SOCK_STREAM && get_iov_length(msg) == 0)
+    {
+        return 0;
+    }
+
+    while (TRUE)
+    {
+        disable_interrupts();
 
-            uint32_t read = fifobuffer_dequeue(socket->buffer_in, (uint8_t*)buf, smaller);
+        ssize_t result = -1;
+        BOOL received = FALSE;
 
-            if (socket->connection->last_thread->state == TS_WAITIO && socket->connection->last_thread->state_privateData == unixsocket_send)
+        if (socket->type == SOCK_STREAM)
+        {
+            if (pagering_get_size(&socket->buffer_in) > 0)
             {
-                thread_resume(socket->connection->last_thread);
+                result = receive_stream(socket, msg, control_size);
+                received = TRUE;
             }
+        }
+        else if (FALSE == list_is_empty(unix_socket->messages))
+        {
+            result = receive_record(socket, msg, control_size, flags);
+            received = TRUE;
+        }
+
+        if (received)
+        {
+            wake_senders(socket);
+
+            return result;
+        }
+
+        //Queued data is still read after the other end went away
+        if (socket->disconnected)
+        {
+            return 0;
+        }
 
-            return read;
+        if (socket->type != SOCK_DGRAM && NULL == socket->connection)
+        {
+            return -ENOTCONN;
+        }
+
+        if (flags & MSG_DONTWAIT)
+        {
+            return -EAGAIN;
         }
 
-        thread_change_state(g_current_thread, TS_WAITIO, unixsocket_recv);
-        enable_interrupts();
-        halt();
+        waitqueue_sleep(&socket->readers);
     }
 
     return -1;
@@ -272,6 +1007,37 @@ static void unixsocket_closing(Socket* socket)
 
     UnixSocket* unix_socket = (UnixSocket*)socket->custom_socket;
 
+    if (unix_socket->name.length > 0)
+    {
+        unbind(unix_socket);
+    }
+
+    if (unix_socket->listener)
+    {
+        //Closed while waiting to be accepted
+        Socket* listener = unix_socket->listener;
+
+        list_remove_first_occurrence(listener->accept_queue->list, socket);
+        --listener->accept_queue_length;
+    }
+
+    //Connections not accepted yet are refused
+    while (queue_is_empty(socket->accept_queue) == FALSE)
+    {
+        Socket* pending = (Socket*)queue_dequeue(socket->accept_queue);
+        UnixSocket* unix_pending = (UnixSocket*)pending->custom_socket;
+
+        unix_pending->listener = NULL;
+        unix_pending->refused = TRUE;
+    }
+    socket->accept_queue_length = 0;
+
+    list_foreach (n, unix_socket->messages)
+    {
+        destroy_message((UnixMessage*)n->data);
+    }
+    list_destroy(unix_socket->messages);
+
     kfree(unix_socket);
 
     socket->custom_socket = NULL;
@@ -288,7 +1054,14 @@ static BOOL unixsocket_fs_read_test_ready(File *file)
         return TRUE;
     }
 
-    if (fifobuffer_get_size(socket->buffer_in) > 0)
+    if (socket->type == SOCK_STREAM)
+    {
+        if (pagering_get_size(&socket->buffer_in) > 0)
+        {
+            return TRUE;
+        }
+    }
+    else if (FALSE == list_is_empty(unix_socket->messages))
     {
         return TRUE;
     }
@@ -301,16 +1074,61 @@ static BOOL unixsocket_fs_read_test_ready(File *file)
     return FALSE;
 }
 
+static BOOL unixsocket_fs_write_test_ready(File *file)
+{
+    Socket* socket = (Socket*)file->node->private_node_data;
+
+    if (socket->type == SOCK_DGRAM)
+    {
+        UnixSocket* unix_socket = (UnixSocket*)socket->custom_socket;
+
+        //An unconnected one may send anywhere, and a vanished peer fails at once
+        if (unix_socket->peer_name.length == 0)
+        {
+            return TRUE;
+        }
+
+        Socket* target = find_bound_socket(&unix_socket->peer_name);
+
+        return NULL == target || get_send_space(socket, target) > 0;
+    }
+
+    if (socket->connection && get_send_space(socket, socket->connection) > 0)
+    {
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
 static int32_t unixsocket_fs_read(File *file, uint32_t len, uint8_t *buf)
 {
     Socket* socket = (Socket*)file->node->private_node_data;
 
-    return unixsocket_recv(socket, file->fd, buf, len, 0);
+    struct iovec iov;
+    iov.iov_base = buf;
+    iov.iov_len = len;
+
+    struct msghdr msg;
+    memset((uint8_t*)&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    return unixsocket_recvmsg(socket, file->fd, &msg, 0);
 }
 
 static int32_t unixsocket_fs_write(File *file, uint32_t len, uint8_t *buf)
 {
     Socket* socket = (Socket*)file->node->private_node_data;
 
-    return unixsocket_send(socket, file->fd, (const uint8_t *)buf, len, 0);
-}
\ No newline at end of file
+    struct iovec iov;
+    iov.iov_base = buf;
+    iov.iov_len = len;
+
+    struct msghdr msg;
+    memset((uint8_t*)&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    return unixsocket_sendmsg(socket, file->fd, &msg, 0);
+}
@@ -6,14 +6,50 @@
 #include "list.h"
 #include "log.h"
 #include "serial.h"
+#include "pagecache.h"
+
+#define FRAME_BITMAP_WORDS      (RAM_AS_4K_PAGES / 32)
+#define FRAME_SUMMARY_WORDS     (FRAME_BITMAP_WORDS / 32)
+#define FRAME_SUMMARY_TOP_WORDS (FRAME_SUMMARY_WORDS / 32)
+
+#define PAGING_FRAME_CACHE_SIZE 64
 
 uint32_t *g_kernel_page_directory = (uint32_t *)KERN_PAGE_DIRECTORY;
-uint8_t g_physical_page_frame_bitmap[RAM_AS_4K_PAGES / 8];
+
+//A set bit means the page frame is used
+uint32_t g_physical_page_frame_bitmap[FRAME_BITMAP_WORDS];
+
+//A set bit means the corresponding bitmap word has at least one free frame
+static uint32_t g_frame_summary[FRAME_SUMMARY_WORDS];
+
+//A set bit means the corresponding summary word is not zero
+static uint32_t g_frame_summary_top[FRAME_SUMMARY_TOP_WORDS];
 
 static int g_total_page_count = 0;
+static uint32_t g_free_page_count = 0;
+
+//Read faults on demand-zero memory map this page read-only. The first write replaces it with a private frame.
+//It is in the identity mapped kernel image, so its physical address is its virtual address.
+static uint8_t g_zero_page[PAGESIZE_4K] __attribute__((aligned(PAGESIZE_4K)));
+
+//Extra owners of each page frame shared copy-on-write after fork. 0 means a single owner.
+static uint16_t* g_frame_share_counts = NULL;
+
+//Copy-on-write faults copy through this since the new frame is not mapped before the swap
+static uint8_t g_copy_on_write_buffer[PAGESIZE_4K];
+
+//Frames of destroyed page directories. They are initialized again when reused.
+static uint32_t g_free_page_directories[PAGING_FRAME_CACHE_SIZE];
+static uint32_t g_free_page_directory_count = 0;
+
+//Frames of released user page tables. All their entries were cleared before the release, so they are reused without zeroing.
+static uint32_t g_zeroed_page_tables[PAGING_FRAME_CACHE_SIZE];
+static uint32_t g_zeroed_page_table_count = 0;
 
 static void handle_page_fault(Registers *regs);
-static void vmm_sync_all_from_kernel();
+static void frame_word_changed(uint32_t word_index);
+static BOOL cpu_supports_global_pages();
+static VirtualMemoryArea* vma_last_starting_before(Process* process, uint32_t address);
 
 void vmm_initialize(uint32_t high_mem)
 {
@@ -24,29 +60,34 @@ void vmm_initialize(uint32_t high_mem)
 
     g_total_page_count = (high_mem * 1024) / PAGESIZE_4K;
 
-    //Mark all memory space available
-    for (pg = 0; pg < g_total_page_count / 8; ++pg)
+    //Mark physically unexistent memory as used or unavailable
+    for (pg = 0; pg < FRAME_BITMAP_WORDS; ++pg)
     {
-        g_physical_page_frame_bitmap[pg] = 0;
+        g_physical_page_frame_bitmap[pg] = 0xFFFFFFFF;
     }
 
-    //Mark physically unexistent memory as used or unavailable
-    for (pg = g_total_page_count / 8; pg < RAM_AS_4K_PAGES / 8; ++pg)
+    //Mark all existing memory available except the pages reserved for the kernel
+    for (pg = PAGE_INDEX_4K(RESERVED_AREA); pg < g_total_page_count; ++pg)
     {
-        g_physical_page_frame_bitmap[pg] = 0xFF;
+        g_physical_page_frame_bitmap[pg / 32] &= ~(1 << (pg % 32));
     }
 
-    //Mark pages reserved for the kernel as used
-    for (pg = PAGE_INDEX_4K(0x0); pg < (int)(PAGE_INDEX_4K(RESERVED_AREA)); ++pg)
+    g_free_page_count = 0;
+    if (g_total_page_count > (int)PAGE_INDEX_4K(RESERVED_AREA))
     {
-        SET_PAGEFRAME_USED(g_physical_page_frame_bitmap, pg);
+        g_free_page_count = g_total_page_count - PAGE_INDEX_4K(RESERVED_AREA);
+    }
+
+    for (pg = 0; pg < FRAME_BITMAP_WORDS; ++pg)
+    {
+        frame_word_changed(pg);
     }
 
     //Identity map for first 16MB
     //First identity pages are 4MB sized for ease
     for (i = 0; i < 4; ++i)
     {
-        g_kernel_page_directory[i] = (i * PAGESIZE_4M | (PG_PRESENT | PG_WRITE | PG_4MB));//add PG_USER for accesing kernel code in user mode
+        g_kernel_page_directory[i] = (i * PAGESIZE_4M | (PG_PRESENT | PG_WRITE | PG_4MB | PG_GLOBAL));//add PG_USER for accesing kernel code in user mode
     }
 
     for (i = 4; i < 1024; ++i)
@@ -54,11 +95,30 @@ void vmm_initialize(uint32_t high_mem)
         g_kernel_page_directory[i] = 0;
     }
 
+    //All page tables of the kernel space are created now and never freed.
+    //Every page directory copies these entries once, so kernel heap mappings are seen by all of them without syncing.
+    for (i = 4; i < KERNELMEMORY_PAGE_COUNT; ++i)
+    {
+        uint32_t table_physical = vmm_acquire_page_frame_4k();
+
+        //Paging is not enabled yet, so the frame is written through its physical address
+        memset((uint8_t*)table_physical, 0, PAGESIZE_4K);
+
+        g_kernel_page_directory[i] = table_physical | PG_PRESENT | PG_WRITE;
+    }
+
     //Recursive page directory strategy
     g_kernel_page_directory[1023] = (uint32_t)g_kernel_page_directory | PG_PRESENT | PG_WRITE;
 
-    //zero out PD area
-    memset((uint8_t*)KERN_PD_AREA_BEGIN, 0, KERN_PD_AREA_END - KERN_PD_AREA_BEGIN);
+    memset(g_zero_page, 0, PAGESIZE_4K);
+
+    //Kernel space is the same in every page directory, so its TLB entries can survive process switches.
+    //The CPU ignores PG_GLOBAL while PGE is off.
+    uint32_t cr4_flags = PSE_FLAG;
+    if (cpu_supports_global_pages())
+    {
+        cr4_flags |= PGE_FLAG;
+    }
 
     //Enable paging
     asm("	mov %0, %%eax \n \
@@ -68,48 +128,148 @@ void vmm_initialize(uint32_t high_mem)
         mov %%eax, %%cr4 \n \
         mov %%cr0, %%eax \n \
         or %1, %%eax \n \
-        mov %%eax, %%cr0"::"m"(g_kernel_page_directory), "i"(PAGING_FLAG), "i"(PSE_FLAG));
+        mov %%eax, %%cr0"::"m"(g_kernel_page_directory), "i"(PAGING_FLAG | WRITE_PROTECT_FLAG), "m"(cr4_flags));
 
     initialize_kernel_heap();
+
+    g_frame_share_counts = (uint16_t*)kmalloc(g_total_page_count * sizeof(uint16_t));
+    memset((uint8_t*)g_frame_share_counts, 0, g_total_page_count * sizeof(uint16_t));
 }
 
-uint32_t vmm_acquire_page_frame_4k()
+static BOOL cpu_supports_global_pages()
+{
+    uint32_t eax = 1, ebx, ecx, edx;
+    asm volatile("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+
+    return (edx & (1 << 13)) != 0;
+}
+
+//Keeps the summary levels in sync after a change in the frame bitmap word
+static void frame_word_changed(uint32_t word_index)
+{
+    uint32_t summary_index = word_index / 32;
+    uint32_t summary_bit = 1 << (word_index % 32);
+
+    if (g_physical_page_frame_bitmap[word_index] != 0xFFFFFFFF)
+    {
+        g_frame_summary[summary_index] |= summary_bit;
+    }
+    else
+    {
+        g_frame_summary[summary_index] &= ~summary_bit;
+    }
+
+    uint32_t top_index = summary_index / 32;
+    uint32_t top_bit = 1 << (summary_index % 32);
+
+    if (g_frame_summary[summary_index] != 0)
+    {
+        g_frame_summary_top[top_index] |= top_bit;
+    }
+    else
+    {
+        g_frame_summary_top[top_index] &= ~top_bit;
+    }
+}
+
+static BOOL is_frame_used(uint32_t page)
+{
+    return (g_physical_page_frame_bitmap[page / 32] & (1 << (page % 32))) != 0;
+}
+
+static void set_frame_used(uint32_t page)
 {
-    int byte, bit;
-    uint32_t page = -1;
+    g_physical_page_frame_bitmap[page / 32] |= (1 << (page % 32));
+    frame_word_changed(page / 32);
+    --g_free_page_count;
+}
 
-    int pid = -1;
-    Thread* thread = thread_get_current();
-    if (thread)
+//Lowest free page frame index or -1
+static int find_first_free_frame()
+{
+    for (uint32_t top = 0; top < FRAME_SUMMARY_TOP_WORDS; ++top)
     {
-        Process* process = thread->owner;
-        if (process)
+        if (g_frame_summary_top[top] != 0)
         {
-            pid = process->pid;
+            uint32_t summary_index = top * 32 + __builtin_ctz(g_frame_summary_top[top]);
+            uint32_t word_index = summary_index * 32 + __builtin_ctz(g_frame_summary[summary_index]);
+            uint32_t bit = __builtin_ctz(~g_physical_page_frame_bitmap[word_index]);
+
+            return (int)(word_index * 32 + bit);
         }
     }
 
-    for (byte = 0; byte < RAM_AS_4K_PAGES / 8; byte++)
+    return -1;
+}
+
+uint32_t vmm_acquire_page_frame_4k()
+{
+    int page = find_first_free_frame();
+
+    if (page >= 0)
+    {
+        set_frame_used(page);
+
+        //log_printf("DEBUG: Acquired 4K Physical %x\n", page * PAGESIZE_4K);
+        //serial_printf("DEBUG: Acquired 4K Physical %x\n", page * PAGESIZE_4K);
+
+        return (page * PAGESIZE_4K);
+    }
+
+    PANIC("Memory is full!");
+    return (uint32_t)-1;
+}
+
+//Acquires page_count physically contiguous frames. The first frame is aligned to alignment_pages frames.
+//Returns the physical address of the first frame or -1. Unlike the single frame version this does not panic.
+uint32_t vmm_acquire_page_frames_4k(uint32_t page_count, uint32_t alignment_pages)
+{
+    if (page_count == 0)
+    {
+        return (uint32_t)-1;
+    }
+
+    if (alignment_pages == 0)
+    {
+        alignment_pages = 1;
+    }
+
+    int first_free = find_first_free_frame();
+    if (first_free < 0)
+    {
+        return (uint32_t)-1;
+    }
+
+    uint32_t start = ((uint32_t)first_free + alignment_pages - 1) / alignment_pages * alignment_pages;
+
+    while (start + page_count <= (uint32_t)g_total_page_count)
     {
-        if (g_physical_page_frame_bitmap[byte] != 0xFF)
+        uint32_t found = 0;
+        while (found < page_count && !is_frame_used(start + found))
+        {
+            ++found;
+        }
+
+        if (found == page_count)
         {
-            for (bit = 0; bit < 8; bit++)
+            for (uint32_t i = 0; i < page_count; ++i)
             {
-                if (!(g_physical_page_frame_bitmap[byte] & (1 << bit)))
-                {
-                    page = 8 * byte + bit;
-                    SET_PAGEFRAME_USED(g_physical_page_frame_bitmap, page);
+                set_frame_used(start + i);
+            }
 
-                    //log_printf("DEBUG: Acquired 4K Physical %x (pid:%d)\n", page * PAGESIZE_4K, pid);
-                    //serial_printf("DEBUG: Acquired 4K Physical %x (pid:%d)\n", page * PAGESIZE_4K, pid);
+            return start * PAGESIZE_4K;
+        }
 
-                    return (page * PAGESIZE_4K);
-                }
-            }
+        //Skip past the used frame, jumping over completely used bitmap words
+        uint32_t next = start + found + 1;
+        while (next < (uint32_t)g_total_page_count && g_physical_page_frame_bitmap[next / 32] == 0xFFFFFFFF)
+        {
+            next = (next / 32 + 1) * 32;
         }
+
+        start = (next + alignment_pages - 1) / alignment_pages * alignment_pages;
     }
 
-    PANIC("Memory is full!");
     return (uint32_t)-1;
 }
 
@@ -118,39 +278,160 @@ void vmm_release_page_frame_4k(uint32_t p_addr)
     //log_printf("DEBUG: Released 4K Physical %x\n", p_addr);
     //serial_printf("DEBUG: Released 4K Physical %x\n", p_addr);
 
-    SET_PAGEFRAME_UNUSED(g_physical_page_frame_bitmap, p_addr);
+    uint32_t page = PAGE_INDEX_4K(p_addr);
+
+    if (g_frame_share_counts && g_frame_share_counts[page] > 0)
+    {
+        //Still mapped copy-on-write by another process
+        --g_frame_share_counts[page];
+        return;
+    }
+
+    if (is_frame_used(page))
+    {
+        g_physical_page_frame_bitmap[page / 32] &= ~(1 << (page % 32));
+        frame_word_changed(page / 32);
+        ++g_free_page_count;
+    }
 }
 
-uint32_t* vmm_acquire_page_directory()
+//Returns a frame for a user page table. zeroed tells whether it is known to be all zeros already.
+static uint32_t acquire_page_table(BOOL* zeroed)
 {
-    uint32_t address = KERN_PD_AREA_BEGIN;
-    for (; address < KERN_PD_AREA_END; address += PAGESIZE_4K)
+    if (g_zeroed_page_table_count > 0)
     {
-        uint32_t* pd = (uint32_t*)address;
+        *zeroed = TRUE;
 
-        if (*pd == NULL)
-        {
-            //Found an unused page directory
+        return g_zeroed_page_tables[--g_zeroed_page_table_count];
+    }
 
-            //Let's initialize it. First we should sync with first 1GB part with kernel page directory to achive the same view.
+    *zeroed = FALSE;
 
-            for (int i = 0; i < KERNELMEMORY_PAGE_COUNT; ++i)
-            {
-                pd[i] = g_kernel_page_directory[i]& ~PG_OWNED;
-            }
+    return vmm_acquire_page_frame_4k();
+}
 
-            for (int i = KERNELMEMORY_PAGE_COUNT; i < 1024; ++i)
-            {
-                pd[i] = 0;
-            }
+//The caller must have cleared all entries of the table
+static void release_page_table(uint32_t table_physical)
+{
+    if (g_zeroed_page_table_count < PAGING_FRAME_CACHE_SIZE)
+    {
+        g_zeroed_page_tables[g_zeroed_page_table_count++] = table_physical;
+    }
+    else
+    {
+        vmm_release_page_frame_4k(table_physical);
+    }
+}
+
+//Replaces the 4MB page at pd_index with a page table mapping the same frames, for changes of a part of it.
+//Works for active Page Directory! Only for user space.
+static BOOL split_huge_page(int pd_index)
+{
+    uint32_t* pd = (uint32_t*)0xFFFFF000;
+
+    uint32_t* pt = ((uint32_t*)0xFFC00000) + (0x400 * pd_index);
+
+    if (g_zeroed_page_table_count == 0 && vmm_get_free_page_count() == 0)
+    {
+        return FALSE;
+    }
+
+    uint32_t entry = pd[pd_index];
+
+    //Bit 7 is PAT in a page table entry, so PG_4MB must not be carried over
+    uint32_t flags = entry & (PG_PRESENT | PG_WRITE | PG_USER | PG_DIRTY | PG_OWNED | PG_COW);
+
+    uint32_t base = entry & 0xFFC00000;
+
+    BOOL zeroed = FALSE;
+    uint32_t table_physical = acquire_page_table(&zeroed);
+
+    pd[pd_index] = table_physical | PG_PRESENT | PG_WRITE | PG_USER | PG_OWNED;
+
+    INVALIDATE(pt);
+
+    for (int i = 0; i < 1024; ++i)
+    {
+        pt[i] = (base + i * PAGESIZE_4K) | flags;
+    }
+
+    //Any address inside drops the 4MB translation
+    INVALIDATE(pd_index << 22);
 
-            pd[1023] = address | PG_PRESENT | PG_WRITE;
+    return TRUE;
+}
+
+//Unmaps the 4MB page at pd_index and releases its frames if they are owned.
+//Works for active Page Directory! Only for user space.
+static void remove_huge_page(int pd_index)
+{
+    uint32_t* pd = (uint32_t*)0xFFFFF000;
+
+    uint32_t* pt = ((uint32_t*)0xFFC00000) + (0x400 * pd_index);
+
+    uint32_t entry = pd[pd_index];
 
-            return pd;
+    pd[pd_index] = 0;
+
+    INVALIDATE(pd_index << 22);
+    INVALIDATE(pt);
+
+    if ((entry & PG_OWNED) == PG_OWNED)
+    {
+        uint32_t base = entry & 0xFFC00000;
+
+        for (int i = 0; i < 1024; ++i)
+        {
+            vmm_release_page_frame_4k(base + i * PAGESIZE_4K);
         }
     }
+}
 
-    return NULL;
+//Returns the physical address of a new page directory, which is what CR3 is loaded with.
+//It is not mapped anywhere, so it is written through the active one after CHANGE_PD.
+uint32_t* vmm_acquire_page_directory()
+{
+    uint32_t address = 0;
+
+    if (g_free_page_directory_count > 0)
+    {
+        address = g_free_page_directories[--g_free_page_directory_count];
+    }
+    else
+    {
+        address = vmm_acquire_page_frame_4k();
+    }
+
+    begin_critical_section();
+
+    //Map it to the window to initialize it. The window's table is a shared kernel one, so the current page directory does.
+    uint32_t* window_pte = ((uint32_t*)0xFFC00000) + PAGE_INDEX_4K(KERN_WINDOW);
+    *window_pte = address | PG_PRESENT | PG_WRITE;
+    INVALIDATE(KERN_WINDOW);
+
+    uint32_t* pd = (uint32_t*)KERN_WINDOW;
+
+    //Let's initialize it. First we should sync with first 1GB part with kernel page directory to achive the same view.
+    //The kernel page tables are shared and preallocated, so this copy never goes stale.
+
+    for (int i = 0; i < KERNELMEMORY_PAGE_COUNT; ++i)
+    {
+        pd[i] = g_kernel_page_directory[i]& ~PG_OWNED;
+    }
+
+    for (int i = KERNELMEMORY_PAGE_COUNT; i < 1024; ++i)
+    {
+        pd[i] = 0;
+    }
+
+    pd[1023] = address | PG_PRESENT | PG_WRITE;
+
+    *window_pte = 0;
+    INVALIDATE(KERN_WINDOW);
+
+    end_critical_section();
+
+    return (uint32_t*)address;
 }
 
 void vmm_destroy_page_directory_with_memory(uint32_t physical_pd)
@@ -167,7 +448,11 @@ void vmm_destroy_page_directory_with_memory(uint32_t physical_pd)
     //we must not touch pd[1023] since PD is mapped to itself. Otherwise we corrupt the whole system's memory.
     for (int pd_index = KERNELMEMORY_PAGE_COUNT; pd_index < 1023; ++pd_index)
     {
-        if ((pd[pd_index] & PG_PRESENT) == PG_PRESENT)
+        if ((pd[pd_index] & (PG_PRESENT | PG_4MB)) == (PG_PRESENT | PG_4MB))
+        {
+            remove_huge_page(pd_index);
+        }
+        else if ((pd[pd_index] & PG_PRESENT) == PG_PRESENT)
         {
             uint32_t* pt = ((uint32_t*)0xFFC00000) + (0x400 * pd_index);
 
@@ -188,22 +473,38 @@ void vmm_destroy_page_directory_with_memory(uint32_t physical_pd)
             if ((pd[pd_index] & PG_OWNED) == PG_OWNED)
             {
                 uint32_t physicalFramePT = pd[pd_index] & ~0xFFF;
-                vmm_release_page_frame_4k(physicalFramePT);
+                release_page_table(physicalFramePT);
             }
         }
 
         pd[pd_index] = 0;
     }
 
-    end_critical_section();
+    //A process destroying itself must not stay on a page directory that is about to be reused
+    if (cr3 == physical_pd)
+    {
+        cr3 = (uint32_t)g_kernel_page_directory;
+    }
+
     //return to caller's Page Directory
     CHANGE_PD(cr3);
+
+    if (g_free_page_directory_count < PAGING_FRAME_CACHE_SIZE)
+    {
+        g_free_page_directories[g_free_page_directory_count++] = physical_pd;
+    }
+    else
+    {
+        vmm_release_page_frame_4k(physical_pd);
+    }
+
+    end_critical_section();
 }
 
 //When calling this function:
 //If it is intended to alloc kernel memory, v_addr must be < KERN_HEAP_END.
 //If it is intended to alloc user memory, v_addr must be > KERN_HEAP_END.
-//Works for active Page Directory!
+//Works for active Page Directory! Kernel page tables are shared by all page directories, so any one will do for kernel memory.
 BOOL vmm_add_page_to_pd(char *v_addr, uint32_t p_addr, int flags)
 {
     // Both addresses are page-aligned.
@@ -217,34 +518,38 @@ BOOL vmm_add_page_to_pd(char *v_addr, uint32_t p_addr, int flags)
 
     uint32_t* pt = ((uint32_t*)0xFFC00000) + (0x400 * pd_index);
 
-    uint32_t cr3 = 0;
-
-    if (v_addr < (char*)(KERN_HEAP_END))
+    if ((pd[pd_index] & (PG_PRESENT | PG_4MB)) == (PG_PRESENT | PG_4MB))
     {
-        cr3 = read_cr3();
-
-        CHANGE_PD(g_kernel_page_directory);
+        //Kernel huge pages are never split, see vmm_add_huge_page_to_pd
+        if (v_addr < (char*)(KERN_HEAP_END) || FALSE == split_huge_page(pd_index))
+        {
+            return FALSE;
+        }
     }
 
     //serial_printf("vmm_add_page_to_pd 1");
     if ((pd[pd_index] & PG_PRESENT) != PG_PRESENT)
     {
         //serial_printf("vmm_add_page_to_pd 2");
-        uint32_t tablePhysical = vmm_acquire_page_frame_4k();
+        BOOL zeroed = FALSE;
+        uint32_t tablePhysical = acquire_page_table(&zeroed);
 
         //serial_printf("vmm_add_page_to_pd 3");
         pd[pd_index] = (tablePhysical) | (flags & 0xFFF) | (PG_PRESENT | PG_WRITE);
 
         //serial_printf("vmm_add_page_to_pd 4");
 
-        INVALIDATE(v_addr);
+        INVALIDATE(pt);
 
         //serial_printf("vmm_add_page_to_pd 5");
 
         //Zero out table as it may contain thrash data from previously allocated page frame
-        for (int i = 0; i < 1024; ++i)
+        if (FALSE == zeroed)
         {
-            pt[i] = 0;
+            for (int i = 0; i < 1024; ++i)
+            {
+                pt[i] = 0;
+            }
         }
     }
 
@@ -252,15 +557,15 @@ BOOL vmm_add_page_to_pd(char *v_addr, uint32_t p_addr, int flags)
     {
         //serial_printf("vmm_add_page_to_pd 6");
 
-        if (0 != cr3)
-        {
-            //restore
-            CHANGE_PD(cr3);
-        }
-
         return FALSE;
     }
 
+    //Only page table entries are global. A global bit in a page directory entry would make it global when read through the recursive mapping.
+    if (v_addr < (char*)(KERN_HEAP_END))
+    {
+        flags |= PG_GLOBAL;
+    }
+
     pt[pt_index] = (p_addr) | (flags & 0xFFF) | (PG_PRESENT | PG_WRITE);
 
     //serial_printf("vmm_add_page_to_pd 7");
@@ -269,18 +574,54 @@ BOOL vmm_add_page_to_pd(char *v_addr, uint32_t p_addr, int flags)
 
     //serial_printf("vmm_add_page_to_pd 8");
 
-    if (0 != cr3)
+    return TRUE;
+}
+
+//Maps a 4MB page. Both addresses must be 4MB aligned and nothing may be mapped in its range yet.
+//Page directories copy kernel space entries once, so kernel huge pages can only be added at boot, before any process exists.
+//Works for active Page Directory!
+BOOL vmm_add_huge_page_to_pd(char *v_addr, uint32_t p_addr, int flags)
+{
+    if ((((uint32_t)v_addr) & (PAGESIZE_4M - 1)) != 0 || (p_addr & (PAGESIZE_4M - 1)) != 0)
     {
-        //restore
-        CHANGE_PD(cr3);
+        return FALSE;
     }
 
+    int pd_index = (((uint32_t) v_addr) >> 22);
+
+    uint32_t* pd = (uint32_t*)0xFFFFF000;
+
+    uint32_t* pt = ((uint32_t*)0xFFC00000) + (0x400 * pd_index);
+
     if (v_addr < (char*)(KERN_HEAP_END))
     {
-        //If this is the kernel page directory, sync others for first 1GB
+        //The preallocated table is given back. It must be unused.
+        for (int i = 0; i < 1024; ++i)
+        {
+            if (pt[i] != 0)
+            {
+                return FALSE;
+            }
+        }
+
+        uint32_t table_physical = pd[pd_index] & 0xFFFFF000;
+
+        pd[pd_index] = 0;
+
+        INVALIDATE(pt);
+
+        vmm_release_page_frame_4k(table_physical);
 
-        vmm_sync_all_from_kernel();
+        flags |= PG_GLOBAL;
     }
+    else if ((pd[pd_index] & PG_PRESENT) == PG_PRESENT)
+    {
+        return FALSE;
+    }
+
+    pd[pd_index] = p_addr | (flags & 0xFFF) | (PG_PRESENT | PG_WRITE | PG_4MB);
+
+    INVALIDATE(v_addr);
 
     return TRUE;
 }
@@ -293,16 +634,14 @@ BOOL vmm_remove_page_from_pd(char *v_addr)
 
     uint32_t* pd = (uint32_t*)0xFFFFF000;
 
-    uint32_t cr3 = 0;
-
-    if (v_addr < (char*)(KERN_HEAP_END))
+    if ((pd[pd_index] & (PG_PRESENT | PG_4MB)) == (PG_PRESENT | PG_4MB))
     {
-        cr3 = read_cr3();
-
-        CHANGE_PD(g_kernel_page_directory);
+        if (v_addr < (char*)(KERN_HEAP_END) || FALSE == split_huge_page(pd_index))
+        {
+            return FALSE;
+        }
     }
 
-
     if ((pd[pd_index] & PG_PRESENT) == PG_PRESENT)
     {
         uint32_t* pt = ((uint32_t*)0xFFC00000) + (0x400 * pd_index);
@@ -329,7 +668,7 @@ BOOL vmm_remove_page_from_pd(char *v_addr)
         if (all_unmapped)
         {
             //All page table entries are unmapped.
-            //Lets destroy this page table and remove it from PD
+            //Lets destroy this page table and remove it from PD. Kernel page tables are not owned, they stay.
 
             uint32_t physical_frame_pt = pd[pd_index] & ~0xFFF;
 
@@ -337,7 +676,9 @@ BOOL vmm_remove_page_from_pd(char *v_addr)
             {
                 pd[pd_index] = 0;
 
-                vmm_release_page_frame_4k(physical_frame_pt);
+                INVALIDATE(pt);
+
+                release_page_table(physical_frame_pt);
             }
         }
 
@@ -345,72 +686,25 @@ BOOL vmm_remove_page_from_pd(char *v_addr)
 
         INVALIDATE(v_addr);
 
-        if (0 != cr3)
-        {
-            //restore
-            CHANGE_PD(cr3);
-        }
-
-        if (v_addr < (char*)(KERN_HEAP_END))
-        {
-            //If this is the kernel page directory, sync others for first 1GB
-            
-            vmm_sync_all_from_kernel();
-        }
-
         return TRUE;
     }
 
-    if (0 != cr3)
-    {
-        //restore
-        CHANGE_PD(cr3);
-    }
-
     return FALSE;
 }
 
-static void vmm_sync_all_from_kernel()
+uint32_t vmm_get_total_page_count()
 {
-    uint32_t address = KERN_PD_AREA_BEGIN;
-    for (; address < KERN_PD_AREA_END; address += PAGESIZE_4K)
-    {
-        uint32_t* pd = (uint32_t*)address;
+    return g_total_page_count;
+}
 
-        if (*pd != NULL)
-        {
-            //Found an in-use page directory
-
-            for (int i = 0; i < KERNELMEMORY_PAGE_COUNT; ++i)
-            {
-                pd[i] = g_kernel_page_directory[i] & ~PG_OWNED;
-            }
-        }
-    }
-}
-
-uint32_t vmm_get_total_page_count()
-{
-    return g_total_page_count;
-}
-
-uint32_t vmm_get_used_page_count()
-{
-    int count = 0;
-    for (int i = 0; i < g_total_page_count; ++i)
-    {
-        if(IS_PAGEFRAME_USED(g_physical_page_frame_bitmap, i))
-        {
-            ++count;
-        }
-    }
-
-    return count;
-}
+uint32_t vmm_get_used_page_count()
+{
+    return g_total_page_count - g_free_page_count;
+}
 
 uint32_t vmm_get_free_page_count()
 {
-    return g_total_page_count - vmm_get_used_page_count();
+    return g_free_page_count;
 }
 
 static void print_page_fault_info(uint32_t faulting_address, Registers *regs)
@@ -438,6 +732,288 @@ static void print_page_fault_info(uint32_t faulting_address, Registers *regs)
     log_printf("CPU was in %s\n", us ? "user-mode" : "supervisor mode");
 }
 
+//Works for active Page Directory! Only for user space addresses.
+static uint32_t* get_user_page_table_entry(uint32_t v_addr, BOOL create)
+{
+    int pd_index = v_addr >> 22;
+    int pt_index = (v_addr >> 12) & 0x03FF;
+
+    uint32_t* pd = (uint32_t*)0xFFFFF000;
+
+    uint32_t* pt = ((uint32_t*)0xFFC00000) + (0x400 * pd_index);
+
+    //The caller works on a single page
+    if ((pd[pd_index] & (PG_PRESENT | PG_4MB)) == (PG_PRESENT | PG_4MB) && FALSE == split_huge_page(pd_index))
+    {
+        return NULL;
+    }
+
+    if ((pd[pd_index] & PG_PRESENT) != PG_PRESENT)
+    {
+        if (FALSE == create || vmm_get_free_page_count() == 0)
+        {
+            return NULL;
+        }
+
+        BOOL zeroed = FALSE;
+        uint32_t table_physical = acquire_page_table(&zeroed);
+
+        pd[pd_index] = table_physical | PG_PRESENT | PG_WRITE | PG_USER | PG_OWNED;
+
+        INVALIDATE(pt);
+
+        if (FALSE == zeroed)
+        {
+            memset((uint8_t*)pt, 0, PAGESIZE_4K);
+        }
+    }
+
+    return &pt[pt_index];
+}
+
+static BOOL map_zeroed_frame(uint32_t v_addr, uint32_t* pte)
+{
+    if (vmm_get_free_page_count() == 0)
+    {
+        return FALSE;
+    }
+
+    uint32_t frame = vmm_acquire_page_frame_4k();
+
+    *pte = frame | PG_PRESENT | PG_WRITE | PG_USER | PG_OWNED;
+
+    INVALIDATE(v_addr);
+
+    memset((uint8_t*)v_addr, 0, PAGESIZE_4K);
+
+    return TRUE;
+}
+
+//Gives the faulting process its own copy of a page shared after fork. Returns FALSE if the fault is not about that.
+static BOOL handle_copy_on_write_fault(uint32_t faulting_address, uint32_t error_code)
+{
+    //Only a write to a present page
+    if ((error_code & 0x3) != 0x3)
+    {
+        return FALSE;
+    }
+
+    if (faulting_address < USER_OFFSET || faulting_address >= MEMORY_END)
+    {
+        return FALSE;
+    }
+
+    uint32_t page = faulting_address & 0xFFFFF000;
+
+    uint32_t* pte = get_user_page_table_entry(page, FALSE);
+
+    if (NULL == pte || (*pte & (PG_PRESENT | PG_COW)) != (PG_PRESENT | PG_COW))
+    {
+        return FALSE;
+    }
+
+    uint32_t frame = *pte & 0xFFFFF000;
+    uint32_t flags = (*pte & 0xFFF & ~PG_COW) | PG_WRITE;
+
+    if (g_frame_share_counts[PAGE_INDEX_4K(frame)] == 0)
+    {
+        //The other sharers are gone, so the frame is ours alone
+        *pte = frame | flags;
+
+        INVALIDATE(page);
+
+        return TRUE;
+    }
+
+    if (vmm_get_free_page_count() == 0)
+    {
+        return FALSE;
+    }
+
+    memcpy(g_copy_on_write_buffer, (uint8_t*)page, PAGESIZE_4K);
+
+    --g_frame_share_counts[PAGE_INDEX_4K(frame)];
+
+    *pte = vmm_acquire_page_frame_4k() | flags;
+
+    INVALIDATE(page);
+
+    memcpy((uint8_t*)page, g_copy_on_write_buffer, PAGESIZE_4K);
+
+    return TRUE;
+}
+
+//Read-only pages fully inside the file map the cached page itself, so all instances of a program share them.
+//Other pages get a private copy.
+static BOOL map_file_page(VirtualMemoryArea* vma, uint32_t page, uint32_t* pte, BOOL write)
+{
+    BOOL writable = (vma->flags & VMA_WRITE) == VMA_WRITE;
+
+    if (write && FALSE == writable)
+    {
+        return FALSE;
+    }
+
+    uint32_t area_offset = page - vma->start;
+
+    uint32_t page_index = (vma->file_offset + area_offset) / PAGESIZE_4K;
+
+    if (vma->cache->file && page_index < vma->cache->page_count && NULL == vma->cache->pages[page_index] &&
+            thread_get_current()->held_mutex_count > 0)
+    {
+        //Reading the page would enter a file system that may be the one holding the lock.
+        //File systems copy to user memory only without their locks, so this is a kernel bug.
+        log_printf("page fault at %x needs file I/O while a lock is held, refused\n", page);
+
+        return FALSE;
+    }
+
+    uint8_t* cached = pagecache_get_page(vma->cache, page_index);
+
+    if (NULL == cached)
+    {
+        return FALSE;
+    }
+
+    if ((vma->flags & VMA_SHARED) == VMA_SHARED)
+    {
+        *pte = vmm_get_physical_address((uint32_t)cached) | PG_PRESENT | PG_USER | (writable ? PG_WRITE : 0);
+
+        INVALIDATE(page);
+
+        return TRUE;
+    }
+
+    uint32_t size = MIN(PAGESIZE_4K, vma->file_size - area_offset);
+
+    if (FALSE == writable && size == PAGESIZE_4K)
+    {
+        *pte = vmm_get_physical_address((uint32_t)cached) | PG_PRESENT | PG_USER;
+
+        INVALIDATE(page);
+
+        return TRUE;
+    }
+
+    if (FALSE == map_zeroed_frame(page, pte))
+    {
+        return FALSE;
+    }
+
+    memcpy((uint8_t*)page, cached, size);
+
+    if (FALSE == writable)
+    {
+        *pte &= ~PG_WRITE;
+
+        INVALIDATE(page);
+    }
+
+    return TRUE;
+}
+
+//Large anonymous areas get a 4MB page on the first touch of an aligned 4MB of them that has nothing mapped yet.
+//Returns FALSE to fall back to a 4K page.
+static BOOL map_zeroed_huge_page(VirtualMemoryArea* vma, uint32_t page)
+{
+    uint32_t base = page & 0xFFC00000;
+
+    if (vma->flags != VMA_ANONYMOUS || base < vma->start || base + PAGESIZE_4M > vma->end)
+    {
+        return FALSE;
+    }
+
+    uint32_t* pd = (uint32_t*)0xFFFFF000;
+
+    if ((pd[base >> 22] & PG_PRESENT) == PG_PRESENT)
+    {
+        return FALSE;
+    }
+
+    uint32_t frames = vmm_acquire_page_frames_4k(1024, 1024);
+
+    if (frames == (uint32_t)-1)
+    {
+        return FALSE;
+    }
+
+    vmm_add_huge_page_to_pd((char*)base, frames, PG_USER | PG_OWNED);
+
+    memset((uint8_t*)base, 0, PAGESIZE_4M);
+
+    return TRUE;
+}
+
+//Backs reserved pages on first touch. Returns FALSE if the fault is a real error.
+static BOOL handle_demand_fault(Process* process, uint32_t faulting_address, uint32_t error_code)
+{
+    if (faulting_address < USER_OFFSET || faulting_address >= MEMORY_END)
+    {
+        return FALSE;
+    }
+
+    VirtualMemoryArea* vma = vmm_vma_find(process, faulting_address);
+
+    //Mapped areas are backed from the start
+    if (NULL == vma || (vma->flags & VMA_MAPPED) == VMA_MAPPED)
+    {
+        return FALSE;
+    }
+
+    BOOL present = (error_code & 0x1) != 0;
+    BOOL write = (error_code & 0x2) != 0;
+
+    uint32_t page = faulting_address & 0xFFFFF000;
+
+    if (FALSE == present && map_zeroed_huge_page(vma, page))
+    {
+        return TRUE;
+    }
+
+    uint32_t* pte = get_user_page_table_entry(page, TRUE);
+
+    if (NULL == pte)
+    {
+        return FALSE;
+    }
+
+    if (vma->cache && page - vma->start < vma->file_size)
+    {
+        //Pages from the file are either mapped by now or this is a real protection fault
+        if (present)
+        {
+            return FALSE;
+        }
+
+        return map_file_page(vma, page, pte, write);
+    }
+
+    if (write && (vma->flags & (VMA_FILE | VMA_WRITE)) == VMA_FILE)
+    {
+        //Zero tail of a read-only file area
+        return FALSE;
+    }
+
+    if (present)
+    {
+        //The only protection fault expected here is the first write to the zero page
+        if (FALSE == write || (*pte & 0xFFFFF000) != (uint32_t)g_zero_page)
+        {
+            return FALSE;
+        }
+    }
+    else if (FALSE == write)
+    {
+        *pte = (uint32_t)g_zero_page | PG_PRESENT | PG_USER;
+
+        INVALIDATE(page);
+
+        return TRUE;
+    }
+
+    return map_zeroed_frame(page, pte);
+}
+
 static void handle_page_fault(Registers *regs)
 {
     // A page fault has occurred.
@@ -450,6 +1026,20 @@ static void handle_page_fault(Registers *regs)
     //log_printf("stack of handler is %x\n", &faulting_address);
 
     Thread* faulting_thread = thread_get_current();
+
+    if (NULL != faulting_thread && NULL != faulting_thread->owner)
+    {
+        if (handle_copy_on_write_fault(faulting_address, regs->errorCode))
+        {
+            return;
+        }
+
+        if (handle_demand_fault(faulting_thread->owner, faulting_address, regs->errorCode))
+        {
+            return;
+        }
+    }
+
     if (NULL != faulting_thread)
     {
         Thread* main_thread = thread_get_first();
@@ -508,84 +1098,170 @@ static void handle_page_fault(Registers *regs)
     }
 }
 
-void vmm_initialize_process_pages(Process* process)
+static uint32_t align_up(uint32_t value, uint32_t alignment)
 {
-    int page = 0;
+    return (value + alignment - 1) / alignment * alignment;
+}
 
-    for (page = 0; page < RAM_AS_4K_PAGES / 8; ++page)
+//Lowest address of size free bytes at or after lower in the gaps before the areas of the subtree, or 0.
+//Subtrees whose largest gap is too small are skipped, so this is logarithmic unless alignment wastes space.
+static uint32_t find_gap(VirtualMemoryArea* node, uint32_t lower, uint32_t size, uint32_t alignment)
+{
+    if (NULL == node || node->subtree_gap < size)
     {
-        process->mmapped_virtual_memory[page] = 0xFF;
+        return 0;
     }
 
-    for (page = PAGE_INDEX_4K(USER_OFFSET); page < (int)(PAGE_INDEX_4K(MEMORY_END)); ++page)
+    //The gaps of the left subtree and of node all end at or before node->start
+    if (node->start > lower)
     {
-        SET_PAGEFRAME_UNUSED(process->mmapped_virtual_memory, page * PAGESIZE_4K);
+        uint32_t address = find_gap(node->left, lower, size, alignment);
+
+        if (address)
+        {
+            return address;
+        }
+
+        address = align_up(MAX(node->start - node->gap, lower), alignment);
+
+        if (address < node->start && node->start - address >= size)
+        {
+            return address;
+        }
     }
 
-    //Page Tables position marked as used. It is after MEMORY_END.
+    return find_gap(node->right, lower, size, alignment);
 }
 
-//if this fails (return NULL), the caller should clean up physical page frames
-void* vmm_map_memory(Process* process, uint32_t v_address_search_start, uint32_t* p_address_array, uint32_t page_count, BOOL own)
+//Returns the first address of page_count free adjacent virtual pages, starting at a multiple of alignment_pages, or 0
+static uint32_t find_free_virtual_range(Process* process, uint32_t v_address_search_start, uint32_t page_count, uint32_t alignment_pages)
 {
-    int page_index = 0;
-
-    if (NULL == p_address_array || page_count == 0)
+    if (page_count == 0 || page_count > PAGE_INDEX_4K(MEMORY_END - USER_OFFSET))
     {
-        return NULL;
+        return 0;
     }
 
-    uint32_t found_adjacent = 0;
+    uint32_t size = page_count * PAGESIZE_4K;
+    uint32_t alignment = alignment_pages * PAGESIZE_4K;
 
-    uint32_t v_mem = 0;
+    //The program break area below brk_next_unallocated_page_begin has no area of its own
+    uint32_t lower = MAX(v_address_search_start & 0xFFFFF000, (uint32_t)process->brk_next_unallocated_page_begin);
+    lower = MAX(lower, USER_OFFSET);
+
+    uint32_t address = find_gap(process->vma_tree, lower, size, alignment);
 
-    for (page_index = PAGE_INDEX_4K(v_address_search_start); page_index < (int)(PAGE_INDEX_4K(MEMORY_END)); ++page_index)
+    if (0 == address)
     {
-        if (IS_PAGEFRAME_USED(process->mmapped_virtual_memory, page_index))
-        {
-            found_adjacent = 0;
-            v_mem = 0;
-        }
-        else
+        //After the last area
+        uint32_t tail = lower;
+
+        VirtualMemoryArea* last = vma_last_starting_before(process, 0xFFFFFFFF);
+        for (VirtualMemoryArea* vma = last; vma && vma->start == last->start; vma = vma->prev)
         {
-            if (0 == found_adjacent)
-            {
-                v_mem = page_index * PAGESIZE_4K;
-            }
-            ++found_adjacent;
+            tail = MAX(tail, vma->end);
         }
 
-        if (found_adjacent == page_count)
+        tail = align_up(tail, alignment);
+
+        if (tail < MEMORY_END && MEMORY_END - tail >= size)
         {
-            break;
+            address = tail;
         }
     }
 
-    //log_printf("vmm_map_memory: needed:%d foundAdjacent:%d v_mem:%x\n", neededPages, foundAdjacent, v_mem);
+    return address;
+}
+
+//Areas of at least 4MB are searched 4MB aligned first, so they can be mapped with 4MB pages
+static uint32_t find_free_virtual_range_for_huge_pages(Process* process, uint32_t v_address_search_start, uint32_t page_count)
+{
+    uint32_t v_mem = 0;
 
-    if (found_adjacent == page_count)
+    if (page_count >= 1024)
     {
-        int own_flag = 0;
-        if (own)
-        {
-            own_flag = PG_OWNED;
-        }
+        v_mem = find_free_virtual_range(process, v_address_search_start, page_count, 1024);
+    }
 
-        uint32_t v = v_mem;
-        for (uint32_t i = 0; i < page_count; ++i)
-        {
-            uint32_t p = p_address_array[i];
-            p = p & 0xFFFFF000;
+    if (0 == v_mem)
+    {
+        v_mem = find_free_virtual_range(process, v_address_search_start, page_count, 1);
+    }
 
-            vmm_add_page_to_pd((char*)v, p, PG_USER | own_flag);
+    return v_mem;
+}
 
-            //log_printf("MMAPPED: %s(%d) virtual:%x -> physical:%x owned:%d\n", process->name, process->pid, v, p, own);
+//Whether the next 1024 pages of the array are one 4MB aligned physical run
+static BOOL is_huge_page_run(uint32_t* p_address_array)
+{
+    uint32_t first = p_address_array[0] & 0xFFFFF000;
 
-            SET_PAGEFRAME_USED(process->mmapped_virtual_memory, PAGE_INDEX_4K(v));
+    if ((first & (PAGESIZE_4M - 1)) != 0)
+    {
+        return FALSE;
+    }
+
+    for (uint32_t i = 1; i < 1024; ++i)
+    {
+        if ((p_address_array[i] & 0xFFFFF000) != first + i * PAGESIZE_4K)
+        {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+//if this fails (return NULL), the caller should clean up physical page frames
+//Aligned 4MB physical runs in p_address_array are mapped with 4MB pages.
+void* vmm_map_memory(Process* process, uint32_t v_address_search_start, uint32_t* p_address_array, uint32_t page_count, BOOL own)
+{
+    if (NULL == p_address_array || page_count == 0)
+    {
+        return NULL;
+    }
+
+    uint32_t v_mem = 0;
+
+    if ((p_address_array[0] & (PAGESIZE_4M - 1)) == 0)
+    {
+        v_mem = find_free_virtual_range_for_huge_pages(process, v_address_search_start, page_count);
+    }
+    else
+    {
+        v_mem = find_free_virtual_range(process, v_address_search_start, page_count, 1);
+    }
+
+    if (0 != v_mem)
+    {
+        int own_flag = 0;
+        if (own)
+        {
+            own_flag = PG_OWNED;
+        }
+
+        uint32_t v = v_mem;
+        for (uint32_t i = 0; i < page_count; ++i)
+        {
+            uint32_t p = p_address_array[i];
+            p = p & 0xFFFFF000;
+
+            if ((v & (PAGESIZE_4M - 1)) == 0 && page_count - i >= 1024 && is_huge_page_run(p_address_array + i) &&
+                vmm_add_huge_page_to_pd((char*)v, p, PG_USER | own_flag))
+            {
+                v += PAGESIZE_4M;
+                i += 1023;
+                continue;
+            }
+
+            vmm_add_page_to_pd((char*)v, p, PG_USER | own_flag);
+
+            //log_printf("MMAPPED: %s(%d) virtual:%x -> physical:%x owned:%d\n", process->name, process->pid, v, p, own);
 
             v += PAGESIZE_4K;
         }
 
+        vmm_vma_add(process, v_mem, v_mem + page_count * PAGESIZE_4K, VMA_MAPPED);
+
         return (void*)v_mem;
     }
 
@@ -599,35 +1275,843 @@ BOOL vmm_unmap_memory(Process* process, uint32_t v_address, uint32_t page_count)
         return FALSE;
     }
 
-    uint32_t page_index = 0;
-
-    uint32_t needed_pages = page_count;
-
-    uint32_t old = v_address;
     v_address &= 0xFFFFF000;
 
     //log_printf("pageFrame dealloc from munmap:%x aligned:%x\n", old, v_address);
 
     uint32_t start_index = PAGE_INDEX_4K(v_address);
-    uint32_t end_index = start_index + needed_pages;
+    uint32_t end_index = MIN(start_index + page_count, PAGE_INDEX_4K(MEMORY_END));
+
+    if (start_index >= end_index)
+    {
+        return FALSE;
+    }
+
+    uint32_t start = start_index * PAGESIZE_4K;
+    uint32_t end = end_index * PAGESIZE_4K;
+
+    //Modifications through shared file mappings reach the file before the pages go away
+    vmm_vma_sync(process, start, end);
+
+    BOOL result = start < (uint32_t)process->brk_next_unallocated_page_begin;
+
+    if (vmm_vma_remove_range(process, start, end))
+    {
+        result = TRUE;
+    }
+
+    if (FALSE == result)
+    {
+        return FALSE;
+    }
+
+    uint32_t* pd = (uint32_t*)0xFFFFF000;
+
+    for (uint32_t page_index = start_index; page_index < end_index; ++page_index)
+    {
+        uint32_t pd_index = page_index / 1024;
+
+        if ((page_index % 1024) == 0 && end_index - page_index >= 1024)
+        {
+            //A whole 4MB page goes at once, a part of it is split by vmm_remove_page_from_pd
+            if ((pd[pd_index] & (PG_PRESENT | PG_4MB)) == (PG_PRESENT | PG_4MB))
+            {
+                remove_huge_page(pd_index);
+            }
+
+            if ((pd[pd_index] & PG_PRESENT) != PG_PRESENT)
+            {
+                page_index += 1023;
+                continue;
+            }
+        }
+
+        vmm_remove_page_from_pd((char*)(page_index * PAGESIZE_4K));
+
+        //log_printf("UNMAPPED: %s(%d) virtual:%x\n", process->name, process->pid, v_addr);
+    }
+
+    return result;
+}
+
+//Reserves virtual pages without backing them. The page fault handler maps zeroed frames on first touch.
+void* vmm_reserve_memory(Process* process, uint32_t v_address_search_start, uint32_t page_count, uint32_t vma_flags)
+{
+    if (page_count == 0)
+    {
+        return NULL;
+    }
+
+    uint32_t v_mem = 0;
+
+    if (vma_flags == VMA_ANONYMOUS)
+    {
+        v_mem = find_free_virtual_range_for_huge_pages(process, v_address_search_start, page_count);
+    }
+    else
+    {
+        v_mem = find_free_virtual_range(process, v_address_search_start, page_count, 1);
+    }
+
+    if (0 == v_mem)
+    {
+        return NULL;
+    }
+
+    vmm_vma_add(process, v_mem, v_mem + page_count * PAGESIZE_4K, vma_flags);
+
+    return (void*)v_mem;
+}
+
+//Like vmm_reserve_memory, for an area showing size bytes of cache from file_offset (page aligned) on.
+void* vmm_reserve_file_memory(Process* process, uint32_t v_address_search_start, uint32_t size, uint32_t vma_flags, PageCache* cache, uint32_t file_offset)
+{
+    if (size == 0 || (file_offset % PAGESIZE_4K) != 0)
+    {
+        return NULL;
+    }
+
+    uint32_t page_count = PAGE_COUNT(size);
+
+    uint32_t v_mem = find_free_virtual_range(process, v_address_search_start, page_count, 1);
+
+    if (0 == v_mem)
+    {
+        return NULL;
+    }
+
+    vmm_vma_add_file(process, v_mem, v_mem + page_count * PAGESIZE_4K, vma_flags, cache, file_offset, page_count * PAGESIZE_4K);
+
+    return (void*)v_mem;
+}
+
+//Backs reserved pages right away. For memory written before the process runs, like its image.
+//Works for active Page Directory!
+BOOL vmm_populate_memory(Process* process, uint32_t v_address, uint32_t page_count)
+{
+    v_address &= 0xFFFFF000;
+
+    for (uint32_t i = 0; i < page_count; ++i)
+    {
+        uint32_t v = v_address + i * PAGESIZE_4K;
+
+        uint32_t* pte = get_user_page_table_entry(v, TRUE);
+
+        if (NULL == pte)
+        {
+            return FALSE;
+        }
+
+        if ((*pte & PG_PRESENT) == PG_PRESENT && (*pte & 0xFFFFF000) != (uint32_t)g_zero_page)
+        {
+            continue;
+        }
+
+        if (FALSE == map_zeroed_frame(v, pte))
+        {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+//Works for active Page Directory! Returns 0 if v_addr is not mapped.
+uint32_t vmm_get_physical_address(uint32_t v_addr)
+{
+    int pd_index = v_addr >> 22;
+    int pt_index = (v_addr >> 12) & 0x03FF;
+
+    uint32_t* pd = (uint32_t*)0xFFFFF000;
+
+    if ((pd[pd_index] & PG_PRESENT) != PG_PRESENT)
+    {
+        return 0;
+    }
+
+    if ((pd[pd_index] & PG_4MB) == PG_4MB)
+    {
+        return (pd[pd_index] & 0xFFC00000) | (v_addr & 0x003FFFFF);
+    }
+
+    uint32_t* pt = ((uint32_t*)0xFFC00000) + (0x400 * pd_index);
+
+    if ((pt[pt_index] & PG_PRESENT) != PG_PRESENT)
+    {
+        return 0;
+    }
+
+    return (pt[pt_index] & 0xFFFFF000) | (v_addr & 0xFFF);
+}
+
+VirtualMemoryArea* vmm_vma_add_file(Process* process, uint32_t start, uint32_t end, uint32_t flags, PageCache* cache, uint32_t file_offset, uint32_t file_size)
+{
+    VirtualMemoryArea* vma = vmm_vma_add(process, start, end, flags | VMA_FILE);
+    vma->cache = cache;
+    vma->file_offset = file_offset;
+    vma->file_size = file_size;
+
+    pagecache_acquire(cache);
+
+    return vma;
+}
+
+static void vma_free(VirtualMemoryArea* vma)
+{
+    if (vma->cache)
+    {
+        pagecache_release(vma->cache);
+    }
+
+    kfree(vma);
+}
+
+//Areas are ordered by start. Equal starts (only an empty heap area can share one) are ordered by address, so every area has its own place.
+static BOOL vma_less(VirtualMemoryArea* a, VirtualMemoryArea* b)
+{
+    if (a->start != b->start)
+    {
+        return a->start < b->start;
+    }
+
+    return (uint32_t)a < (uint32_t)b;
+}
+
+static int32_t vma_height(VirtualMemoryArea* node)
+{
+    return node ? node->height : 0;
+}
+
+//Recomputes the height and the largest gap of node from its children
+static void vma_update(VirtualMemoryArea* node)
+{
+    node->height = MAX(vma_height(node->left), vma_height(node->right)) + 1;
+
+    node->subtree_gap = node->gap;
+
+    if (node->left)
+    {
+        node->subtree_gap = MAX(node->subtree_gap, node->left->subtree_gap);
+    }
+
+    if (node->right)
+    {
+        node->subtree_gap = MAX(node->subtree_gap, node->right->subtree_gap);
+    }
+}
+
+static VirtualMemoryArea* vma_rotate_right(VirtualMemoryArea* node)
+{
+    VirtualMemoryArea* left = node->left;
+
+    node->left = left->right;
+    left->right = node;
+
+    vma_update(node);
+    vma_update(left);
+
+    return left;
+}
+
+static VirtualMemoryArea* vma_rotate_left(VirtualMemoryArea* node)
+{
+    VirtualMemoryArea* right = node->right;
+
+    node->right = right->left;
+    right->left = node;
+
+    vma_update(node);
+    vma_update(right);
+
+    return right;
+}
+
+static VirtualMemoryArea* vma_balance(VirtualMemoryArea* node)
+{
+    vma_update(node);
+
+    int32_t balance = vma_height(node->left) - vma_height(node->right);
+
+    if (balance > 1)
+    {
+        if (vma_height(node->left->left) < vma_height(node->left->right))
+        {
+            node->left = vma_rotate_left(node->left);
+        }
+
+        return vma_rotate_right(node);
+    }
+
+    if (balance < -1)
+    {
+        if (vma_height(node->right->right) < vma_height(node->right->left))
+        {
+            node->right = vma_rotate_right(node->right);
+        }
+
+        return vma_rotate_left(node);
+    }
+
+    return node;
+}
+
+static VirtualMemoryArea* vma_tree_insert(VirtualMemoryArea* node, VirtualMemoryArea* vma)
+{
+    if (NULL == node)
+    {
+        vma->left = NULL;
+        vma->right = NULL;
+        vma_update(vma);
+
+        return vma;
+    }
+
+    if (vma_less(vma, node))
+    {
+        node->left = vma_tree_insert(node->left, vma);
+    }
+    else
+    {
+        node->right = vma_tree_insert(node->right, vma);
+    }
+
+    return vma_balance(node);
+}
+
+static VirtualMemoryArea* vma_tree_remove_min(VirtualMemoryArea* node, VirtualMemoryArea** min)
+{
+    if (NULL == node->left)
+    {
+        *min = node;
+
+        return node->right;
+    }
+
+    node->left = vma_tree_remove_min(node->left, min);
+
+    return vma_balance(node);
+}
+
+static VirtualMemoryArea* vma_tree_remove(VirtualMemoryArea* node, VirtualMemoryArea* vma)
+{
+    if (node == vma)
+    {
+        if (NULL == node->right)
+        {
+            return node->left;
+        }
+
+        VirtualMemoryArea* min = NULL;
+        VirtualMemoryArea* right = vma_tree_remove_min(node->right, &min);
+
+        min->left = node->left;
+        min->right = right;
+
+        return vma_balance(min);
+    }
+
+    if (vma_less(vma, node))
+    {
+        node->left = vma_tree_remove(node->left, vma);
+    }
+    else
+    {
+        node->right = vma_tree_remove(node->right, vma);
+    }
+
+    return vma_balance(node);
+}
+
+//Recomputes the largest gaps on the way to vma after its gap changed
+static void vma_tree_update_path(VirtualMemoryArea* node, VirtualMemoryArea* vma)
+{
+    if (node != vma)
+    {
+        vma_tree_update_path(vma_less(vma, node) ? node->left : node->right, vma);
+    }
+
+    vma_update(node);
+}
+
+static void vma_refresh_gap(Process* process, VirtualMemoryArea* vma)
+{
+    if (NULL == vma)
+    {
+        return;
+    }
+
+    uint32_t previous_end = vma->prev ? vma->prev->end : USER_OFFSET;
+
+    vma->gap = vma->start > previous_end ? vma->start - previous_end : 0;
+
+    vma_tree_update_path(process->vma_tree, vma);
+}
+
+//Last area starting at or before address, or NULL
+static VirtualMemoryArea* vma_last_starting_before(Process* process, uint32_t address)
+{
+    VirtualMemoryArea* result = NULL;
+
+    VirtualMemoryArea* node = process->vma_tree;
+    while (node)
+    {
+        if (node->start <= address)
+        {
+            result = node;
+            node = node->right;
+        }
+        else
+        {
+            node = node->left;
+        }
+    }
+
+    return result;
+}
+
+//First area ending after address, in address order
+static VirtualMemoryArea* vma_first_ending_after(Process* process, uint32_t address)
+{
+    VirtualMemoryArea* vma = vma_last_starting_before(process, address);
+
+    if (NULL == vma)
+    {
+        return process->vmas;
+    }
+
+    //Areas with the same start are next to each other in the list
+    while (vma->prev && vma->prev->start == vma->start)
+    {
+        vma = vma->prev;
+    }
+
+    while (vma && vma->end <= address)
+    {
+        vma = vma->next;
+    }
+
+    return vma;
+}
+
+static void vma_link(Process* process, VirtualMemoryArea* vma)
+{
+    //The area right before vma in the order, found before vma is in the tree
+    VirtualMemoryArea* previous = NULL;
+
+    VirtualMemoryArea* node = process->vma_tree;
+    while (node)
+    {
+        if (vma_less(node, vma))
+        {
+            previous = node;
+            node = node->right;
+        }
+        else
+        {
+            node = node->left;
+        }
+    }
+
+    vma->prev = previous;
+
+    if (previous)
+    {
+        vma->next = previous->next;
+        previous->next = vma;
+    }
+    else
+    {
+        vma->next = process->vmas;
+        process->vmas = vma;
+    }
+
+    if (vma->next)
+    {
+        vma->next->prev = vma;
+    }
+
+    uint32_t previous_end = previous ? previous->end : USER_OFFSET;
+    vma->gap = vma->start > previous_end ? vma->start - previous_end : 0;
 
+    process->vma_tree = vma_tree_insert(process->vma_tree, vma);
+
+    vma_refresh_gap(process, vma->next);
+}
+
+static void vma_unlink(Process* process, VirtualMemoryArea* vma)
+{
+    VirtualMemoryArea* next = vma->next;
+
+    if (vma->prev)
+    {
+        vma->prev->next = next;
+    }
+    else
+    {
+        process->vmas = next;
+    }
+
+    if (next)
+    {
+        next->prev = vma->prev;
+    }
+
+    process->vma_tree = vma_tree_remove(process->vma_tree, vma);
+
+    if (process->heap_vma == vma)
+    {
+        process->heap_vma = NULL;
+    }
+
+    vma_refresh_gap(process, next);
+}
+
+//Moves the bounds of vma. It must not pass its neighbours.
+void vmm_vma_resize(Process* process, VirtualMemoryArea* vma, uint32_t start, uint32_t end)
+{
+    vma->start = start;
+    vma->end = end;
+
+    vma_refresh_gap(process, vma);
+    vma_refresh_gap(process, vma->next);
+}
+
+//Plain anonymous areas touching each other are kept as one
+static BOOL vma_can_merge(VirtualMemoryArea* vma, uint32_t flags)
+{
+    return flags == VMA_ANONYMOUS && vma->flags == VMA_ANONYMOUS && NULL == vma->cache;
+}
+
+VirtualMemoryArea* vmm_vma_add(Process* process, uint32_t start, uint32_t end, uint32_t flags)
+{
+    VirtualMemoryArea* previous = vma_last_starting_before(process, start);
+
+    if (previous && previous->end == start && start < end && vma_can_merge(previous, flags))
+    {
+        VirtualMemoryArea* next = previous->next;
+
+        if (next && next->start == end && vma_can_merge(next, flags))
+        {
+            end = next->end;
+
+            vma_unlink(process, next);
+            vma_free(next);
+        }
+
+        vmm_vma_resize(process, previous, previous->start, end);
+
+        return previous;
+    }
+
+    VirtualMemoryArea* vma = (VirtualMemoryArea*)kmalloc(sizeof(VirtualMemoryArea));
+    memset((uint8_t*)vma, 0, sizeof(VirtualMemoryArea));
+    vma->start = start;
+    vma->end = end;
+    vma->flags = flags;
+
+    vma_link(process, vma);
+
+    return vma;
+}
+
+//Keeps the file part in place when the start of vma moves forward by skipped bytes
+static void vma_skip_file(VirtualMemoryArea* vma, uint32_t skipped)
+{
+    if (vma->cache)
+    {
+        vma->file_offset += skipped;
+        vma->file_size = vma->file_size > skipped ? vma->file_size - skipped : 0;
+    }
+}
+
+//Cuts [start, end) out of the areas. An area covering both sides of the range is split in two.
+//Returns whether any area was touched.
+BOOL vmm_vma_remove_range(Process* process, uint32_t start, uint32_t end)
+{
     BOOL result = FALSE;
 
-    for (page_index = start_index; page_index < end_index; ++page_index)
+    VirtualMemoryArea* vma = vma_first_ending_after(process, start);
+    while (vma && vma->start < end)
+    {
+        VirtualMemoryArea* next = vma->next;
+
+        result = TRUE;
+
+        if (start <= vma->start && vma->end <= end)
+        {
+            vma_unlink(process, vma);
+
+            vma_free(vma);
+        }
+        else if (vma->start < start && end < vma->end)
+        {
+            VirtualMemoryArea* upper = (VirtualMemoryArea*)kmalloc(sizeof(VirtualMemoryArea));
+            *upper = *vma;
+            upper->flags = vma->flags & ~VMA_HEAP;
+            upper->start = end;
+            vma_skip_file(upper, end - vma->start);
+
+            if (upper->cache)
+            {
+                pagecache_acquire(upper->cache);
+            }
+
+            vmm_vma_resize(process, vma, vma->start, start);
+
+            vma_link(process, upper);
+            break;
+        }
+        else if (vma->start < start)
+        {
+            vmm_vma_resize(process, vma, vma->start, start);
+        }
+        else
+        {
+            vma_skip_file(vma, end - vma->start);
+
+            vmm_vma_resize(process, vma, end, vma->end);
+        }
+
+        vma = next;
+    }
+
+    return result;
+}
+
+VirtualMemoryArea* vmm_vma_find(Process* process, uint32_t address)
+{
+    VirtualMemoryArea* vma = vma_first_ending_after(process, address);
+
+    if (vma && vma->start <= address)
+    {
+        return vma;
+    }
+
+    return NULL;
+}
+
+//Whether [start, end) overlaps any area
+BOOL vmm_vma_intersects(Process* process, uint32_t start, uint32_t end)
+{
+    VirtualMemoryArea* vma = vma_first_ending_after(process, start);
+
+    return vma && vma->start < end;
+}
+
+//Moves the CPU dirty bits of shared file pages in [start, end) into their caches.
+//Switches to the Page Directory of process if it is not the active one, in interrupts disabled
+//so that a schedule does not switch back under it (the reaper thread runs in the kernel's).
+void vmm_vma_collect_dirty(Process* process, uint32_t start, uint32_t end)
+{
+    BOOL interrupts_enabled = is_interrupts_enabled();
+    disable_interrupts();
+
+    uint32_t cr3 = read_cr3();
+
+    BOOL switched = FALSE;
+
+    for (VirtualMemoryArea* vma = vma_first_ending_after(process, start); vma && vma->start < end; vma = vma->next)
     {
-        if (IS_PAGEFRAME_USED(process->mmapped_virtual_memory, page_index))
+        if (vma->end <= start || (vma->flags & VMA_SHARED) != VMA_SHARED || NULL == vma->cache || NULL == vma->cache->file)
+        {
+            continue;
+        }
+
+        if (FALSE == switched && cr3 != (uint32_t)process->pd)
+        {
+            CHANGE_PD(process->pd);
+            switched = TRUE;
+        }
+
+        uint32_t* pd = (uint32_t*)0xFFFFF000;
+
+        uint32_t last = MIN(end, vma->end);
+
+        for (uint32_t page = MAX(start, vma->start) & 0xFFFFF000; page < last; page += PAGESIZE_4K)
         {
-            char* v_addr = (char*)(page_index * PAGESIZE_4K);
+            uint32_t pd_index = page >> 22;
+
+            if ((pd[pd_index] & PG_PRESENT) != PG_PRESENT)
+            {
+                //skip to the next table
+                page = (page | (PAGESIZE_4M - 1)) + 1 - PAGESIZE_4K;
+                continue;
+            }
+
+            uint32_t* pte = ((uint32_t*)0xFFC00000) + (page >> 12);
 
-            vmm_remove_page_from_pd(v_addr);
+            if ((*pte & (PG_PRESENT | PG_DIRTY)) == (PG_PRESENT | PG_DIRTY))
+            {
+                pagecache_mark_dirty(vma->cache, (vma->file_offset + page - vma->start) / PAGESIZE_4K);
+
+                *pte &= ~PG_DIRTY;
+
+                INVALIDATE(page);
+            }
+        }
+    }
+
+    if (switched)
+    {
+        CHANGE_PD(cr3);
+    }
+
+    if (interrupts_enabled)
+    {
+        enable_interrupts();
+    }
+}
 
-            //log_printf("UNMAPPED: %s(%d) virtual:%x\n", process->name, process->pid, v_addr);
+//msync: writes the pages of shared file areas in [start, end) that were modified back to their files
+int32_t vmm_vma_sync(Process* process, uint32_t start, uint32_t end)
+{
+    vmm_vma_collect_dirty(process, start, end);
 
-            SET_PAGEFRAME_UNUSED(process->mmapped_virtual_memory, v_addr);
+    int32_t result = 0;
 
-            result = TRUE;
+    for (VirtualMemoryArea* vma = vma_first_ending_after(process, start); vma && vma->start < end; vma = vma->next)
+    {
+        if (vma->end > start && (vma->flags & VMA_SHARED) == VMA_SHARED && vma->cache)
+        {
+            if (pagecache_writeback(vma->cache) < 0)
+            {
+                result = -1;
+            }
         }
     }
 
     return result;
 }
+
+void vmm_vma_destroy_all(Process* process)
+{
+    VirtualMemoryArea* vma = process->vmas;
+    while (vma)
+    {
+        VirtualMemoryArea* next = vma->next;
+
+        vma_free(vma);
+
+        vma = next;
+    }
+
+    process->vmas = NULL;
+    process->vma_tree = NULL;
+    process->heap_vma = NULL;
+}
+
+//Copies the user space of the active Page Directory into child's. Writable owned pages become
+//read-only copy-on-write in both, so only the page tables are copied here.
+//Works for active Page Directory! On failure the caller destroys child's Page Directory.
+BOOL vmm_fork_user_space(Process* child)
+{
+    uint32_t* pd = (uint32_t*)0xFFFFF000;
+
+    uint32_t* table_copy = (uint32_t*)kmalloc(PAGESIZE_4K);
+
+    uint32_t cr3 = read_cr3();
+
+    BOOL result = TRUE;
+
+    for (int pd_index = KERNELMEMORY_PAGE_COUNT; pd_index < 1023; ++pd_index)
+    {
+        if ((pd[pd_index] & PG_PRESENT) != PG_PRESENT)
+        {
+            continue;
+        }
+
+        if ((pd[pd_index] & (PG_4MB | PG_OWNED)) == (PG_4MB | PG_OWNED))
+        {
+            //Owned memory is shared copy-on-write page by page below
+            if (FALSE == split_huge_page(pd_index))
+            {
+                result = FALSE;
+                break;
+            }
+        }
+
+        if ((pd[pd_index] & PG_4MB) == PG_4MB)
+        {
+            //Large mappings that are not owned are device or shared memory, shared as they are
+            uint32_t entry = pd[pd_index] & ~PG_OWNED;
+
+            //The child's page directory is not mapped, it is written as the active one
+            CHANGE_PD(child->pd);
+
+            pd[pd_index] = entry;
+
+            CHANGE_PD(cr3);
+            continue;
+        }
+
+        if (vmm_get_free_page_count() == 0)
+        {
+            result = FALSE;
+            break;
+        }
+
+        uint32_t* pt = ((uint32_t*)0xFFC00000) + (0x400 * pd_index);
+
+        for (int pt_index = 0; pt_index < 1024; ++pt_index)
+        {
+            uint32_t entry = pt[pt_index];
+
+            //Not owned pages (shared memory, framebuffer, the zero page) stay shared
+            if ((entry & (PG_PRESENT | PG_OWNED)) == (PG_PRESENT | PG_OWNED))
+            {
+                if ((entry & PG_WRITE) == PG_WRITE)
+                {
+                    entry = (entry & ~PG_WRITE) | PG_COW;
+
+                    pt[pt_index] = entry;
+                }
+
+                ++g_frame_share_counts[PAGE_INDEX_4K(entry & 0xFFFFF000)];
+            }
+
+            table_copy[pt_index] = entry;
+        }
+
+        BOOL zeroed = FALSE;
+        uint32_t table_physical = acquire_page_table(&zeroed);
+
+        //The child's page directory is not mapped, it is written as the active one
+        CHANGE_PD(child->pd);
+
+        pd[pd_index] = table_physical | PG_PRESENT | PG_WRITE | PG_USER | PG_OWNED;
+
+        INVALIDATE(pt);
+
+        memcpy((uint8_t*)pt, (uint8_t*)table_copy, PAGESIZE_4K);
+
+        //Also flushes the parent's entries we just write protected
+        CHANGE_PD(cr3);
+    }
+
+    kfree(table_copy);
+
+    return result;
+}
+
+//Deep copies the areas of from into to
+void vmm_vma_copy_all(Process* to, Process* from)
+{
+    for (VirtualMemoryArea* vma = from->vmas; vma; vma = vma->next)
+    {
+        VirtualMemoryArea* copy = NULL;
+
+        if (vma->cache)
+        {
+            copy = vmm_vma_add_file(to, vma->start, vma->end, vma->flags, vma->cache, vma->file_offset, vma->file_size);
+        }
+        else
+        {
+            copy = vmm_vma_add(to, vma->start, vma->end, vma->flags);
+        }
+
+        if (from->heap_vma == vma)
+        {
+            to->heap_vma = copy;
+        }
+    }
+}
@@ -5,18 +5,52 @@
 
 typedef struct Process Process;
 typedef struct List List;
+typedef struct PageCache PageCache;
 
 extern uint32_t *g_kernel_page_directory;
 
 
-#define SET_PAGEFRAME_USED(bitmap, page_index)	bitmap[((uint32_t) page_index)/8] |= (1 << (((uint32_t) page_index)%8))
-#define SET_PAGEFRAME_UNUSED(bitmap, p_addr)	bitmap[((uint32_t) p_addr/PAGESIZE_4K)/8] &= ~(1 << (((uint32_t) p_addr/PAGESIZE_4K)%8))
-#define IS_PAGEFRAME_USED(bitmap, page_index)	(bitmap[((uint32_t) page_index)/8] & (1 << (((uint32_t) page_index)%8)))
-
 #define CHANGE_PD(pd) asm("mov %0, %%eax ;mov %%eax, %%cr3":: "m"(pd))
-#define INVALIDATE(v_addr) asm("invlpg %0"::"m"(v_addr))
+#define INVALIDATE(v_addr) asm volatile("invlpg (%0)"::"r"(v_addr) : "memory")
+
+//A used region of the user address space. Except mapped ones, their pages are created on first touch.
+typedef struct VirtualMemoryArea
+{
+    uint32_t start;
+    uint32_t end;//exclusive
+    uint32_t flags;
+    PageCache* cache;//file backed areas only
+    uint32_t file_offset;//file position of start, page aligned
+    uint32_t file_size;//bytes from start that come from the file, the rest is zero
+    struct VirtualMemoryArea* next;
+    struct VirtualMemoryArea* prev;
+    //AVL tree by start, for lookups and free range searches
+    struct VirtualMemoryArea* left;
+    struct VirtualMemoryArea* right;
+    int32_t height;
+    uint32_t gap;//free bytes between the previous area (or USER_OFFSET) and start
+    uint32_t subtree_gap;//largest gap in the subtree
+} VirtualMemoryArea;
+
+#define VMA_ANONYMOUS   0x1
+#define VMA_HEAP        0x2
+#define VMA_STACK       0x4
+#define VMA_FILE        0x8
+#define VMA_WRITE       0x10
+#define VMA_SHARED      0x20//file pages are mapped as they are, writes go to the file
+#define VMA_MAPPED      0x40//device or shared memory mapped by vmm_map_memory
+
+//mmap() prot and flags, msync() flags
+#define PROT_READ       0x1
+#define PROT_WRITE      0x2
+#define MAP_SHARED      0x01
+#define MAP_PRIVATE     0x02
+#define MS_ASYNC        1
+#define MS_INVALIDATE   2
+#define MS_SYNC         4
 
 uint32_t vmm_acquire_page_frame_4k();
+uint32_t vmm_acquire_page_frames_4k(uint32_t page_count, uint32_t alignment_pages);
 void vmm_release_page_frame_4k(uint32_t p_addr);
 
 void vmm_initialize(uint32_t high_mem);
@@ -25,6 +59,7 @@ uint32_t *vmm_acquire_page_directory();
 void vmm_destroy_page_directory_with_memory(uint32_t physical_pd);
 
 BOOL vmm_add_page_to_pd(char *v_addr, uint32_t p_addr, int flags);
+BOOL vmm_add_huge_page_to_pd(char *v_addr, uint32_t p_addr, int flags);
 BOOL vmm_remove_page_from_pd(char *v_addr);
 
 void enable_paging();
@@ -34,8 +69,25 @@ uint32_t vmm_get_total_page_count();
 uint32_t vmm_get_used_page_count();
 uint32_t vmm_get_free_page_count();
 
-void vmm_initialize_process_pages(Process* process);
+uint32_t vmm_get_physical_address(uint32_t v_addr);
+
 void* vmm_map_memory(Process* process, uint32_t v_address_search_start, uint32_t* p_address_array, uint32_t page_count, BOOL own);
 BOOL vmm_unmap_memory(Process* process, uint32_t v_address, uint32_t page_count);
+void* vmm_reserve_memory(Process* process, uint32_t v_address_search_start, uint32_t page_count, uint32_t vma_flags);
+void* vmm_reserve_file_memory(Process* process, uint32_t v_address_search_start, uint32_t size, uint32_t vma_flags, PageCache* cache, uint32_t file_offset);
+BOOL vmm_populate_memory(Process* process, uint32_t v_address, uint32_t page_count);
+
+VirtualMemoryArea* vmm_vma_add(Process* process, uint32_t start, uint32_t end, uint32_t flags);
+VirtualMemoryArea* vmm_vma_add_file(Process* process, uint32_t start, uint32_t end, uint32_t flags, PageCache* cache, uint32_t file_offset, uint32_t file_size);
+BOOL vmm_vma_remove_range(Process* process, uint32_t start, uint32_t end);
+void vmm_vma_resize(Process* process, VirtualMemoryArea* vma, uint32_t start, uint32_t end);
+VirtualMemoryArea* vmm_vma_find(Process* process, uint32_t address);
+BOOL vmm_vma_intersects(Process* process, uint32_t start, uint32_t end);
+void vmm_vma_destroy_all(Process* process);
+void vmm_vma_collect_dirty(Process* process, uint32_t start, uint32_t end);
+int32_t vmm_vma_sync(Process* process, uint32_t start, uint32_t end);
+void vmm_vma_copy_all(Process* to, Process* from);
+
+BOOL vmm_fork_user_space(Process* child);
 
 #endif // VMM_H
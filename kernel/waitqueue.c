@@ -0,0 +1,190 @@
+#include "waitqueue.h"
+#include "process.h"
+#include "list.h"
+
+void waitqueue_initialize(WaitQueue* queue)
+{
+    memset((uint8_t*)queue, 0, sizeof(WaitQueue));
+}
+
+//Sleeping in this queue, or waiting for any of the queues it registered in
+static BOOL is_waiting(Thread* thread, WaitQueue* queue)
+{
+    return (thread->state == TS_WAITIO && thread->state_privateData == queue) || thread->state == TS_SELECT;
+}
+
+//Must be called in interrupts disabled
+static void waitqueue_remove(WaitQueue* queue, Thread* thread)
+{
+    if (queue->threads)
+    {
+        list_remove_first_occurrence(queue->threads, thread);
+    }
+
+    if (thread->wait_queues)
+    {
+        list_remove_first_occurrence(thread->wait_queues, queue);
+    }
+}
+
+//Waiters are resumed and forget the queue, so it may be freed right after
+void waitqueue_destroy(WaitQueue* queue)
+{
+    if (NULL == queue->threads)
+    {
+        return;
+    }
+
+    BOOL interrupts_enabled = is_interrupts_enabled();
+    disable_interrupts();
+
+    list_foreach (n, queue->threads)
+    {
+        Thread* thread = (Thread*)n->data;
+
+        if (is_waiting(thread, queue))
+        {
+            thread_resume(thread);
+        }
+
+        list_remove_first_occurrence(thread->wait_queues, queue);
+    }
+
+    list_destroy(queue->threads);
+    queue->threads = NULL;
+
+    if (interrupts_enabled)
+    {
+        enable_interrupts();
+    }
+}
+
+//Registers thread to be woken by the queue. Both sides keep a list so either can go away first.
+void waitqueue_add(WaitQueue* queue, Thread* thread)
+{
+    BOOL interrupts_enabled = is_interrupts_enabled();
+    disable_interrupts();
+
+    if (NULL == queue->threads)
+    {
+        queue->threads = list_create();
+    }
+
+    if (NULL == thread->wait_queues)
+    {
+        thread->wait_queues = list_create();
+    }
+
+    if (NULL == list_find_first_occurrence(queue->threads, thread))
+    {
+        list_append(queue->threads, thread);
+        list_append(thread->wait_queues, queue);
+    }
+
+    if (interrupts_enabled)
+    {
+        enable_interrupts();
+    }
+}
+
+//Must be called in interrupts disabled. Returns in interrupts disabled state after a wake up or a signal.
+void waitqueue_sleep(WaitQueue* queue)
+{
+    Thread* thread = thread_get_current();
+
+    waitqueue_add(queue, thread);
+
+    thread_change_state(thread, TS_WAITIO, queue);
+    enable_interrupts();
+    halt();
+
+    disable_interrupts();
+
+    //Only this one, a select in progress keeps its registrations.
+    //A destroyed queue already dropped the back link and may be freed by now.
+    if (thread->wait_queues && list_find_first_occurrence(thread->wait_queues, queue))
+    {
+        waitqueue_remove(queue, thread);
+    }
+}
+
+//Safe in interrupt handlers
+void waitqueue_wake_all(WaitQueue* queue)
+{
+    if (NULL == queue->threads)
+    {
+        return;
+    }
+
+    BOOL interrupts_enabled = is_interrupts_enabled();
+    disable_interrupts();
+
+    list_foreach (n, queue->threads)
+    {
+        Thread* thread = (Thread*)n->data;
+
+        if (is_waiting(thread, queue))
+        {
+            thread_resume(thread);
+        }
+    }
+
+    if (interrupts_enabled)
+    {
+        enable_interrupts();
+    }
+}
+
+//Resumes the longest waiting one. Sleepers are in arrival order, so it is normally the first.
+void waitqueue_wake_one(WaitQueue* queue)
+{
+    if (NULL == queue->threads)
+    {
+        return;
+    }
+
+    BOOL interrupts_enabled = is_interrupts_enabled();
+    disable_interrupts();
+
+    list_foreach (n, queue->threads)
+    {
+        Thread* thread = (Thread*)n->data;
+
+        if (is_waiting(thread, queue))
+        {
+            thread_resume(thread);
+            break;
+        }
+    }
+
+    if (interrupts_enabled)
+    {
+        enable_interrupts();
+    }
+}
+
+//Drops every registration of thread. Called after a select and when a thread is destroyed.
+void waitqueue_remove_thread(Thread* thread)
+{
+    if (NULL == thread->wait_queues)
+    {
+        return;
+    }
+
+    BOOL interrupts_enabled = is_interrupts_enabled();
+    disable_interrupts();
+
+    while (list_is_empty(thread->wait_queues) == FALSE)
+    {
+        WaitQueue* queue = (WaitQueue*)thread->wait_queues->head->data;
+
+        list_remove_first_occurrence(queue->threads, thread);
+
+        list_remove_first_node(thread->wait_queues);
+    }
+
+    if (interrupts_enabled)
+    {
+        enable_interrupts();
+    }
+}
@@ -0,0 +1,25 @@
+#ifndef WAITQUEUE_H
+#define WAITQUEUE_H
+
+#include "common.h"
+
+typedef struct Thread Thread;
+typedef struct List List;
+
+//The one blocking mechanism of the kernel. A thread either sleeps in one queue (waitqueue_sleep)
+//or registers in several and sleeps in select state (select/poll/epoll_wait on file system nodes).
+//Woken threads re-check their condition, a wake up may be spurious.
+typedef struct WaitQueue
+{
+    List* threads;//created on first use
+} WaitQueue;
+
+void waitqueue_initialize(WaitQueue* queue);
+void waitqueue_destroy(WaitQueue* queue);
+void waitqueue_add(WaitQueue* queue, Thread* thread);
+void waitqueue_sleep(WaitQueue* queue);
+void waitqueue_wake_all(WaitQueue* queue);
+void waitqueue_wake_one(WaitQueue* queue);
+void waitqueue_remove_thread(Thread* thread);
+
+#endif // WAITQUEUE_H
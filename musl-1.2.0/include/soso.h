@@ -3,7 +3,8 @@
 
 #include <stdint.h>
 
-#define SOSO_MAX_OPENED_FILES 20
+#define SOSO_MAX_OPENED_FILES 1024
+#define SOSO_PROCINFO_MAX_FILES 20
 #define SOSO_PROCESS_NAME_MAX 32
 
 typedef struct ThreadInfo
@@ -26,7 +27,7 @@ typedef struct ProcInfo
 {
     uint32_t process_id;
     int32_t parent_process_id;
-    uint32_t fd[SOSO_MAX_OPENED_FILES];
+    uint32_t fd[SOSO_PROCINFO_MAX_FILES];
 
     char name[SOSO_PROCESS_NAME_MAX];
     char tty[128];
@@ -51,6 +52,12 @@ typedef struct FileSystemDirent
     int32_t inode;
 } FileSystemDirent;
 
+typedef struct FileSystemDirentStat
+{
+    FileSystemDirent dirent;
+    uint32_t size;
+} FileSystemDirentStat;
+
 typedef struct SosoMessage
 {
     uint32_t message_type;
@@ -67,6 +74,7 @@ int32_t execute(const char *path, char *const argv[], char *const envp[]);
 int32_t executep(const char *filename, char *const argv[], char *const envp[]);
 
 int32_t soso_read_dir(int32_t fd, void *dirent, int32_t index);
+int32_t soso_read_dir_stat(int32_t fd, FileSystemDirentStat* entries, int32_t max_count);
 
 void sleep_ms(uint32_t ms);
 
@@ -5,4 +5,9 @@
 int32_t soso_read_dir(int32_t fd, void *dirent, int32_t index)
 {
     return __syscall(SYS_soso_read_dir, fd, dirent, index);
+}
+
+int32_t soso_read_dir_stat(int32_t fd, FileSystemDirentStat* entries, int32_t max_count)
+{
+    return __syscall(SYS_soso_read_dir_stat, fd, entries, max_count);
 }
\ No newline at end of file
@@ -0,0 +1,283 @@
+//Host side throughput benchmark for kernel/fifobuffer.c
+//Build and run: make -C tools && tools/fifobuffer_benchmark
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+//kernel/fifobuffer.h pulls in the kernel common.h which clashes with the host headers
+typedef struct FifoBuffer FifoBuffer;
+
+FifoBuffer* fifobuffer_create(uint32_t capacity);
+void fifobuffer_destroy(FifoBuffer* fifo_buffer);
+uint32_t fifobuffer_get_size(FifoBuffer* fifo_buffer);
+int32_t fifobuffer_enqueue(FifoBuffer* fifo_buffer, uint8_t* data, uint32_t size);
+int32_t fifobuffer_dequeue(FifoBuffer* fifo_buffer, uint8_t* data, uint32_t size);
+int32_t fifobuffer_enqueue_from_other(FifoBuffer* fifo_buffer, FifoBuffer* other);
+uint8_t* fifobuffer_peek_readable(FifoBuffer* fifo_buffer, uint32_t* size);
+void fifobuffer_commit_read(FifoBuffer* fifo_buffer, uint32_t size);
+
+void* kmalloc(uint32_t size)
+{
+    return malloc(size);
+}
+
+void kfree(void* v_addr)
+{
+    free(v_addr);
+}
+
+//The byte at a time implementation the kernel used before, kept as the baseline
+typedef struct LegacyFifo
+{
+    uint8_t* data;
+    uint32_t write_index;
+    uint32_t read_index;
+    uint32_t capacity;
+    uint32_t used_bytes;
+} LegacyFifo;
+
+__attribute__((noinline)) static int32_t legacy_enqueue(LegacyFifo* fifo, uint8_t* data, uint32_t size)
+{
+    uint32_t i = 0;
+    while (fifo->used_bytes < fifo->capacity && i < size)
+    {
+        fifo->data[fifo->write_index] = data[i++];
+        fifo->used_bytes++;
+        fifo->write_index++;
+        fifo->write_index %= fifo->capacity;
+    }
+
+    return (int32_t)i;
+}
+
+__attribute__((noinline)) static int32_t legacy_dequeue(LegacyFifo* fifo, uint8_t* data, uint32_t size)
+{
+    uint32_t i = 0;
+    while (fifo->used_bytes > 0 && i < size)
+    {
+        data[i++] = fifo->data[fifo->read_index];
+        fifo->used_bytes--;
+        fifo->read_index++;
+        fifo->read_index %= fifo->capacity;
+    }
+
+    return (int32_t)i;
+}
+
+#define CAPACITY (500 * 1024) //SOCKET_BUFFER_SIZE
+#define BYTES_PER_CASE (256 * 1024 * 1024)
+
+#define MIN_SPAN(a, b) (((a) < (b)) ? (a) : (b))
+
+static double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fill_pattern(uint8_t* buffer, uint32_t size, uint32_t start)
+{
+    for (uint32_t i = 0; i < size; ++i)
+    {
+        buffer[i] = (uint8_t)(start + i);
+    }
+}
+
+static int check_pattern(uint8_t* buffer, uint32_t size, uint32_t start)
+{
+    for (uint32_t i = 0; i < size; ++i)
+    {
+        if (buffer[i] != (uint8_t)(start + i))
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+//Keeps a third of the buffer queued so the indexes keep wrapping
+static double run_fifo(uint32_t chunk, uint8_t* in, uint8_t* out)
+{
+    FifoBuffer* fifo = fifobuffer_create(CAPACITY);
+
+    uint32_t produced = 0;
+    while (produced < CAPACITY / 3)
+    {
+        produced += fifobuffer_enqueue(fifo, in, chunk);
+    }
+
+    double start = now_seconds();
+
+    uint64_t moved = 0;
+    while (moved < BYTES_PER_CASE)
+    {
+        fifobuffer_enqueue(fifo, in, chunk);
+
+        moved += fifobuffer_dequeue(fifo, out, chunk);
+    }
+
+    double elapsed = now_seconds() - start;
+
+    fifobuffer_destroy(fifo);
+
+    return moved / elapsed / (1024 * 1024);
+}
+
+static double run_legacy(uint32_t chunk, uint8_t* in, uint8_t* out)
+{
+    LegacyFifo fifo;
+    memset(&fifo, 0, sizeof(fifo));
+    fifo.data = malloc(CAPACITY);
+    fifo.capacity = CAPACITY;
+
+    uint32_t produced = 0;
+    while (produced < CAPACITY / 3)
+    {
+        produced += legacy_enqueue(&fifo, in, chunk);
+    }
+
+    double start = now_seconds();
+
+    uint64_t moved = 0;
+    while (moved < BYTES_PER_CASE)
+    {
+        legacy_enqueue(&fifo, in, chunk);
+
+        moved += legacy_dequeue(&fifo, out, chunk);
+    }
+
+    double elapsed = now_seconds() - start;
+
+    free(fifo.data);
+
+    return moved / elapsed / (1024 * 1024);
+}
+
+static double run_from_other(uint32_t chunk, uint8_t* in)
+{
+    FifoBuffer* source = fifobuffer_create(CAPACITY);
+    FifoBuffer* target = fifobuffer_create(CAPACITY);
+
+    double start = now_seconds();
+
+    uint64_t moved = 0;
+    while (moved < BYTES_PER_CASE)
+    {
+        fifobuffer_enqueue(source, in, chunk);
+
+        moved += fifobuffer_enqueue_from_other(target, source);
+
+        //Drain the target without copying
+        uint32_t span = 0;
+        fifobuffer_peek_readable(target, &span);
+        while (span > 0)
+        {
+            fifobuffer_commit_read(target, span);
+            fifobuffer_peek_readable(target, &span);
+        }
+    }
+
+    double elapsed = now_seconds() - start;
+
+    fifobuffer_destroy(source);
+    fifobuffer_destroy(target);
+
+    return moved / elapsed / (1024 * 1024);
+}
+
+//Pushes a counting stream through odd sized operations and checks it comes out in order
+static int verify()
+{
+    FifoBuffer* first = fifobuffer_create(1000);
+    FifoBuffer* second = fifobuffer_create(777);
+
+    uint8_t in[600];
+    uint8_t out[600];
+
+    uint32_t produced = 0;
+    uint32_t consumed = 0;
+
+    srand(1);
+
+    for (int round = 0; round < 100000; ++round)
+    {
+        uint32_t size = 1 + rand() % sizeof(in);
+
+        fill_pattern(in, size, produced);
+        produced += fifobuffer_enqueue(first, in, size);
+
+        fifobuffer_enqueue_from_other(second, first);
+
+        if (round % 2)
+        {
+            size = 1 + rand() % sizeof(out);
+
+            int32_t read = fifobuffer_dequeue(second, out, size);
+            if (!check_pattern(out, read, consumed))
+            {
+                return 0;
+            }
+            consumed += read;
+        }
+        else
+        {
+            uint32_t span = 0;
+            uint8_t* data = fifobuffer_peek_readable(second, &span);
+            uint32_t limit = rand() % 300;
+            span = MIN_SPAN(span, limit);
+            if (!check_pattern(data, span, consumed))
+            {
+                return 0;
+            }
+            fifobuffer_commit_read(second, span);
+            consumed += span;
+        }
+    }
+
+    fifobuffer_destroy(first);
+    fifobuffer_destroy(second);
+
+    return 1;
+}
+
+int main()
+{
+    const uint32_t chunks[] = {1, 16, 256, 4096, 65536};
+    const uint32_t chunk_count = sizeof(chunks) / sizeof(chunks[0]);
+
+    uint8_t* in = malloc(65536);
+    uint8_t* out = malloc(65536);
+
+    if (!verify())
+    {
+        printf("FAILED: data came out of order\n");
+        return 1;
+    }
+
+    printf("capacity %d bytes, %d MB per case\n", CAPACITY, BYTES_PER_CASE / (1024 * 1024));
+    printf("%-8s %12s %12s %12s\n", "chunk", "legacy MB/s", "fifo MB/s", "other MB/s");
+
+    for (uint32_t i = 0; i < chunk_count; ++i)
+    {
+        uint32_t chunk = chunks[i];
+
+        fill_pattern(in, chunk, 0);
+
+        double legacy = run_legacy(chunk, in, out);
+        double fifo = run_fifo(chunk, in, out);
+        double other = run_from_other(chunk, in);
+
+        printf("%-8u %12.1f %12.1f %12.1f\n", chunk, legacy, fifo, other);
+    }
+
+    free(in);
+    free(out);
+
+    return 0;
+}
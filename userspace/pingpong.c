@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+
+//Context switch latency: a byte bounces between two processes over a pair of pipes.
+//Every round trip is two blocking reads, so two switches between page directories.
+
+static long long now_microseconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int main(int argc, char** argv)
+{
+    int round_trips = 10000;
+
+    if (argc > 1)
+    {
+        sscanf(argv[1], "%d", &round_trips);
+    }
+
+    int ping[2];
+    int pong[2];
+
+    if (pipe(ping) < 0 || pipe(pong) < 0)
+    {
+        printf("pipe failed\n");
+        return 1;
+    }
+
+    pid_t child = fork();
+
+    if (child < 0)
+    {
+        printf("fork failed\n");
+        return 1;
+    }
+
+    char c = 0;
+
+    if (child == 0)
+    {
+        for (int i = 0; i < round_trips; ++i)
+        {
+            if (read(ping[0], &c, 1) != 1 || write(pong[1], &c, 1) != 1)
+            {
+                return 1;
+            }
+        }
+
+        return 0;
+    }
+
+    long long start = now_microseconds();
+
+    for (int i = 0; i < round_trips; ++i)
+    {
+        if (write(ping[1], &c, 1) != 1 || read(pong[0], &c, 1) != 1)
+        {
+            printf("round trip %d failed\n", i);
+            break;
+        }
+    }
+
+    long long elapsed = now_microseconds() - start;
+
+    waitpid(child, NULL, 0);
+
+    if (round_trips > 0)
+    {
+        printf("%d round trips in %lld us, %lld ns per switch\n", round_trips, elapsed, elapsed * 1000 / (round_trips * 2LL));
+    }
+
+    return 0;
+}
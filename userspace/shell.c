@@ -22,13 +22,27 @@ static void listDirectory(const char* path)
     }
 
 
-    FileSystemDirent dirEntry;
-    memset(&dirEntry, 0, sizeof(FileSystemDirent));
-
+    //Names come with their sizes in batches, no stat per entry
+    FileSystemDirentStat entries[16];
+    int count = 0;
     int index = 0;
-    while (soso_read_dir(fd, &dirEntry, index++) != -1)
+
+    while (1)
     {
-        char pathBuffer[128];
+        if (index == count)
+        {
+            count = soso_read_dir_stat(fd, entries, 16);
+            index = 0;
+
+            if (count <= 0)
+            {
+                break;
+            }
+        }
+
+        FileSystemDirent dirEntry = entries[index].dirent;
+        unsigned int size = entries[index].size;
+        ++index;
 
         if ((dirEntry.fileType & FT_MountPoint) == FT_MountPoint)
         {
@@ -63,18 +77,7 @@ static void listDirectory(const char* path)
             printf("*");
         }
 
-
-        sprintf(pathBuffer, "%s/%s", path, dirEntry.name);
-        struct stat s;
-        memset(&s, 0, sizeof(s));
-        if (stat(pathBuffer, &s) != -1)
-        {
-            printf(" %10u", (unsigned int)s.st_size);
-        }
-        else
-        {
-            printf(" %10s", "");
-        }
+        printf(" %10u", size);
 
         printf(" %s", dirEntry.name);
 